@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sanic_fs.h"
+#include "disk.h"
+
+#define BENCH_DISK "bench.fs"
+#define BENCH_SEED 325 // every run issues the same offsets
+#define BENCH_FILE_BYTES (16 << 20) // file size for the sequential and random workloads
+#define BENCH_RANDOM_OPS 4096 // requests per random workload
+#define BENCH_FILES 2048 // files for the churn and small file workloads
+#define BENCH_THREADS 4
+#define BENCH_DUP_FILES 8 // files sharing BENCH_FILE_BYTES in the dup workloads
+#define BENCH_TEMPLATES 16 // distinct blocks in the dup workloads' files
+#define BENCH_THREAD_BYTES (4 << 20) // private file size per thread in the mix
+
+/* Everything measured by one workload */
+typedef struct t_bench_result {
+  char* workload; // name printed in the first column
+  size_t size; // request size in bytes, 0 if not applicable
+  int threads; // threads issuing requests
+  long ops; // logical operations timed
+  size_t bytes; // payload bytes moved by those operations
+  double seconds; // wall time for all of them
+  long* latency; // nanoseconds taken by each operation
+  disk_stats io; // block I/O caused by them
+  double ratio; // bytes of file data per byte of blocks it takes on the disk
+} bench_result;
+
+/* Work for one thread of the mixed workload */
+typedef struct t_mix_job {
+  int fd; // descriptor of the thread's private file
+  unsigned int seed; // seed for its offsets and read/write choices
+  long* latency; // where to record its BENCH_RANDOM_OPS latencies
+  int failed; // set if any request failed
+} mix_job;
+
+/* Only workloads whose name starts with this run, if set */
+char* filter = NULL;
+
+/**
+ * @return  Current time of the monotonic clock in nanoseconds.
+ */
+long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int compare_long(const void* a, const void* b) {
+  long x = *(const long*) a;
+  long y = *(const long*) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @return  Latency at quantile (q) of (n) sorted samples, in microseconds.
+ */
+double percentile(long* sorted, long n, double q) {
+  long i = (long) (q * (n - 1) + 0.5);
+  return sorted[i] / 1e3;
+}
+
+/**
+ * Sets up (r) for a workload and allocates room for (ops) latencies.
+ */
+void result_init(bench_result* r, char* workload, size_t size, int threads,
+                 long ops) {
+  memset(r, 0, sizeof(*r));
+  r->workload = workload;
+  r->size = size;
+  r->threads = threads;
+  r->ops = ops;
+  r->latency = malloc(ops * sizeof(long));
+  r->ratio = 1;
+}
+
+/**
+ * Prints one comma-separated line for (r), the format announced by the header
+ * line in main, and frees its latencies.
+ */
+void report(bench_result* r) {
+  qsort(r->latency, r->ops, sizeof(long), compare_long);
+
+  printf("%s,%zu,%d,%ld,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f,%.2f\n",
+         r->workload, r->size, r->threads, r->ops, r->seconds,
+         r->ops / r->seconds, r->bytes / r->seconds / (1 << 20),
+         percentile(r->latency, r->ops, 0.5),
+         percentile(r->latency, r->ops, 0.99),
+         percentile(r->latency, r->ops, 0.999),
+         (double) r->io.reads / r->ops, (double) r->io.writes / r->ops,
+         r->ratio);
+  fflush(stdout);
+
+  free(r->latency);
+}
+
+/**
+ * Starts the clock and the block I/O counters for the timed part of (r).
+ */
+void measure_begin(bench_result* r) {
+  disk_reset_stats();
+  r->seconds = now_ns();
+}
+
+/**
+ * Stops the clock and the block I/O counters for the timed part of (r).
+ */
+void measure_end(bench_result* r) {
+  r->seconds = (now_ns() - r->seconds) / 1e9;
+  disk_get_stats(&r->io);
+}
+
+/**
+ * Formats and mounts a fresh disk, so every workload starts from the same
+ * state.
+ */
+int fresh_fs() {
+  if (make_fs(BENCH_DISK) || mount_fs(BENCH_DISK)) {
+    fprintf(stderr, "fresh_fs: Could not format %s.\n", BENCH_DISK);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Re-mounts the disk so reads start with an empty block cache.
+ */
+int remount_fs() {
+  if (umount_fs(BENCH_DISK) || mount_fs(BENCH_DISK)) {
+    fprintf(stderr, "remount_fs: Could not re-mount %s.\n", BENCH_DISK);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Creates (name) on the mounted disk and fills it with (nbytes) of data.
+ */
+int make_file(char* name, size_t nbytes) {
+  char* data = malloc(nbytes);
+  memset(data, 'b', nbytes);
+
+  int fd;
+  if (fs_create(name)
+      || (fd = fs_open(name)) == -1
+      || fs_write(fd, data, nbytes) != nbytes
+      || fs_close(fd)) {
+    fprintf(stderr, "make_file: Could not write %s.\n", name);
+    free(data);
+    return -1;
+  }
+
+  free(data);
+  return 0;
+}
+
+/**
+ * Writes (or, if (read), reads back) a file of BENCH_FILE_BYTES from start to
+ * end in requests of (size) bytes.
+ */
+int bench_sequential(int read, size_t size) {
+  bench_result r;
+  long ops = BENCH_FILE_BYTES / size;
+  result_init(&r, read ? "seq_read" : "seq_write", size, 1, ops);
+  char* buf = malloc(size);
+  memset(buf, 's', size);
+
+  int fd;
+  if (fresh_fs()
+      || (read && (make_file("seq", BENCH_FILE_BYTES) || remount_fs()))
+      || (!read && fs_create("seq"))
+      || (fd = fs_open("seq")) == -1) {
+    return -1;
+  }
+
+  measure_begin(&r);
+  long i;
+  for (i = 0; i < ops; i++) {
+    long t = now_ns();
+    int n = read ? fs_read(fd, buf, size) : fs_write(fd, buf, size);
+    r.latency[i] = now_ns() - t;
+
+    if (n != size) {
+      fprintf(stderr, "bench_sequential: Short transfer.\n");
+      return -1;
+    }
+    r.bytes += n;
+  }
+  measure_end(&r);
+
+  free(buf);
+  if (fs_close(fd) || umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Fills (text) with (nbytes) of log lines, which compress about as well as
+ * the text and logs the volume mostly holds.
+ */
+void make_text(char* text, size_t nbytes) {
+  static char* levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG" };
+  static char* paths[] = { "items", "users", "orders", "search" };
+  unsigned int seed = BENCH_SEED;
+  char line[160];
+
+  size_t done = 0;
+  long n;
+  for (n = 0; done < nbytes; n++) {
+    int len = snprintf(line, sizeof(line),
+                       "2026-10-17 12:%02ld:%02ld.%03d %s request id=%ld "
+                       "path=/api/v1/%s/%d status=%d bytes=%d\n",
+                       n / 60000 % 60, n / 1000 % 60, rand_r(&seed) % 1000,
+                       levels[rand_r(&seed) % 5], n, paths[rand_r(&seed) % 4],
+                       rand_r(&seed) % 100000,
+                       rand_r(&seed) % 8 ? 200 : 404, rand_r(&seed) % 65536);
+    if (len > nbytes - done) {
+      len = nbytes - done;
+    }
+    memcpy(text + done, line, len);
+    done += len;
+  }
+}
+
+/**
+ * Writes (or, if (read), reads back) BENCH_FILE_BYTES of log lines from start
+ * to end in requests of (size) bytes, in a plain file or, if (compress), a
+ * compressed one. Comparing the two shows what compression saves in space
+ * and costs in throughput.
+ */
+int bench_text(int read, int compress, size_t size) {
+  char* names[] = { "text_write", "text_write_lz",
+                    "text_read", "text_read_lz" };
+  bench_result r;
+  long ops = BENCH_FILE_BYTES / size;
+  result_init(&r, names[2 * read + compress], size, 1, ops);
+  char* text = malloc(BENCH_FILE_BYTES);
+  char* buf = malloc(size);
+  make_text(text, BENCH_FILE_BYTES);
+
+  int fd;
+  if (fresh_fs()) {
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+
+  if (fs_create("text")
+      || (fd = fs_open("text")) == -1
+      || (compress && fs_set_compressed(fd, 1))
+      || (read && (fs_write(fd, text, BENCH_FILE_BYTES) != BENCH_FILE_BYTES
+                   || fs_close(fd)
+                   || remount_fs()
+                   || (fd = fs_open("text")) == -1))) {
+    fprintf(stderr, "bench_text: Could not set up file.\n");
+    return -1;
+  }
+
+  measure_begin(&r);
+  long i;
+  for (i = 0; i < ops; i++) {
+    long t = now_ns();
+    int n = read ? fs_read(fd, buf, size) : fs_write(fd, text + i * size, size);
+    r.latency[i] = now_ns() - t;
+
+    if (n != size) {
+      fprintf(stderr, "bench_text: Short transfer.\n");
+      return -1;
+    }
+    r.bytes += n;
+  }
+  measure_end(&r);
+
+  if (read && memcmp(buf, text + BENCH_FILE_BYTES - size, size)) {
+    fprintf(stderr, "bench_text: Read back the wrong data.\n");
+    return -1;
+  }
+
+  free(buf);
+  free(text);
+  if (fs_close(fd)) {
+    return -1;
+  }
+  r.ratio = (double) BENCH_FILE_BYTES
+    / ((double) (free_start - fs_get_free_blocks()) * BLOCK_SIZE);
+  if (umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Fills (data) with (nbytes) of blocks, each of them zeros or a copy of one
+ * of BENCH_TEMPLATES templated records, like the fixed-layout records and
+ * preallocated regions that make up much of what the volume holds.
+ */
+void make_dup(char* data, size_t nbytes) {
+  unsigned int seed = BENCH_SEED;
+  char* templates = malloc((size_t) BENCH_TEMPLATES * BLOCK_SIZE);
+  int i;
+  for (i = 0; i < BENCH_TEMPLATES * BLOCK_SIZE; i++) {
+    templates[i] = rand_r(&seed);
+  }
+
+  size_t done;
+  for (done = 0; done < nbytes; done += BLOCK_SIZE) {
+    int t = rand_r(&seed) % (BENCH_TEMPLATES + 4);
+    if (t >= BENCH_TEMPLATES) {
+      memset(data + done, 0, BLOCK_SIZE);
+    } else {
+      memcpy(data + done, templates + (size_t) t * BLOCK_SIZE, BLOCK_SIZE);
+    }
+  }
+
+  free(templates);
+}
+
+/**
+ * Writes BENCH_DUP_FILES files that share BENCH_FILE_BYTES of duplicate
+ * blocks between them from start to end in requests of (size) bytes, with
+ * or without (dedup). Comparing the two shows what sharing blocks saves in
+ * space and block writes, and what hashing and comparing them costs.
+ */
+int bench_dup(int dedup, size_t size) {
+  bench_result r;
+  size_t file_bytes = BENCH_FILE_BYTES / BENCH_DUP_FILES;
+  long ops = BENCH_FILE_BYTES / size;
+  result_init(&r, dedup ? "dup_write_dedup" : "dup_write", size, 1, ops);
+  char* data = malloc(file_bytes);
+  make_dup(data, file_bytes);
+
+  if (fresh_fs()) {
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+  fs_set_dedup(dedup);
+
+  measure_begin(&r);
+  long i = 0;
+  int f;
+  for (f = 0; f < BENCH_DUP_FILES; f++) {
+    char name[MAX_FNAME];
+    snprintf(name, sizeof(name), "dup%d", f);
+
+    int fd;
+    if (fs_create(name) || (fd = fs_open(name)) == -1) {
+      fprintf(stderr, "bench_dup: Could not create %s.\n", name);
+      return -1;
+    }
+
+    size_t off;
+    for (off = 0; off < file_bytes; off += size) {
+      long t = now_ns();
+      int n = fs_write(fd, data + off, size);
+      r.latency[i++] = now_ns() - t;
+
+      if (n != size) {
+        fprintf(stderr, "bench_dup: Short transfer.\n");
+        return -1;
+      }
+      r.bytes += n;
+    }
+
+    if (fs_close(fd)) {
+      return -1;
+    }
+  }
+  measure_end(&r);
+
+  free(data);
+  r.ratio = (double) BENCH_FILE_BYTES
+    / ((double) (free_start - fs_get_free_blocks()) * BLOCK_SIZE);
+  fs_set_dedup(0);
+  if (umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Reads (or, unless (read), overwrites) BENCH_RANDOM_OPS requests of (size)
+ * bytes at random aligned offsets of a file of BENCH_FILE_BYTES.
+ */
+int bench_random(int read, size_t size) {
+  bench_result r;
+  result_init(&r, read ? "rand_read" : "rand_write", size, 1,
+              BENCH_RANDOM_OPS);
+  char* buf = malloc(size);
+  memset(buf, 'r', size);
+  unsigned int seed = BENCH_SEED;
+
+  int fd;
+  if (fresh_fs()
+      || make_file("rand", BENCH_FILE_BYTES)
+      || remount_fs()
+      || (fd = fs_open("rand")) == -1) {
+    return -1;
+  }
+
+  measure_begin(&r);
+  long i;
+  for (i = 0; i < r.ops; i++) {
+    off_t offset = (off_t) (rand_r(&seed) % (BENCH_FILE_BYTES / size)) * size;
+
+    long t = now_ns();
+    int n = read ? fs_pread(fd, buf, size, offset)
+                 : fs_pwrite(fd, buf, size, offset);
+    r.latency[i] = now_ns() - t;
+
+    if (n != size) {
+      fprintf(stderr, "bench_random: Short transfer.\n");
+      return -1;
+    }
+    r.bytes += n;
+  }
+  measure_end(&r);
+
+  free(buf);
+  if (fs_close(fd) || umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Creates, opens, writes one block to, closes and deletes a file, over and
+ * over; each round is one operation.
+ */
+int bench_churn() {
+  bench_result r;
+  result_init(&r, "create_delete", BLOCK_SIZE, 1, BENCH_FILES);
+  char buf[BLOCK_SIZE];
+  memset(buf, 'c', BLOCK_SIZE);
+
+  if (fresh_fs()) {
+    return -1;
+  }
+
+  measure_begin(&r);
+  long i;
+  for (i = 0; i < r.ops; i++) {
+    long t = now_ns();
+    int fd;
+    if (fs_create("churn")
+        || (fd = fs_open("churn")) == -1
+        || fs_write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE
+        || fs_close(fd)
+        || fs_delete("churn")) {
+      fprintf(stderr, "bench_churn: Round failed.\n");
+      return -1;
+    }
+    r.latency[i] = now_ns() - t;
+    r.bytes += BLOCK_SIZE;
+  }
+  measure_end(&r);
+
+  if (umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Grows a file to 1 MB and truncates it back to nothing, over and over; only
+ * the truncations are timed.
+ */
+int bench_truncate() {
+  size_t grow = 1 << 20;
+  bench_result r;
+  result_init(&r, "truncate", grow, 1, 256);
+  char* buf = malloc(grow);
+  memset(buf, 't', grow);
+
+  int fd;
+  if (fresh_fs()
+      || fs_create("trunc")
+      || (fd = fs_open("trunc")) == -1) {
+    return -1;
+  }
+
+  long spent = 0;
+  disk_stats total;
+  memset(&total, 0, sizeof(total));
+
+  long i;
+  for (i = 0; i < r.ops; i++) {
+    if (fs_lseek(fd, 0) || fs_write(fd, buf, grow) != grow) {
+      fprintf(stderr, "bench_truncate: Write failed.\n");
+      return -1;
+    }
+
+    measure_begin(&r);
+    long t = now_ns();
+    int failed = fs_truncate(fd, 0);
+    r.latency[i] = now_ns() - t;
+    measure_end(&r);
+
+    if (failed) {
+      fprintf(stderr, "bench_truncate: Truncate failed.\n");
+      return -1;
+    }
+    spent += r.latency[i];
+    total.reads += r.io.reads;
+    total.writes += r.io.writes;
+  }
+  r.seconds = spent / 1e9;
+  r.io = total;
+
+  free(buf);
+  if (fs_close(fd) || umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * Creates BENCH_FILES files of 1 KB each, then reads every one back; each file
+ * written or read is one operation of the respective workload.
+ */
+int bench_small_files() {
+  size_t size = 1024;
+  char buf[1024];
+  memset(buf, 'f', size);
+  char name[32];
+
+  if (fresh_fs()) {
+    return -1;
+  }
+
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    bench_result r;
+    result_init(&r, pass ? "small_read" : "small_create", size, 1,
+                BENCH_FILES);
+
+    if (pass && remount_fs()) {
+      return -1;
+    }
+
+    measure_begin(&r);
+    long i;
+    for (i = 0; i < r.ops; i++) {
+      snprintf(name, sizeof(name), "small%ld", i);
+
+      long t = now_ns();
+      int fd;
+      if ((!pass && fs_create(name))
+          || (fd = fs_open(name)) == -1
+          || (pass ? fs_read(fd, buf, size) : fs_write(fd, buf, size)) != size
+          || fs_close(fd)) {
+        fprintf(stderr, "bench_small_files: File %s failed.\n", name);
+        return -1;
+      }
+      r.latency[i] = now_ns() - t;
+      r.bytes += size;
+    }
+    measure_end(&r);
+
+    report(&r);
+  }
+
+  if (umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Issues BENCH_RANDOM_OPS block-sized requests at random offsets of one
+ * thread's file, three reads for every write.
+ */
+void* mix_worker(void* arg) {
+  mix_job* job = arg;
+  char buf[BLOCK_SIZE];
+  memset(buf, 'm', BLOCK_SIZE);
+
+  long i;
+  for (i = 0; i < BENCH_RANDOM_OPS; i++) {
+    int write = rand_r(&job->seed) % 4 == 0;
+    off_t offset = (off_t) (rand_r(&job->seed)
+                            % (BENCH_THREAD_BYTES / BLOCK_SIZE)) * BLOCK_SIZE;
+
+    long t = now_ns();
+    int n = write ? fs_pwrite(job->fd, buf, BLOCK_SIZE, offset)
+                  : fs_pread(job->fd, buf, BLOCK_SIZE, offset);
+    job->latency[i] = now_ns() - t;
+
+    if (n != BLOCK_SIZE) {
+      job->failed = 1;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Runs mix_worker on (threads) threads at once, each on its own file.
+ */
+int bench_mix(int threads) {
+  bench_result r;
+  result_init(&r, "mt_mix", BLOCK_SIZE, threads,
+              (long) threads * BENCH_RANDOM_OPS);
+  pthread_t workers[BENCH_THREADS];
+  mix_job jobs[BENCH_THREADS];
+  char name[MAX_FNAME];
+
+  if (fresh_fs()) {
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < threads; i++) {
+    snprintf(name, MAX_FNAME, "mix%d", i);
+    if (make_file(name, BENCH_THREAD_BYTES)) {
+      return -1;
+    }
+  }
+  if (remount_fs()) {
+    return -1;
+  }
+
+  for (i = 0; i < threads; i++) {
+    snprintf(name, MAX_FNAME, "mix%d", i);
+    jobs[i].fd = fs_open(name);
+    jobs[i].seed = BENCH_SEED + i;
+    jobs[i].latency = r.latency + (long) i * BENCH_RANDOM_OPS;
+    jobs[i].failed = jobs[i].fd == -1;
+  }
+
+  measure_begin(&r);
+  for (i = 0; i < threads; i++) {
+    pthread_create(&workers[i], NULL, mix_worker, &jobs[i]);
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  measure_end(&r);
+
+  for (i = 0; i < threads; i++) {
+    if (jobs[i].failed || fs_close(jobs[i].fd)) {
+      fprintf(stderr, "bench_mix: Thread %d failed.\n", i);
+      return -1;
+    }
+  }
+  r.bytes = (size_t) r.ops * BLOCK_SIZE;
+
+  if (umount_fs(BENCH_DISK)) {
+    return -1;
+  }
+
+  report(&r);
+  return 0;
+}
+
+/**
+ * @return  Nonzero if the workload (name) was selected on the command line.
+ */
+int selected(char* name) {
+  return filter == NULL || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+/**
+ * Runs every workload, or those whose name starts with the first argument, and
+ * prints one comma-separated line of results per workload and request size.
+ */
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    filter = argv[1];
+  }
+
+  size_t sizes[] = { 512, BLOCK_SIZE, 64 * 1024 };
+  int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  int failed = 0;
+
+  printf("workload,size,threads,ops,seconds,ops_per_s,mb_per_s,"
+         "p50_us,p99_us,p999_us,reads_per_op,writes_per_op,space_ratio\n");
+
+  int i;
+  for (i = 0; i < nsizes; i++) {
+    if (selected("seq_write")) {
+      failed |= bench_sequential(0, sizes[i]);
+    }
+    if (selected("seq_read")) {
+      failed |= bench_sequential(1, sizes[i]);
+    }
+  }
+  for (i = 0; i < nsizes; i++) {
+    int compress;
+    for (compress = 0; compress < 2; compress++) {
+      if (selected(compress ? "text_write_lz" : "text_write")) {
+        failed |= bench_text(0, compress, sizes[i]);
+      }
+      if (selected(compress ? "text_read_lz" : "text_read")) {
+        failed |= bench_text(1, compress, sizes[i]);
+      }
+    }
+  }
+  for (i = 0; i < nsizes; i++) {
+    int dedup;
+    for (dedup = 0; dedup < 2; dedup++) {
+      if (selected(dedup ? "dup_write_dedup" : "dup_write")) {
+        failed |= bench_dup(dedup, sizes[i]);
+      }
+    }
+  }
+  for (i = 0; i < nsizes; i++) {
+    if (selected("rand_write")) {
+      failed |= bench_random(0, sizes[i]);
+    }
+    if (selected("rand_read")) {
+      failed |= bench_random(1, sizes[i]);
+    }
+  }
+  if (selected("create_delete")) {
+    failed |= bench_churn();
+  }
+  if (selected("truncate")) {
+    failed |= bench_truncate();
+  }
+  if (selected("small_create") || selected("small_read")) {
+    failed |= bench_small_files();
+  }
+  if (selected("mt_mix")) {
+    failed |= bench_mix(1);
+    failed |= bench_mix(BENCH_THREADS);
+  }
+
+  unlink(BENCH_DISK);
+  return failed ? 1 : 0;
+}
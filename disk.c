@@ -1,20 +1,183 @@
+#define _GNU_SOURCE     /* fallocate */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/falloc.h>
+
+#undef BLOCK_SIZE       /* <linux/fs.h>, via io_uring.h, defines its own */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024    /* Linux limit on iovecs per preadv/pwritev call */
+#endif
+
+#define CACHE_SHARDS    16  /* most shards the block cache is split into  */
+#define CACHE_SHARD_MIN  8  /* fewest slots a shard is given              */
+
+#define SLOT_READING 1  /* slot being read in: its contents aren't valid yet */
+#define SLOT_WRITING 2  /* slot being written out: its contents are stable */
 
 #include "disk.h"
 
 /******************************************************************************/
+int disk_blocks = DEFAULT_DISK_BLOCKS;
+int block_size = DEFAULT_BLOCK_SIZE;
+int block_shift = 12;
+
+/* Serialises every thread's use of the io_uring instance. The block cache has
+ * a lock per shard instead (see below), and neither kind is held across a
+ * transfer to or from the disk file. open_disk, close_disk and
+ * disk_cache_size on an open disk must not race with any other call. */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int active = 0;  /* is the virtual disk open (active) */
 static int handle;      /* file handle to virtual disk       */
 
+static int backend = DISK_BACKEND_FD;  /* backend for the next open_disk */
+static int format = DISK_FORMAT_SPARSE; /* how make_disk lays out the file */
+static int discard_broken;  /* the file system can't punch holes     */
+static char *mapping;   /* whole disk image, when memory-mapped  */
+
+/* io_uring instance, when the io_uring backend is active */
+static int ring_fd = -1;
+static void *sq_ring, *cq_ring;        /* mapped ring buffers           */
+static size_t sq_ring_size, cq_ring_size;
+static struct io_uring_sqe *sqes;      /* submission queue entries      */
+static size_t sqes_size;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static int ring_queued;   /* entries filled in but not yet submitted     */
+static int ring_inflight; /* entries submitted but not yet completed     */
+
+/* Each thread waits for its own async requests only; ring completions carry
+ * the address of the batch they belong to, so any thread can reap them */
+typedef struct t_async_batch {
+  int outstanding;      /* requests queued but not yet completed      */
+  int failed;           /* a request failed since the last block_wait */
+} async_batch;
+
+static __thread async_batch batch;
+
+/* Requests queued with block_*_async on backends without a ring; they are
+ * carried out as vectored transfers by block_poll/block_wait */
+static __thread int pend_block[IOV_MAX];
+static __thread char *pend_buf[IOV_MAX];
+static __thread char pend_write[IOV_MAX];
+static __thread int pend_count;
+
+/* Write-back block cache, split into shards by block number so that threads
+ * working on different blocks rarely wait for each other. Each shard keeps
+ * its own range of slots in least-recently-used order under its own mutex.
+ * A slot is marked busy while its block is read in or written out with the
+ * shard unlocked; it stays mapped meanwhile, so nobody reads the block from
+ * the disk file behind its back, and anyone who needs it waits on (idle). */
+typedef struct t_cache_slot {
+  int block;            /* disk block held by this slot, -1 if unused */
+  int dirty;            /* slot differs from the disk file            */
+  int prefetched;       /* loaded by block_prefetch, not yet used     */
+  int busy;             /* SLOT_READING, SLOT_WRITING or 0            */
+  int prev, next;       /* neighbours in LRU list (-1 terminates)     */
+} cache_slot;
+
+typedef struct t_cache_shard {
+  pthread_mutex_t lock; /* guards the shard's slots and their slot_of  */
+  pthread_cond_t idle;  /* broadcast whenever a busy slot goes idle    */
+  int first;            /* first slot of the shard                     */
+  int capacity;         /* slots in the shard                          */
+  int used;             /* slots handed out since the cache opened     */
+  int lru_head;         /* most recently used slot                     */
+  int lru_tail;         /* least recently used slot                    */
+} __attribute__((aligned(64))) cache_shard;
+
+static int cache_capacity = DISK_CACHE_BLOCKS;
+static cache_slot *slots;    /* cache_capacity slot headers            */
+static char *slot_data;      /* cache_capacity blocks of cached data   */
+static int *slot_of;         /* slot caching each block, or -1         */
+static cache_shard shards[CACHE_SHARDS];
+static int shard_count = 1;  /* shards in use, a power of two          */
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static disk_stats stats;
+
+/* counters are bumped from unlocked paths too */
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* block reads and writes issued by the calling thread, so the file system can
+ * tell which of its calls caused them */
+static __thread unsigned long thread_reads, thread_writes;
+#define IO_ADD(field, n) (STAT_ADD(field, n), thread_##field += (n))
+
+/* time spent in the synchronous block calls is added to the stats unless
+ * turned off at run time, or compiled out with -DFS_NO_STATS */
+static int timing = 1;
+/* block access trace: a ring of trace_capacity records, of which record
+ * (n % trace_capacity) is the n-th one logged; NULL while not tracing */
+static disk_trace_record *trace_ring;
+static unsigned long trace_capacity;
+static unsigned long trace_next;
+static __thread int trace_tag;
+
+/* log every block of a call, unless tracing is off */
+#define TRACE(kind, count, blocks) \
+  do { if (trace_ring) trace(kind, count, blocks); } while (0)
+
+#ifdef FS_NO_STATS
+#define TIMER_START() 0L
+#define TIMER_STOP(field, t) ((void) (t))
+#else
+#define TIMER_START() (timing ? now_ns() : 0L)
+#define TIMER_STOP(field, t) do { if (t) STAT_ADD(field, now_ns() - (t)); } while (0)
+#endif
+
+static void shards_init();
+static cache_shard *shard_of(int block);
+static int cache_open();
+static int cache_close();
+static int cache_flush();
+static int cache_release(int count, int *blocks, int *taken, int written);
+static int cache_slot_for(cache_shard *shard, int block, int load);
+static int cache_victim(cache_shard *shard);
+static int cache_lock_idle(int block);
+static int cache_lookup(int block, char *buf);
+static void lru_remove(cache_shard *shard, int slot);
+static void lru_park(cache_shard *shard, int slot);
+static void lru_push(cache_shard *shard, int slot);
+static void cache_hit(int slot);
+static long now_ns();
+static void trace(int kind, int count, int *blocks);
+static int replay_group(int kind, int count, int *blocks, char **rbufs,
+                        char **wbufs, int *queued);
+static int write_block(int block, char *buf);
+static int read_block(int block, char *buf);
+static int write_blocks(int count, int *blocks, char **bufs);
+static int read_blocks(int count, int *blocks, char **bufs);
+static int raw_read(int block, char *buf);
+static int raw_write(int block, char *buf);
+static int raw_rwv(int write, int count, int *blocks, char **bufs);
+static int ring_open(int f);
+static void ring_close();
+static int ring_queue(int write, int block, char *buf);
+static int ring_submit();
+static void ring_reap();
+static int pend_queue(int write, int block, char *buf);
+static int pend_run();
+
 /******************************************************************************/
 int make_disk(char *name)
 { 
   int f, cnt;
-  char buf[BLOCK_SIZE];
+  char buf[MAX_BLOCK_SIZE];
 
   if (!name) {
     fprintf(stderr, "make_disk: invalid file name\n");
@@ -26,6 +189,23 @@ int make_disk(char *name)
     return -1;
   }
 
+  if (format == DISK_FORMAT_ALLOCATE
+      && fallocate(f, 0, 0, (off_t) DISK_BLOCKS * BLOCK_SIZE) == 0) {
+    close(f);
+    return 0;
+  }
+
+  /* a sparse file reads back as zeros, just like a written one */
+  if (format != DISK_FORMAT_ZERO) {
+    if (ftruncate(f, (off_t) DISK_BLOCKS * BLOCK_SIZE) < 0) {
+      perror("make_disk: cannot size file");
+      close(f);
+      return -1;
+    }
+    close(f);
+    return 0;
+  }
+
   memset(buf, 0, BLOCK_SIZE);
   for (cnt = 0; cnt < DISK_BLOCKS; ++cnt)
     write(f, buf, BLOCK_SIZE);
@@ -54,28 +234,102 @@ int open_disk(char *name)
     return -1;
   }
 
+  if (backend == DISK_BACKEND_MMAP) {
+    struct stat st;
+
+    /* touching a page past the end of the file would raise SIGBUS */
+    if (fstat(f, &st) < 0 || st.st_size < (off_t) DISK_BLOCKS * BLOCK_SIZE) {
+      fprintf(stderr, "open_disk: file too small to map\n");
+      close(f);
+      return -1;
+    }
+
+    mapping = mmap(NULL, (size_t) DISK_BLOCKS * BLOCK_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (mapping == MAP_FAILED) {
+      perror("open_disk: cannot map file");
+      mapping = NULL;
+      close(f);
+      return -1;
+    }
+  }
+
+  if (backend == DISK_BACKEND_URING && ring_open(f) < 0)
+    fprintf(stderr, "open_disk: io_uring unavailable, using plain I/O\n");
+
   handle = f;
   active = 1;
+  discard_broken = 0;
+
+  if (!(slot_of = malloc(DISK_BLOCKS * sizeof(int))) || cache_open() < 0) {
+    free(slot_of);
+    slot_of = NULL;
+    close(handle);
+    active = handle = 0;
+    return -1;
+  }
 
   return 0;
 }
 
 int close_disk()
 {
+  int ret = 0;
+
   if (!active) {
     fprintf(stderr, "close_disk: no open disk\n");
     return -1;
   }
+
+  /* the disk is closed either way, but data that didn't make it out is
+   * reported, so callers never take a lost write for success */
+  if (block_wait() < 0) {
+    fprintf(stderr, "close_disk: queued request failed\n");
+    ret = -1;
+  }
+
+  if (cache_close() < 0) {
+    fprintf(stderr, "close_disk: failed to write back block cache\n");
+    ret = -1;
+  }
+
+  ring_close();
+
+  if (mapping) {
+    if (msync(mapping, (size_t) DISK_BLOCKS * BLOCK_SIZE, MS_SYNC) < 0) {
+      perror("close_disk: failed to sync mapping");
+      ret = -1;
+    }
+    munmap(mapping, (size_t) DISK_BLOCKS * BLOCK_SIZE);
+    mapping = NULL;
+  }
   
-  close(handle);
+  if (close(handle) < 0) {
+    perror("close_disk: failed to close file");
+    ret = -1;
+  }
+  free(slot_of);
+  slot_of = NULL;
 
   active = handle = 0;
 
-  return 0;
+  return ret;
 }
 
 int block_write(int block, char *buf)
 {
+  long t = TIMER_START();
+  int ret = write_block(block, buf);
+
+  TIMER_STOP(write_ns, t);
+  return ret;
+}
+
+static int write_block(int block, char *buf)
+{
+  cache_shard *shard;
+  int slot;
+
   if (!active) {
     fprintf(stderr, "block_write: disk not active\n");
     return -1;
@@ -86,21 +340,49 @@ int block_write(int block, char *buf)
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_write: failed to lseek");
-    return -1;
+  IO_ADD(writes, 1);
+  TRACE(DISK_TRACE_WRITE, 1, &block);
+
+  if (mapping) {
+    memcpy(mapping + (size_t) block * BLOCK_SIZE, buf, BLOCK_SIZE);
+    return 0;
   }
 
-  if (write(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_write: failed to write");
-    return -1;
+  if (!cache_capacity)
+    return raw_write(block, buf);
+
+  shard = shard_of(block);
+  pthread_mutex_lock(&shard->lock);
+
+  /* the whole block is replaced, so a missing slot needn't be loaded first;
+   * with none to spare, the write goes straight through */
+  if ((slot = cache_slot_for(shard, block, 0)) < 0) {
+    pthread_mutex_unlock(&shard->lock);
+    return raw_write(block, buf);
   }
 
+  memcpy(slot_data + slot * BLOCK_SIZE, buf, BLOCK_SIZE);
+  slots[slot].dirty = 1;
+
+  pthread_mutex_unlock(&shard->lock);
+
   return 0;
 }
 
 int block_read(int block, char *buf)
 {
+  long t = TIMER_START();
+  int ret = read_block(block, buf);
+
+  TIMER_STOP(read_ns, t);
+  return ret;
+}
+
+static int read_block(int block, char *buf)
+{
+  cache_shard *shard;
+  int slot;
+
   if (!active) {
     fprintf(stderr, "block_read: disk not active\n");
     return -1;
@@ -111,15 +393,1424 @@ int block_read(int block, char *buf)
     return -1;
   }
 
-  if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-    perror("block_read: failed to lseek");
+  IO_ADD(reads, 1);
+  TRACE(DISK_TRACE_READ, 1, &block);
+
+  if (mapping) {
+    memcpy(buf, mapping + (size_t) block * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+  }
+
+  if (!cache_capacity)
+    return raw_read(block, buf);
+
+  shard = shard_of(block);
+  pthread_mutex_lock(&shard->lock);
+
+  /* with no slot to spare, or if loading failed, read around the cache */
+  if ((slot = cache_slot_for(shard, block, 1)) < 0) {
+    pthread_mutex_unlock(&shard->lock);
+    return raw_read(block, buf);
+  }
+
+  memcpy(buf, slot_data + slot * BLOCK_SIZE, BLOCK_SIZE);
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return 0;
+}
+
+int block_writev(int count, int *blocks, char **bufs)
+{
+  long t = TIMER_START();
+  int ret = write_blocks(count, blocks, bufs);
+
+  TIMER_STOP(write_ns, t);
+  return ret;
+}
+
+static int write_blocks(int count, int *blocks, char **bufs)
+{
+  int i, slot;
+
+  if (!active) {
+    fprintf(stderr, "block_writev: disk not active\n");
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if ((blocks[i] < 0) || (blocks[i] >= DISK_BLOCKS)) {
+      fprintf(stderr, "block_writev: block index out of bounds\n");
+      return -1;
+    }
+  }
+
+  IO_ADD(writes, count);
+  TRACE(DISK_TRACE_WRITE, count, blocks);
+
+  if (mapping) {
+    for (i = 0; i < count; ++i)
+      memcpy(mapping + (size_t) blocks[i] * BLOCK_SIZE, bufs[i], BLOCK_SIZE);
+    return 0;
+  }
+
+  /* vectored writes go straight through; cached copies are brought up to
+   * date first, and marked clean so that an eviction racing with the write
+   * can't put the old contents back */
+  if (cache_capacity) {
+    for (i = 0; i < count; ++i) {
+      if ((slot = cache_lock_idle(blocks[i])) >= 0) {
+        memcpy(slot_data + slot * BLOCK_SIZE, bufs[i], BLOCK_SIZE);
+        slots[slot].dirty = 0;
+      }
+      pthread_mutex_unlock(&shard_of(blocks[i])->lock);
+    }
+  }
+
+  return raw_rwv(1, count, blocks, bufs);
+}
+
+int block_readv(int count, int *blocks, char **bufs)
+{
+  long t = TIMER_START();
+  int ret = read_blocks(count, blocks, bufs);
+
+  TIMER_STOP(read_ns, t);
+  return ret;
+}
+
+static int read_blocks(int count, int *blocks, char **bufs)
+{
+  int i, n;
+  int want[IOV_MAX];
+  char *into[IOV_MAX];
+
+  if (!active) {
+    fprintf(stderr, "block_readv: disk not active\n");
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if ((blocks[i] < 0) || (blocks[i] >= DISK_BLOCKS)) {
+      fprintf(stderr, "block_readv: block index out of bounds\n");
+      return -1;
+    }
+  }
+
+  IO_ADD(reads, count);
+  TRACE(DISK_TRACE_READ, count, blocks);
+
+  if (mapping) {
+    for (i = 0; i < count; ++i)
+      memcpy(bufs[i], mapping + (size_t) blocks[i] * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+  }
+
+  if (!cache_capacity)
+    return raw_rwv(0, count, blocks, bufs);
+
+  /* cached blocks are copied out; uncached ones are gathered and read with
+   * as few calls as their runs allow, without displacing what is already in
+   * the cache, and without any shard locked meanwhile */
+  for (i = n = 0; i < count; ++i) {
+    if (cache_lookup(blocks[i], bufs[i]) < 0) {
+      want[n] = blocks[i];
+      into[n++] = bufs[i];
+    }
+
+    if (n > 0 && (n == IOV_MAX || i == count - 1)) {
+      STAT_ADD(misses, n);
+      if (raw_rwv(0, n, want, into) < 0)
+        return -1;
+      n = 0;
+    }
+  }
+
+  return 0;
+}
+
+/******************************************************************************/
+int disk_cache_size(int blocks)
+{
+  if (blocks < 0) {
+    fprintf(stderr, "disk_cache_size: invalid cache size\n");
     return -1;
   }
 
-  if (read(handle, buf, BLOCK_SIZE) < 0) {
-    perror("block_read: failed to read");
+  /* resizing an open disk writes back and drops everything cached so far */
+  if (active && cache_close() < 0)
+    return -1;
+
+  cache_capacity = blocks;
+
+  if (active && cache_open() < 0)
+    return -1;
+
+  return 0;
+}
+
+int disk_flush()
+{
+  if (!active) {
+    fprintf(stderr, "disk_flush: disk not active\n");
     return -1;
   }
 
+  if (mapping) {
+    if (msync(mapping, (size_t) DISK_BLOCKS * BLOCK_SIZE, MS_SYNC) < 0) {
+      perror("disk_flush: failed to sync mapping");
+      return -1;
+    }
+    return 0;
+  }
+
+  return cache_flush();
+}
+
+int disk_sync()
+{
+  if (disk_flush() < 0)
+    return -1;
+
+  /* a mapped disk was synced by disk_flush already */
+  if (!mapping && fdatasync(handle) < 0) {
+    perror("disk_sync: failed to sync disk");
+    return -1;
+  }
+
+  STAT_ADD(syncs, 1);
+  return 0;
+}
+
+int block_write_async(int block, char *buf)
+{
+  int slot, ret;
+
+  if (!active) {
+    fprintf(stderr, "block_write_async: disk not active\n");
+    return -1;
+  }
+
+  if ((block < 0) || (block >= DISK_BLOCKS)) {
+    fprintf(stderr, "block_write_async: block index out of bounds\n");
+    return -1;
+  }
+
+  if (ring_fd < 0)
+    return pend_queue(1, block, buf);
+
+  IO_ADD(writes, 1);
+  TRACE(DISK_TRACE_WRITE_ASYNC, 1, &block);
+
+  /* like block_writev, the write goes through and the cached copy follows */
+  if (cache_capacity) {
+    if ((slot = cache_lock_idle(block)) >= 0) {
+      memcpy(slot_data + slot * BLOCK_SIZE, buf, BLOCK_SIZE);
+      slots[slot].dirty = 0;
+    }
+    pthread_mutex_unlock(&shard_of(block)->lock);
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  ret = ring_queue(1, block, buf);
+  pthread_mutex_unlock(&ring_lock);
+
+  return ret;
+}
+
+int block_read_async(int block, char *buf)
+{
+  int ret;
+
+  if (!active) {
+    fprintf(stderr, "block_read_async: disk not active\n");
+    return -1;
+  }
+
+  if ((block < 0) || (block >= DISK_BLOCKS)) {
+    fprintf(stderr, "block_read_async: block index out of bounds\n");
+    return -1;
+  }
+
+  if (ring_fd < 0)
+    return pend_queue(0, block, buf);
+
+  IO_ADD(reads, 1);
+  TRACE(DISK_TRACE_READ_ASYNC, 1, &block);
+
+  /* cached blocks complete on the spot */
+  if (cache_capacity) {
+    if (cache_lookup(block, buf) == 0)
+      return 0;
+    STAT_ADD(misses, 1);
+  }
+
+  pthread_mutex_lock(&ring_lock);
+  ret = ring_queue(0, block, buf);
+  pthread_mutex_unlock(&ring_lock);
+
+  return ret;
+}
+
+int block_poll()
+{
+  int ret;
+
+  if (!active) {
+    fprintf(stderr, "block_poll: disk not active\n");
+    return -1;
+  }
+
+  if (ring_fd < 0)
+    return pend_run();
+
+  pthread_mutex_lock(&ring_lock);
+  ret = ring_submit();
+  ring_reap();
+  pthread_mutex_unlock(&ring_lock);
+
+  return ret < 0 ? -1 : batch.outstanding;
+}
+
+int block_wait()
+{
+  int failed;
+
+  if (!active) {
+    fprintf(stderr, "block_wait: disk not active\n");
+    return -1;
+  }
+
+  if (ring_fd < 0) {
+    pend_run();
+  } else {
+    /* the lock is held while waiting in the kernel, so whichever thread is
+     * waiting reaps every completion and none can be missed by another */
+    pthread_mutex_lock(&ring_lock);
+    if (ring_submit() < 0)
+      batch.failed = 1;
+
+    while (batch.outstanding > 0) {
+      if (syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        perror("block_wait: failed to wait for completions");
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+      }
+      ring_reap();
+    }
+    pthread_mutex_unlock(&ring_lock);
+  }
+
+  failed = batch.failed;
+  batch.failed = 0;
+
+  return failed ? -1 : 0;
+}
+
+int block_prefetch(int count, int *blocks)
+{
+  int i, n, slot, ret;
+  int want[IOV_MAX], taken[IOV_MAX];
+  char *bufs[IOV_MAX];
+  cache_shard *shard;
+
+  if (!active) {
+    fprintf(stderr, "block_prefetch: disk not active\n");
+    return -1;
+  }
+
+  for (i = 0; i < count; ++i) {
+    if ((blocks[i] < 0) || (blocks[i] >= DISK_BLOCKS)) {
+      fprintf(stderr, "block_prefetch: block index out of bounds\n");
+      return -1;
+    }
+  }
+
+  TRACE(DISK_TRACE_PREFETCH, count, blocks);
+
+  /* a mapped disk leaves it to the kernel, one run of blocks at a time */
+  if (mapping) {
+    for (i = 0; i < count; i += n) {
+      for (n = 1; i + n < count && blocks[i + n] == blocks[i] + n; ++n)
+        ;
+      madvise(mapping + (size_t) blocks[i] * BLOCK_SIZE,
+              (size_t) n * BLOCK_SIZE, MADV_WILLNEED);
+    }
+    STAT_ADD(prefetches, count);
+    return 0;
+  }
+
+  /* never let readahead push out more than half of the cache */
+  if (count > cache_capacity / 2)
+    count = cache_capacity / 2;
+  if (count > IOV_MAX)
+    count = IOV_MAX;
+
+  /* claim a slot for every block not cached yet, marked as being read in,
+   * then fill them in one go with no shard locked */
+  for (i = n = 0; i < count; ++i) {
+    shard = shard_of(blocks[i]);
+    pthread_mutex_lock(&shard->lock);
+
+    if (slot_of[blocks[i]] < 0 && (slot = cache_victim(shard)) >= 0) {
+      /* a write-back may have let another thread cache the block */
+      if (slot_of[blocks[i]] >= 0) {
+        lru_park(shard, slot);
+      } else {
+        slots[slot].block = blocks[i];
+        slots[slot].busy = SLOT_READING;
+        slot_of[blocks[i]] = slot;
+        want[n] = blocks[i];
+        taken[n] = slot;
+        bufs[n++] = slot_data + slot * BLOCK_SIZE;
+      }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  ret = n > 0 ? raw_rwv(0, n, want, bufs) : 0;
+
+  for (i = 0; i < n; ++i) {
+    shard = shard_of(want[i]);
+    pthread_mutex_lock(&shard->lock);
+    slots[taken[i]].busy = 0;
+    if (ret < 0) {
+      slot_of[want[i]] = -1;
+      slots[taken[i]].block = -1;
+      lru_park(shard, taken[i]);
+    } else {
+      slots[taken[i]].prefetched = 1;
+      lru_push(shard, taken[i]);
+    }
+    pthread_cond_broadcast(&shard->idle);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  if (ret < 0)
+    return -1;
+
+  STAT_ADD(prefetches, n);
+
+  return 0;
+}
+
+int block_discard(int block, int count)
+{
+  int i, slot;
+
+  if (!active) {
+    fprintf(stderr, "block_discard: disk not active\n");
+    return -1;
+  }
+
+  if ((block < 0) || (count < 0) || (block + count > DISK_BLOCKS)) {
+    fprintf(stderr, "block_discard: block index out of bounds\n");
+    return -1;
+  }
+
+  /* whatever was cached for these blocks is no longer wanted */
+  for (i = block; i < block + count && slots; ++i) {
+    if ((slot = cache_lock_idle(i)) >= 0)
+      slots[slot].dirty = 0;
+    pthread_mutex_unlock(&shard_of(i)->lock);
+  }
+
+  if (__atomic_load_n(&discard_broken, __ATOMIC_RELAXED))
+    return -1;
+
+  if (fallocate(handle, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t) block * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0) {
+    perror("block_discard: cannot punch hole");
+    __atomic_store_n(&discard_broken, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  /* cached copies must read back as zeros, like the hole does */
+  for (i = block; i < block + count && slots; ++i) {
+    if ((slot = cache_lock_idle(i)) >= 0)
+      memset(slot_data + slot * BLOCK_SIZE, 0, BLOCK_SIZE);
+    pthread_mutex_unlock(&shard_of(i)->lock);
+  }
+
+  return 0;
+}
+
+int disk_set_geometry(int blocks, int size)
+{
+  int shift;
+
+  if (active) {
+    fprintf(stderr, "disk_set_geometry: disk is open\n");
+    return -1;
+  }
+
+  for (shift = 0; (1 << shift) < size; ++shift)
+    ;
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (1 << shift) != size) {
+    fprintf(stderr, "disk_set_geometry: invalid block size\n");
+    return -1;
+  }
+
+  if (blocks < 1) {
+    fprintf(stderr, "disk_set_geometry: invalid block count\n");
+    return -1;
+  }
+
+  disk_blocks = blocks;
+  block_size = size;
+  block_shift = shift;
+
   return 0;
 }
+
+int disk_set_format(int mode)
+{
+  if (mode != DISK_FORMAT_ZERO && mode != DISK_FORMAT_SPARSE
+      && mode != DISK_FORMAT_ALLOCATE) {
+    fprintf(stderr, "disk_set_format: unknown format mode\n");
+    return -1;
+  }
+
+  format = mode;
+
+  return 0;
+}
+
+int disk_set_backend(int which)
+{
+  if (which != DISK_BACKEND_FD && which != DISK_BACKEND_MMAP
+      && which != DISK_BACKEND_URING) {
+    fprintf(stderr, "disk_set_backend: unknown backend\n");
+    return -1;
+  }
+
+  backend = which;
+
+  return 0;
+}
+
+char *block_ptr(int block)
+{
+  if (!active || !mapping) {
+    fprintf(stderr, "block_ptr: disk not memory-mapped\n");
+    return NULL;
+  }
+
+  if ((block < 0) || (block >= DISK_BLOCKS)) {
+    fprintf(stderr, "block_ptr: block index out of bounds\n");
+    return NULL;
+  }
+
+  IO_ADD(reads, 1);
+  TRACE(DISK_TRACE_READ, 1, &block);
+
+  return mapping + (size_t) block * BLOCK_SIZE;
+}
+
+void disk_get_stats(disk_stats *out)
+{
+  *out = stats;
+}
+
+void disk_reset_stats()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+void disk_thread_io(unsigned long *reads, unsigned long *writes)
+{
+  *reads = thread_reads;
+  *writes = thread_writes;
+}
+
+void disk_set_timing(int enable)
+{
+  timing = enable;
+}
+
+/******************************************************************************/
+int disk_trace_start(int records)
+{
+  if (records <= 0) {
+    fprintf(stderr, "disk_trace_start: invalid ring size\n");
+    return -1;
+  }
+
+  disk_trace_stop();
+  if (!(trace_ring = calloc(records, sizeof(disk_trace_record)))) {
+    fprintf(stderr, "disk_trace_start: cannot allocate ring\n");
+    return -1;
+  }
+  trace_capacity = records;
+  trace_next = 0;
+
+  return 0;
+}
+
+void disk_trace_stop()
+{
+  free(trace_ring);
+  trace_ring = NULL;
+}
+
+void disk_trace_tag(int tag)
+{
+  trace_tag = tag;
+}
+
+int disk_trace_save(char *name)
+{
+  disk_trace_header header;
+  unsigned long first, n;
+  FILE *f;
+
+  if (!trace_ring) {
+    fprintf(stderr, "disk_trace_save: not tracing\n");
+    return -1;
+  }
+
+  /* once the ring has wrapped, only the newest trace_capacity records remain */
+  n = trace_next < trace_capacity ? trace_next : trace_capacity;
+  first = trace_next - n;
+
+  header.magic = DISK_TRACE_MAGIC;
+  header.version = DISK_TRACE_VERSION;
+  header.block_size = BLOCK_SIZE;
+  header.disk_blocks = DISK_BLOCKS;
+  header.records = n;
+  header.dropped = first;
+
+  if (!(f = fopen(name, "wb"))) {
+    perror("disk_trace_save: cannot open file");
+    return -1;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, f) != 1) {
+    perror("disk_trace_save: cannot write header");
+    fclose(f);
+    return -1;
+  }
+
+  /* oldest first, in at most two pieces */
+  while (n > 0) {
+    unsigned long at = first % trace_capacity;
+    unsigned long run = trace_capacity - at < n ? trace_capacity - at : n;
+
+    if (fwrite(trace_ring + at, sizeof(disk_trace_record), run, f) != run) {
+      perror("disk_trace_save: cannot write records");
+      fclose(f);
+      return -1;
+    }
+    first += run;
+    n -= run;
+  }
+
+  if (fclose(f)) {
+    perror("disk_trace_save: cannot close file");
+    return -1;
+  }
+
+  return 0;
+}
+
+int disk_trace_replay(char *name, int timed)
+{
+  disk_trace_header header;
+  disk_trace_record rec;
+  int blocks[IOV_MAX];
+  char *rbufs[IOV_MAX], *wbufs[IOV_MAX];
+  char *data, *zeros;
+  int count = 0, kind = 0, queued = 0, ret = 0, i;
+  long start = 0, first = 0;
+  FILE *f;
+
+  if (!active) {
+    fprintf(stderr, "disk_trace_replay: disk not active\n");
+    return -1;
+  }
+
+  /* reads land in a scratch area and writes come from zeros, since traces
+   * hold no data; pages never touched cost nothing */
+  data = malloc((size_t) IOV_MAX * BLOCK_SIZE);
+  zeros = calloc(IOV_MAX, BLOCK_SIZE);
+  if (!data || !zeros) {
+    fprintf(stderr, "disk_trace_replay: cannot allocate buffers\n");
+    free(data);
+    free(zeros);
+    return -1;
+  }
+  for (i = 0; i < IOV_MAX; ++i) {
+    rbufs[i] = data + (size_t) i * BLOCK_SIZE;
+    wbufs[i] = zeros + (size_t) i * BLOCK_SIZE;
+  }
+
+  if (!(f = fopen(name, "rb"))) {
+    perror("disk_trace_replay: cannot open file");
+    free(data);
+    free(zeros);
+    return -1;
+  }
+
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != DISK_TRACE_MAGIC
+      || header.version != DISK_TRACE_VERSION
+      || header.block_size != BLOCK_SIZE
+      || header.disk_blocks != DISK_BLOCKS) {
+    fprintf(stderr, "disk_trace_replay: not a trace of this disk geometry\n");
+    fclose(f);
+    free(data);
+    free(zeros);
+    return -1;
+  }
+
+  /* records of one call are issued together, as the same kind of call */
+  while (ret == 0 && fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (rec.block < 0 || rec.block >= DISK_BLOCKS) {
+      fprintf(stderr, "disk_trace_replay: block index out of bounds\n");
+      ret = -1;
+      break;
+    }
+
+    if (count == 0) {
+      kind = rec.kind;
+
+      if (timed) {
+        long now = now_ns();
+        if (start == 0) {
+          start = now;
+          first = rec.ns;
+        } else if (rec.ns - first > now - start) {
+          struct timespec gap;
+          long wait = (rec.ns - first) - (now - start);
+          gap.tv_sec = wait / 1000000000L;
+          gap.tv_nsec = wait % 1000000000L;
+          nanosleep(&gap, NULL);
+        }
+      }
+    }
+    blocks[count++] = rec.block;
+
+    if (!rec.more || count == IOV_MAX) {
+      ret = replay_group(kind, count, blocks, rbufs, wbufs, &queued);
+      count = 0;
+    }
+  }
+
+  if (ret == 0 && count > 0)
+    ret = replay_group(kind, count, blocks, rbufs, wbufs, &queued);
+  if (block_wait() < 0)
+    ret = -1;
+
+  fclose(f);
+  free(data);
+  free(zeros);
+  return ret;
+}
+
+/*
+ * Current time of the monotonic clock in nanoseconds.
+ */
+static long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/******************************************************************************/
+static void shards_init()
+{
+  int i;
+
+  for (i = 0; i < CACHE_SHARDS; ++i) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_cond_init(&shards[i].idle, NULL);
+  }
+}
+
+/* the shard whose lock covers (block) */
+static cache_shard *shard_of(int block)
+{
+  return &shards[block & (shard_count - 1)];
+}
+
+static int cache_open()
+{
+  int i, first;
+
+  pthread_once(&shards_once, shards_init);
+
+  for (i = 0; i < DISK_BLOCKS; ++i)
+    slot_of[i] = -1;
+
+  /* a mapped disk is already served from the page cache */
+  if (!cache_capacity || mapping) {
+    shard_count = 1;
+    shards[0].capacity = shards[0].used = 0;
+    shards[0].lru_head = shards[0].lru_tail = -1;
+    return 0;
+  }
+
+  /* as many shards as keep each one big enough to hold a working set */
+  for (shard_count = CACHE_SHARDS; shard_count > 1; shard_count /= 2) {
+    if (cache_capacity / shard_count >= CACHE_SHARD_MIN)
+      break;
+  }
+
+  for (i = first = 0; i < shard_count; ++i) {
+    shards[i].first = first;
+    shards[i].capacity = cache_capacity / shard_count +
+                         (i < cache_capacity % shard_count);
+    shards[i].used = 0;
+    shards[i].lru_head = shards[i].lru_tail = -1;
+    first += shards[i].capacity;
+  }
+
+  slots = malloc(cache_capacity * sizeof(cache_slot));
+  slot_data = malloc((size_t) cache_capacity * BLOCK_SIZE);
+  if (!slots || !slot_data) {
+    fprintf(stderr, "cache_open: cannot allocate block cache\n");
+    free(slots);
+    free(slot_data);
+    slots = NULL;
+    slot_data = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int cache_close()
+{
+  int ret = 0;
+
+  if (!slots)
+    return 0;
+
+  if (cache_flush() < 0)
+    ret = -1;
+
+  free(slots);
+  free(slot_data);
+  slots = NULL;
+  slot_data = NULL;
+
+  return ret;
+}
+
+/*
+ * Write back every dirty slot. Slots are marked as being written out while
+ * their shard is unlocked for the write, so other threads can still read
+ * them; a slot some other thread is writing out is waited for.
+ */
+static int cache_flush()
+{
+  int i, n, block;
+  int blocks[IOV_MAX], taken[IOV_MAX];
+  char *bufs[IOV_MAX];
+  cache_shard *shard;
+
+  if (!slots)
+    return 0;
+
+  /* walk the disk in block order so dirty neighbours merge into one write */
+  n = 0;
+  for (block = 0; block <= DISK_BLOCKS; ++block) {
+    i = -1;
+
+    if (block < DISK_BLOCKS) {
+      shard = shard_of(block);
+      pthread_mutex_lock(&shard->lock);
+
+      if ((i = slot_of[block]) >= 0 && slots[i].busy) {
+        /* our own pending run may be what it waits on */
+        pthread_mutex_unlock(&shard->lock);
+        if (n > 0 &&
+            cache_release(n, blocks, taken, raw_rwv(1, n, blocks, bufs)) < 0)
+          return -1;
+        n = 0;
+        pthread_mutex_lock(&shard->lock);
+        while ((i = slot_of[block]) >= 0 && slots[i].busy)
+          pthread_cond_wait(&shard->idle, &shard->lock);
+      }
+
+      if (i >= 0 && slots[i].dirty)
+        slots[i].busy = SLOT_WRITING;
+      else
+        i = -1;
+
+      pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (i >= 0) {
+      blocks[n] = block;
+      taken[n] = i;
+      bufs[n++] = slot_data + i * BLOCK_SIZE;
+    }
+
+    if (n > 0 && (i < 0 || n == IOV_MAX)) {
+      if (cache_release(n, blocks, taken, raw_rwv(1, n, blocks, bufs)) < 0)
+        return -1;
+      n = 0;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Mark the (count) slots cache_flush wrote out for (blocks) idle again, and
+ * clean if the write, which returned (written), succeeded.
+ */
+static int cache_release(int count, int *blocks, int *taken, int written)
+{
+  int i;
+  cache_shard *shard;
+
+  for (i = 0; i < count; ++i) {
+    shard = shard_of(blocks[i]);
+    pthread_mutex_lock(&shard->lock);
+    slots[taken[i]].busy = 0;
+    if (written == 0) {
+      slots[taken[i]].dirty = 0;
+      STAT_ADD(writebacks, 1);
+    }
+    pthread_cond_broadcast(&shard->idle);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  return written;
+}
+
+/* unlink a slot from its shard's LRU list */
+static void lru_remove(cache_shard *shard, int slot)
+{
+  if (slots[slot].prev >= 0)
+    slots[slots[slot].prev].next = slots[slot].next;
+  else
+    shard->lru_head = slots[slot].next;
+
+  if (slots[slot].next >= 0)
+    slots[slots[slot].next].prev = slots[slot].prev;
+  else
+    shard->lru_tail = slots[slot].prev;
+}
+
+/* link an empty slot in at the cold end, to be reused first */
+static void lru_park(cache_shard *shard, int slot)
+{
+  slots[slot].prev = shard->lru_tail;
+  slots[slot].next = -1;
+
+  if (shard->lru_tail >= 0)
+    slots[shard->lru_tail].next = slot;
+  else
+    shard->lru_head = slot;
+
+  shard->lru_tail = slot;
+}
+
+/* link a slot in as the most recently used one */
+static void lru_push(cache_shard *shard, int slot)
+{
+  slots[slot].prev = -1;
+  slots[slot].next = shard->lru_head;
+
+  if (shard->lru_head >= 0)
+    slots[shard->lru_head].prev = slot;
+  else
+    shard->lru_tail = slot;
+
+  shard->lru_head = slot;
+}
+
+/*
+ * Find the slot caching (block), making it the most recently used one; the
+ * caller holds the lock of (shard). On a miss a victim slot is reused; if
+ * (load) is set the block is then read in from the disk file, with the shard
+ * unlocked meanwhile. Callers that load only read the slot, and may do so
+ * while it is being written out; others get it idle. Returns -1 if no slot
+ * could be had, in which case the caller should go around the cache.
+ */
+static int cache_slot_for(cache_shard *shard, int block, int load)
+{
+  int slot, ret, missed = 0;
+
+  for (;;) {
+    if ((slot = slot_of[block]) >= 0) {
+      if (slots[slot].busy == SLOT_READING || (slots[slot].busy && !load)) {
+        pthread_cond_wait(&shard->idle, &shard->lock);
+        continue;
+      }
+      cache_hit(slot);
+      lru_remove(shard, slot);
+      lru_push(shard, slot);
+      return slot;
+    }
+
+    if (!missed++)
+      STAT_ADD(misses, 1);
+
+    if ((slot = cache_victim(shard)) < 0)
+      return -1;
+
+    /* writing back the victim may have let another thread cache the block */
+    if (slot_of[block] < 0)
+      break;
+    lru_park(shard, slot);
+  }
+
+  slots[slot].block = block;
+  slot_of[block] = slot;
+
+  if (load) {
+    slots[slot].busy = SLOT_READING;
+    pthread_mutex_unlock(&shard->lock);
+    ret = raw_read(block, slot_data + slot * BLOCK_SIZE);
+    pthread_mutex_lock(&shard->lock);
+    slots[slot].busy = 0;
+    pthread_cond_broadcast(&shard->idle);
+
+    if (ret < 0) {
+      slot_of[block] = -1;
+      slots[slot].block = -1;
+      lru_park(shard, slot);
+      return -1;
+    }
+  }
+
+  lru_push(shard, slot);
+
+  return slot;
+}
+
+/*
+ * Hand out an empty slot of (shard), unlinked from the LRU list: an unused one
+ * while the shard is filling up, otherwise the least recently used one that
+ * isn't busy. A dirty one is written back first, with the shard unlocked, and
+ * the search starts over. Returns -1 if every slot is busy or a write-back
+ * failed; the caller holds the lock of (shard).
+ */
+static int cache_victim(cache_shard *shard)
+{
+  int slot, block, ret;
+
+  for (;;) {
+    if (shard->used < shard->capacity) {
+      slot = shard->first + shard->used++;
+      break;
+    }
+
+    for (slot = shard->lru_tail; slot >= 0 && slots[slot].busy;
+         slot = slots[slot].prev)
+      ;
+    if (slot < 0)
+      return -1;
+
+    if (!slots[slot].dirty) {
+      lru_remove(shard, slot);
+      if (slots[slot].block >= 0) {
+        slot_of[slots[slot].block] = -1;
+        STAT_ADD(evictions, 1);
+      }
+      break;
+    }
+
+    /* nobody can dirty it again while it is busy */
+    block = slots[slot].block;
+    slots[slot].busy = SLOT_WRITING;
+    pthread_mutex_unlock(&shard->lock);
+    ret = raw_write(block, slot_data + slot * BLOCK_SIZE);
+    pthread_mutex_lock(&shard->lock);
+    slots[slot].busy = 0;
+    pthread_cond_broadcast(&shard->idle);
+
+    if (ret < 0)
+      return -1;
+    slots[slot].dirty = 0;
+    STAT_ADD(writebacks, 1);
+  }
+
+  slots[slot].block = -1;
+  slots[slot].dirty = 0;
+  slots[slot].prefetched = 0;
+  slots[slot].busy = 0;
+
+  return slot;
+}
+
+/*
+ * Lock the shard of (block) and wait until its slot, if any, is neither read
+ * in nor written out, so the caller may change it. Returns the slot or -1;
+ * the shard stays locked either way.
+ */
+static int cache_lock_idle(int block)
+{
+  int slot;
+  cache_shard *shard = shard_of(block);
+
+  pthread_mutex_lock(&shard->lock);
+  while ((slot = slot_of[block]) >= 0 && slots[slot].busy)
+    pthread_cond_wait(&shard->idle, &shard->lock);
+
+  return slot;
+}
+
+/*
+ * Copy (block) into (buf) if it is cached, waiting for it should it be read
+ * in right now. Returns 0 on a hit, -1 on a miss.
+ */
+static int cache_lookup(int block, char *buf)
+{
+  int slot;
+  cache_shard *shard = shard_of(block);
+
+  pthread_mutex_lock(&shard->lock);
+  while ((slot = slot_of[block]) >= 0 && slots[slot].busy == SLOT_READING)
+    pthread_cond_wait(&shard->idle, &shard->lock);
+
+  if (slot >= 0) {
+    memcpy(buf, slot_data + slot * BLOCK_SIZE, BLOCK_SIZE);
+    cache_hit(slot);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return slot >= 0 ? 0 : -1;
+}
+
+/* count a request served from (slot), crediting readahead if it loaded it */
+static void cache_hit(int slot)
+{
+  STAT_ADD(hits, 1);
+
+  if (slots[slot].prefetched) {
+    slots[slot].prefetched = 0;
+    STAT_ADD(prefetch_hits, 1);
+  }
+}
+
+static int raw_write(int block, char *buf)
+{
+  if (pwrite(handle, buf, BLOCK_SIZE, (off_t) block * BLOCK_SIZE) < 0) {
+    perror("block_write: failed to write");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int raw_read(int block, char *buf)
+{
+  if (pread(handle, buf, BLOCK_SIZE, (off_t) block * BLOCK_SIZE) < 0) {
+    perror("block_read: failed to read");
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Transfer (count) blocks between the disk file and the matching buffers.
+ * Every run of consecutive block numbers goes out as a single preadv/pwritev.
+ */
+static int raw_rwv(int write, int count, int *blocks, char **bufs)
+{
+  struct iovec iov[IOV_MAX];
+  int i, n;
+  ssize_t want, got;
+
+  for (i = 0; i < count; i += n) {
+    for (n = 0; i + n < count && n < IOV_MAX; ++n) {
+      if (n > 0 && blocks[i + n] != blocks[i] + n)
+        break;
+      iov[n].iov_base = bufs[i + n];
+      iov[n].iov_len = BLOCK_SIZE;
+    }
+
+    want = (ssize_t) n * BLOCK_SIZE;
+    if (write)
+      got = pwritev(handle, iov, n, (off_t) blocks[i] * BLOCK_SIZE);
+    else
+      got = preadv(handle, iov, n, (off_t) blocks[i] * BLOCK_SIZE);
+
+    if (got < 0) {
+      perror(write ? "block_writev: failed to write"
+                   : "block_readv: failed to read");
+      return -1;
+    }
+
+    /* a short transfer is picked up again from the first block it missed */
+    if (got < want)
+      n = got / BLOCK_SIZE;
+    if (n == 0) {
+      fprintf(stderr, write ? "block_writev: short write\n"
+                            : "block_readv: short read\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Set up an io_uring instance for (f) and map its rings. Block transfers
+ * queued with block_*_async are then handed to the kernel as a batch.
+ */
+static int ring_open(int f)
+{
+  struct io_uring_params p;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &p)) < 0) {
+    perror("ring_open: io_uring_setup failed");
+    return -1;
+  }
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size > sq_ring_size)
+      sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+  }
+
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    perror("ring_open: cannot map submission ring");
+    close(fd);
+    return -1;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring = sq_ring;
+  } else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      perror("ring_open: cannot map completion ring");
+      munmap(sq_ring, sq_ring_size);
+      close(fd);
+      return -1;
+    }
+  }
+
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    perror("ring_open: cannot map submission entries");
+    if (cq_ring != sq_ring)
+      munmap(cq_ring, cq_ring_size);
+    munmap(sq_ring, sq_ring_size);
+    close(fd);
+    return -1;
+  }
+
+  sq_head = (unsigned *) ((char *) sq_ring + p.sq_off.head);
+  sq_tail = (unsigned *) ((char *) sq_ring + p.sq_off.tail);
+  sq_mask = (unsigned *) ((char *) sq_ring + p.sq_off.ring_mask);
+  sq_array = (unsigned *) ((char *) sq_ring + p.sq_off.array);
+  cq_head = (unsigned *) ((char *) cq_ring + p.cq_off.head);
+  cq_tail = (unsigned *) ((char *) cq_ring + p.cq_off.tail);
+  cq_mask = (unsigned *) ((char *) cq_ring + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) ((char *) cq_ring + p.cq_off.cqes);
+
+  ring_fd = fd;
+  ring_queued = ring_inflight = 0;
+
+  return 0;
+}
+
+static void ring_close()
+{
+  if (ring_fd < 0)
+    return;
+
+  munmap(sqes, sqes_size);
+  if (cq_ring != sq_ring)
+    munmap(cq_ring, cq_ring_size);
+  munmap(sq_ring, sq_ring_size);
+  close(ring_fd);
+
+  ring_fd = -1;
+}
+
+/* fill in one submission entry, first making room if the ring is full; the
+ * caller holds ring_lock */
+static int ring_queue(int write, int block, char *buf)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail, index;
+
+  while (ring_queued + ring_inflight >= DISK_QUEUE_DEPTH) {
+    if (ring_submit() < 0)
+      return -1;
+    if (syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      perror("ring_queue: failed to wait for completions");
+      return -1;
+    }
+    ring_reap();
+  }
+
+  tail = *sq_tail;
+  index = tail & *sq_mask;
+  sqe = &sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = handle;
+  sqe->addr = (unsigned long) buf;
+  sqe->len = BLOCK_SIZE;
+  sqe->off = (unsigned long long) block * BLOCK_SIZE;
+  sqe->user_data = (unsigned long) &batch;
+
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring_queued;
+  ++batch.outstanding;
+
+  return 0;
+}
+
+/* hand every filled-in submission entry to the kernel */
+static int ring_submit()
+{
+  int ret;
+
+  while (ring_queued > 0) {
+    ret = syscall(__NR_io_uring_enter, ring_fd, ring_queued, 0, 0, NULL, 0);
+    if (ret < 0) {
+      perror("ring_submit: io_uring_enter failed");
+      return -1;
+    }
+    ring_queued -= ret;
+    ring_inflight += ret;
+  }
+
+  return 0;
+}
+
+/* collect every completion the kernel has posted, crediting each to the
+ * thread that queued it; the caller holds ring_lock */
+static void ring_reap()
+{
+  unsigned head = *cq_head;
+
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+    async_batch *owner = (async_batch *) (unsigned long) cqe->user_data;
+
+    if (cqe->res != BLOCK_SIZE) {
+      fprintf(stderr, "ring_reap: block transfer failed\n");
+      owner->failed = 1;
+    }
+
+    --owner->outstanding;
+    ++head;
+    --ring_inflight;
+  }
+
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* remember a request for a backend without a ring */
+static int pend_queue(int write, int block, char *buf)
+{
+  if (pend_count == IOV_MAX && pend_run() < 0)
+    return -1;
+
+  pend_block[pend_count] = block;
+  pend_buf[pend_count] = buf;
+  pend_write[pend_count] = write;
+  ++pend_count;
+
+  return 0;
+}
+
+/* carry out remembered requests in order, batching neighbours of one kind */
+static int pend_run()
+{
+  int i, n, ret;
+
+  for (i = 0; i < pend_count; i += n) {
+    for (n = 1; i + n < pend_count && pend_write[i + n] == pend_write[i]; ++n)
+      ;
+
+    if (pend_write[i])
+      ret = block_writev(n, pend_block + i, pend_buf + i);
+    else
+      ret = block_readv(n, pend_block + i, pend_buf + i);
+
+    if (ret < 0)
+      batch.failed = 1;
+  }
+
+  pend_count = 0;
+
+  return 0;
+}
+
+/*
+ * Log the (count) blocks of one call of (kind), tagged with the calling
+ * thread's tag. The records are claimed together, so those of one call stay
+ * adjacent even with other threads logging at the same time.
+ */
+static void trace(int kind, int count, int *blocks)
+{
+  unsigned long at = __atomic_fetch_add(&trace_next, count, __ATOMIC_RELAXED);
+  long ns = now_ns();
+  int i;
+
+  for (i = 0; i < count; ++i) {
+    disk_trace_record *rec = trace_ring + (at + i) % trace_capacity;
+
+    rec->ns = ns;
+    rec->block = blocks[i];
+    rec->kind = kind;
+    rec->more = i + 1 < count;
+    rec->tag = trace_tag;
+  }
+}
+
+/*
+ * Issue one traced call again, reading into (rbufs) and writing from (wbufs).
+ * Async requests stay queued until the next synchronous call, as the file
+ * system waits for its requests before doing anything else; (queued) tracks
+ * whether any are.
+ */
+static int replay_group(int kind, int count, int *blocks, char **rbufs,
+                        char **wbufs, int *queued)
+{
+  if (kind == DISK_TRACE_READ_ASYNC || kind == DISK_TRACE_WRITE_ASYNC) {
+    *queued = 1;
+    return kind == DISK_TRACE_READ_ASYNC ? block_read_async(blocks[0], rbufs[0])
+                                         : block_write_async(blocks[0], wbufs[0]);
+  }
+
+  if (*queued) {
+    *queued = 0;
+    if (block_wait() < 0)
+      return -1;
+  }
+
+  switch (kind) {
+  case DISK_TRACE_READ:
+    return count == 1 ? block_read(blocks[0], rbufs[0])
+                      : block_readv(count, blocks, rbufs);
+  case DISK_TRACE_WRITE:
+    return count == 1 ? block_write(blocks[0], wbufs[0])
+                      : block_writev(count, blocks, wbufs);
+  case DISK_TRACE_PREFETCH:
+    return block_prefetch(count, blocks);
+  }
+
+  fprintf(stderr, "disk_trace_replay: unknown record kind %d\n", kind);
+  return -1;
+}
@@ -2,8 +2,72 @@
 #define _DISK_H_
 
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
+/* geometry of the open disk, or of the next one made or opened; set with
+ * disk_set_geometry and fixed while a disk is open */
+extern int disk_blocks, block_size, block_shift;
+
+#define DISK_BLOCKS  disk_blocks  /* number of blocks on the disk             */
+#define BLOCK_SIZE   block_size   /* block size on "disk"                     */
+#define BLOCK_SHIFT  block_shift  /* log2(BLOCK_SIZE)                         */
+
+#define DEFAULT_DISK_BLOCKS 8192  /* geometry until disk_set_geometry         */
+#define DEFAULT_BLOCK_SIZE  4096
+#define MIN_BLOCK_SIZE      4096  /* block sizes are powers of two in between */
+#define MAX_BLOCK_SIZE      65536
+
+#define DISK_CACHE_BLOCKS 64   /* default capacity of the block cache         */
+
+#define DISK_BACKEND_FD   0    /* read/write the image through a descriptor   */
+#define DISK_BACKEND_MMAP 1    /* map the whole image into memory             */
+#define DISK_BACKEND_URING 2   /* descriptor, with async requests on io_uring */
+
+#define DISK_QUEUE_DEPTH 64    /* io_uring submission queue entries           */
+
+#define DISK_FORMAT_ZERO     0 /* make_disk writes every block with zeros     */
+#define DISK_FORMAT_SPARSE   1 /* make_disk sizes an empty (sparse) file      */
+#define DISK_FORMAT_ALLOCATE 2 /* make_disk reserves space with fallocate     */
+
+/******************************************************************************/
+#define DISK_TRACE_MAGIC   0x53414e54 /* "SANT" */
+#define DISK_TRACE_VERSION 1
+
+#define DISK_TRACE_READ        0 /* block_read, block_readv, block_ptr       */
+#define DISK_TRACE_WRITE       1 /* block_write, block_writev                */
+#define DISK_TRACE_READ_ASYNC  2 /* block_read_async on io_uring             */
+#define DISK_TRACE_WRITE_ASYNC 3 /* block_write_async on io_uring            */
+#define DISK_TRACE_PREFETCH    4 /* block_prefetch                           */
+
+/* trace file layout: one header, then (records) records, oldest first */
+typedef struct t_disk_trace_header {
+  unsigned int magic;          /* DISK_TRACE_MAGIC                            */
+  unsigned int version;        /* DISK_TRACE_VERSION                          */
+  unsigned int block_size;     /* BLOCK_SIZE of the traced disk               */
+  unsigned int disk_blocks;    /* DISK_BLOCKS of the traced disk              */
+  unsigned long records;       /* records that follow                         */
+  unsigned long dropped;       /* older records overwritten in the ring       */
+} disk_trace_header;
+
+typedef struct t_disk_trace_record {
+  unsigned long ns;            /* monotonic time of the call, nanoseconds     */
+  int block;                   /* block read or written                       */
+  unsigned char kind;          /* DISK_TRACE_*                                */
+  unsigned char more;          /* next record belongs to the same call        */
+  unsigned short tag;          /* disk_trace_tag of the calling thread        */
+} disk_trace_record;
+
+typedef struct t_disk_stats {
+  unsigned long reads;         /* block_read calls                            */
+  unsigned long writes;        /* block_write calls                           */
+  unsigned long hits;          /* calls served by the block cache             */
+  unsigned long misses;        /* calls that had to load a cache slot         */
+  unsigned long evictions;     /* cached blocks dropped to make room          */
+  unsigned long writebacks;    /* dirty cached blocks written to the file     */
+  unsigned long prefetches;    /* blocks loaded ahead of use                  */
+  unsigned long prefetch_hits; /* prefetched blocks used while still cached   */
+  unsigned long read_ns;       /* time spent in block_read and block_readv    */
+  unsigned long write_ns;      /* time spent in block_write and block_writev  */
+  unsigned long syncs;         /* disk_sync calls that reached the file       */
+} disk_stats;
 
 /******************************************************************************/
 int make_disk(char *name);     /* create an empty, virtual disk file          */
@@ -14,6 +78,70 @@ int block_write(int block, char *buf);
                                /* write a block of size BLOCK_SIZE to disk    */
 int block_read(int block, char *buf);
                                /* read a block of size BLOCK_SIZE from disk   */
+int block_writev(int count, int *blocks, char **bufs);
+                               /* write bufs[i] to blocks[i] for each i,      */
+                               /* merging consecutive blocks into one write   */
+int block_readv(int count, int *blocks, char **bufs);
+                               /* read blocks[i] into bufs[i] for each i,     */
+                               /* merging consecutive blocks into one read    */
+
+int block_write_async(int block, char *buf);
+                               /* queue a block write; buf must stay intact   */
+                               /* until block_wait                            */
+int block_read_async(int block, char *buf);
+                               /* queue a block read; buf is filled by the    */
+                               /* time block_wait returns                     */
+int block_poll();              /* collect finished requests without blocking, */
+                               /* returning how many of this thread's are     */
+                               /* still outstanding                           */
+int block_wait();              /* wait until every request queued by this     */
+                               /* thread finishes, returning -1 if any of     */
+                               /* them failed; call it before the thread ends */
+
+int block_prefetch(int count, int *blocks);
+                               /* load the (distinct) blocks into the cache   */
+                               /* ahead of use, in as few reads as possible;  */
+                               /* a mapped disk asks the kernel to read ahead */
+int block_discard(int block, int count);
+                               /* punch a hole where (count) blocks starting  */
+                               /* at (block) were; they read back as zeros    */
+
+int disk_set_geometry(int blocks, int size);
+                               /* choose the block count and block size used  */
+                               /* by the next make_disk/open_disk             */
+int disk_set_format(int mode); /* choose how make_disk creates the file       */
+int disk_set_backend(int which);
+                               /* choose the backend used by open_disk        */
+char *block_ptr(int block);    /* address of a block in a mapped disk, for    */
+                               /* reading without a copy (NULL if unmapped)   */
+
+int disk_cache_size(int blocks);
+                               /* set block cache capacity (0 disables it,    */
+                               /* and mapped disks never use it)              */
+int disk_flush();              /* write back every dirty cached block         */
+int disk_sync();               /* disk_flush, then make every write so far    */
+                               /* durable with fdatasync (msync if mapped)    */
+void disk_get_stats(disk_stats *stats);
+                               /* copy out the block I/O counters             */
+void disk_reset_stats();       /* zero the block I/O counters                 */
+void disk_thread_io(unsigned long *reads, unsigned long *writes);
+                               /* block reads and writes the calling thread   */
+                               /* has issued since it started                 */
+void disk_set_timing(int enable);
+                               /* time the synchronous block calls (default)  */
+
+int disk_trace_start(int records);
+                               /* log every block access into a ring of       */
+                               /* (records) entries, dropping the oldest      */
+void disk_trace_stop();        /* stop logging and discard the ring           */
+void disk_trace_tag(int tag);  /* tag this thread's next accesses, e.g. with  */
+                               /* the file system call making them            */
+int disk_trace_save(char *name);
+                               /* write the ring to file (name), oldest first */
+int disk_trace_replay(char *name, int timed);
+                               /* issue every access in trace (name) against  */
+                               /* the open disk, with zeros for written data; */
+                               /* if (timed), keep the original spacing       */
 /******************************************************************************/
 
 #endif
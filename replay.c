@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "disk.h"
+
+/**
+ * Replays a block trace saved with disk_trace_save against a disk image, on
+ * the backend and cache size given, and prints one comma-separated line of
+ * results under a header row. The disk takes the trace's geometry. The image
+ * is created if it does not exist; its contents are overwritten by the
+ * trace's writes, so use a scratch copy.
+ *
+ * usage: fs_replay trace image [fd|mmap|uring] [cache blocks] [timed]
+ */
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s trace image [fd|mmap|uring] [cache blocks] "
+            "[timed]\n", argv[0]);
+    return 2;
+  }
+
+  char* trace = argv[1];
+  char* image = argv[2];
+  char* backend = argc > 3 ? argv[3] : "fd";
+  int cache = argc > 4 ? atoi(argv[4]) : DISK_CACHE_BLOCKS;
+  int timed = argc > 5 && strcmp(argv[5], "timed") == 0;
+
+  int which = DISK_BACKEND_FD;
+  if (strcmp(backend, "mmap") == 0) {
+    which = DISK_BACKEND_MMAP;
+  } else if (strcmp(backend, "uring") == 0) {
+    which = DISK_BACKEND_URING;
+  } else if (strcmp(backend, "fd") != 0) {
+    fprintf(stderr, "%s: Unknown backend %s.\n", argv[0], backend);
+    return 2;
+  }
+
+  disk_trace_header header;
+  FILE* f = fopen(trace, "rb");
+  int loaded = f && fread(&header, sizeof(header), 1, f) == 1;
+  if (f) {
+    fclose(f);
+  }
+
+  if (!loaded || header.magic != DISK_TRACE_MAGIC
+      || disk_set_geometry(header.disk_blocks, header.block_size)) {
+    fprintf(stderr, "%s: %s is not a block trace.\n", argv[0], trace);
+    return 1;
+  }
+
+  if (access(image, F_OK) && make_disk(image)) {
+    fprintf(stderr, "%s: Could not create %s.\n", argv[0], image);
+    return 1;
+  }
+
+  if (disk_set_backend(which)
+      || disk_cache_size(cache)
+      || open_disk(image)) {
+    fprintf(stderr, "%s: Could not open %s.\n", argv[0], image);
+    return 1;
+  }
+
+  struct timespec start, end;
+  disk_stats stats;
+
+  disk_reset_stats();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int failed = disk_trace_replay(trace, timed) || disk_flush();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  disk_get_stats(&stats);
+
+  if (close_disk() || failed) {
+    fprintf(stderr, "%s: Replay of %s failed.\n", argv[0], trace);
+    return 1;
+  }
+
+  double secs = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  unsigned long blocks = stats.reads + stats.writes;
+
+  printf("backend,cache,blocks,seconds,blocks_per_s,mb_per_s,reads,writes,"
+         "hits,misses,writebacks,prefetches,read_us,write_us\n");
+  printf("%s,%d,%lu,%.6f,%.1f,%.2f,%lu,%lu,%lu,%lu,%lu,%lu,%.1f,%.1f\n",
+         backend, cache, blocks, secs, blocks / secs,
+         (double) blocks * BLOCK_SIZE / secs / (1 << 20), stats.reads,
+         stats.writes, stats.hits, stats.misses, stats.writebacks,
+         stats.prefetches, stats.read_ns / 1e3, stats.write_ns / 1e3);
+
+  return 0;
+}
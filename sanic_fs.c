@@ -1,182 +1,872 @@
+#define _GNU_SOURCE /* writer-preferring rwlock */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 #include "sanic_fs.h"
 #include "disk.h"
 
 directory_entry directory[MAX_FILES];
+/* One flag per block of the directory region, set when it changed since the
+ * last commit */
+char directory_dirty[MAX_FILES * sizeof(directory_entry) / MIN_BLOCK_SIZE];
+/* Open-addressed filename index: directory index per slot, or -1 */
+int dir_hash[DIR_HASH_SIZE];
+/* Lowest directory index that might be free */
+int dir_free_hint;
 file_descriptor descriptor_table[MAX_DESCRIPTORS];
 int descriptors;
+/* Files with at least one open descriptor, each with its reader/writer lock */
+open_file open_files[MAX_DESCRIPTORS];
+/* Guards the directory, the filename index, and the descriptor and open file
+ * tables. Taken after any descriptor and file lock. */
+pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* In-memory copy of every block's next pointer, loaded at mount and padded to
+ * whole blocks of the table region */
+int* block_table;
+/* One flag per block of the table region, set when it changed since the last
+ * commit */
+char* block_table_dirty;
+
+/* Disk block each reference node stands for (node DISK_BLOCKS + i at i), or
+ * REF_EMPTY, or 0 if the node is free; padded to whole blocks of the
+ * reference region */
+int* ref_target;
+/* One flag per block of the reference region, set when it changed since the
+ * last commit */
+char* ref_target_dirty;
+/* Index of ref_target to start the next search for a free node from */
+int ref_hint;
+
+/* Hash of the contents of every block that reference nodes stand for, or 0,
+ * padded to whole blocks of the hash region */
+unsigned int* block_hash;
+/* One flag per block of the hash region, set when it changed since the last
+ * commit */
+char* block_hash_dirty;
+/* Number of reference nodes standing for each block, rebuilt at mount */
+int* block_refs;
+/* Open-addressed content index: disk index of a block with a hash per slot,
+ * or 0. Rebuilt at mount from the hash region. */
+int* dedup_index;
+int dedup_slots;
+
+/* Give files that get their first block from now on reference nodes */
+int dedup_enabled = 0;
+
+/* Free-space bitmap (bit set = block in use), padded to whole blocks of the
+ * bitmap region */
+uint64_t* block_bitmap;
+/* Word of block_bitmap to start the next allocation scan from */
+int alloc_hint;
+/* Number of clear bits in block_bitmap */
+int free_blocks;
+/* One flag per block of the bitmap region, set when it changed since the last
+ * commit */
+char* block_bitmap_dirty;
+/* Blocks freed since the last commit copied out the bitmap, and blocks freed
+ * in the transaction being committed. Neither are reused until the free is
+ * durable, so a crash that loses a delete never leaves the file pointing at
+ * another file's data. Counted as free, and guarded by alloc_lock. */
+uint64_t* pending_free;
+uint64_t* committing_free;
+int pending_free_count;
+int committing_free_count;
+
+/* Punch a hole in the disk file for every block that gets freed */
+int discard_freed = 0;
+
+/* Largest readahead window, in blocks */
+int readahead_max = READAHEAD_MAX;
+
+/* Guards the free-space bitmap, the allocation hint, changes to the block
+ * table and reference nodes, and the reference counts and content index.
+ * Taken last, after dir_lock if both are needed. */
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hand the chains of deleted files to a background thread to free */
+int deferred_free = 0;
+int mounted = 0;
+/* Chains waiting for the reclaimer, oldest at (reclaim_first), each with the
+ * number of blocks it was counted as. All of it is guarded by alloc_lock. */
+int reclaim_queue[RECLAIM_QUEUE];
+int reclaim_blocks[RECLAIM_QUEUE];
+int reclaim_first;
+int reclaim_count;
+/* Blocks counted as free that the reclaimer has yet to release */
+int reclaim_pending;
+int reclaim_stop;
+pthread_t reclaim_thread;
+int reclaim_running = 0;
+/* Signalled when a chain is queued, and when one has been freed */
+pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;
+
+/* Every call that changes metadata holds this shared from start to finish. A
+ * commit holds it exclusively while it copies out the changed blocks, so a
+ * transaction always holds whole calls. Taken before any descriptor or file
+ * lock, and never while holding one. */
+pthread_rwlock_t journal_handles = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+/* Serialises commits and checkpoints, and guards everything below it up to
+ * checkpoint_dirty. Taken before journal_handles. */
+pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Next unused block of the journal region */
+int journal_head;
+/* Sequence number of the transaction at the start of the journal region */
+unsigned int journal_base;
+/* Metadata blocks changed since the last commit */
+int journal_dirty;
+/* Sequence number the next transaction written to the journal gets */
+unsigned int journal_seq;
+/* Transaction that calls running now belong to (only changes while
+ * journal_handles is held exclusively), and the last one made durable */
+unsigned long journal_tid;
+unsigned long journal_committed;
+/* One flag per block before the journal region, set when a committed change
+ * to it has yet to be checkpointed to its home block */
+char* checkpoint_dirty;
+/* Make each call that changes metadata wait until its changes are committed */
+int journal_sync = 0;
+/* Set whenever the calling thread changes metadata */
+__thread int journal_touched;
+/* Transaction whose commit would give the calling thread back blocks it ran
+ * out of, or 0 */
+__thread unsigned long journal_starved;
+/* Set for the first try of a call that journal_retry may make once more */
+__thread int journal_quiet;
+/* Messages held back until journal_retry knows whether the call gets
+ * another try */
+__thread char* journal_held[JOURNAL_HELD];
+__thread int journal_held_count;
+
+/* Counters behind fs_get_stats */
+fs_stats counters;
+/* Count and time calls; fs_set_stats turns this off */
+int stats_enabled = 1;
+
+/* Start of a counted call: when it started, and the block I/O its thread had
+ * done by then */
+typedef struct t_op_timer {
+  long start; // monotonic nanoseconds, 0 if not counting
+  unsigned long reads; // block reads issued by the thread so far
+  unsigned long writes; // block writes issued by the thread so far
+} op_timer;
+
+#ifdef FS_NO_STATS
+#define COUNT(field, n) ((void) (n))
+#define stats_begin(timer, op) ((void) (timer), disk_trace_tag((op) + 1))
+#define stats_end(timer, op, ret) (disk_trace_tag(0), (ret))
+#else
+#define COUNT(field, n) \
+  do { \
+    if (stats_enabled) { \
+      __atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED); \
+    } \
+  } while (0)
+void stats_begin(op_timer* timer, int op);
+int stats_end(op_timer* timer, int op, int ret);
+#endif
+
+/* Entry (n) of an open file's block map, and the chunks a map can have */
+#define MAP_ENTRY(file, n) ((file)->map[(n) / MAP_CHUNK][(n) % MAP_CHUNK])
+#define MAP_CHUNKS ((NODE_COUNT + MAP_CHUNK - 1) / MAP_CHUNK)
 
 /* Helper function prototypes */
 int search_directory(char* fname);
-short get_block_ptr(int block);
-int set_block_ptr(int block, short ptr);
+unsigned int hash_name(char* fname);
+void dir_hash_insert(int di);
+void dir_hash_remove(int di);
+void dirty_entry(int di);
+int load_directory();
+int alloc_tables();
+void free_tables();
+int region_io(int write, int start, int count, char* data, char* dirty);
+char* meta_block(int block, char** dirty);
+void dirty_bitmap(int block);
+void mark_dirty(char* flag);
+void journal_begin();
+int journal_end(int ret);
+int journal_commit(unsigned long tid, int checkpoint_now);
+int journal_retry(int failed);
+void journal_report(char* message);
+void release_committed(int committed);
+int journal_write(int count, int* homes, char* blocks);
+int journal_replay(unsigned int* seq);
+unsigned long journal_checksum(char* data, size_t len);
+int checkpoint();
+int journal_rewind();
+int get_block_ptr(int block);
+int set_block_ptr(int block, int ptr);
 void free_list(int head);
+int free_batch(int head, int max);
+void* reclaimer(void* arg);
+int start_reclaimer();
+void stop_reclaimer();
+int load_block_table();
+int load_refs();
+int sync_super_block();
+uint64_t taken_word(int w);
+int alloc_block();
+int alloc_block_near(int goal);
+int find_free_run(int from, int want);
+void release_block(int block);
+int alloc_ref();
+void release_ref(int node);
+void set_ref_target(int node, int block);
+void put_block(int block);
+int data_block(int node);
+int node_read(int node, char* buf);
+int node_write(int node, char* data);
+int dedup_store(int node, char* data);
+unsigned int dedup_hash(char* data);
+int dedup_lookup(unsigned int hash);
+void dedup_insert(int block);
+void dedup_remove(int block);
+void set_block_hash(int block, unsigned int hash);
+int lock_file(int fildes, int write);
+void unlock_file(int fildes);
+open_file* lock_open_file(int fildes, int write);
+void unlock_open_file(open_file* file);
+void readahead(file_descriptor* fd, int first, int last);
+int file_read(file_descriptor* fd, void* buf, size_t nbyte);
+int file_write(file_descriptor* fd, void* buf, size_t nbyte);
+int file_fallocate(file_descriptor* fd, off_t length);
+int file_truncate(file_descriptor* fd, off_t length);
+int map_block(open_file* file, int n, int grow);
+int map_tail(open_file* file);
+int hold_tail(open_file* file, int n, unsigned int size);
+int flush_tail(open_file* file);
+int promote_file(open_file* file);
+int cluster_bytes(unsigned int size, int c);
+int locate_cluster(open_file* file, int c, int* blocks);
+int load_cluster(open_file* file, int c, char* dst);
+int hold_cluster(open_file* file, int c);
+int flush_cluster(open_file* file);
+int cluster_read(file_descriptor* fd, void* buf, size_t nbyte);
+int cluster_write(file_descriptor* fd, void* buf, size_t nbyte);
+int lz_compress(char* src, int len, char* dst, int cap);
+int lz_decompress(char* src, int len, char* dst, int cap);
+int lz_sequence(char* dst, int out, int cap, char* literals, int count,
+                int offset, int match);
+int lz_put_length(char* dst, int out, int n);
+int lz_get_length(unsigned char* src, int* in, int len, int n);
+
+/* Bodies of the counted calls */
+int op_sync();
+int op_open(char* name);
+int op_close(int fildes);
+int op_create(char* name);
+int op_delete(char* name);
+int op_read(int fildes, void* buf, size_t nbyte);
+int op_write(int fildes, void* buf, size_t nbyte);
+int op_pread(int fildes, void* buf, size_t nbyte, off_t offset);
+int op_pwrite(int fildes, void* buf, size_t nbyte, off_t offset);
+int op_fallocate(int fildes, off_t length);
+int op_lseek(int fildes, off_t offset);
+int op_truncate(int fildes, off_t length);
 
 int make_fs(char* disk_name){
+  return make_fs_geometry(disk_name, DEFAULT_DISK_BLOCKS, DEFAULT_BLOCK_SIZE);
+}
+
+int make_fs_geometry(char* disk_name, int blocks, int block_size){
+  if (blocks % 64 != 0 || blocks > FS_MAX_BLOCKS
+      || disk_set_geometry(blocks, block_size)
+      || DATA_START >= DISK_BLOCKS) {
+    fprintf(stderr, "make_fs: Invalid disk geometry.\n");
+    return -1;
+  }
+
   if(make_disk(disk_name)) {
     fprintf(stderr, "make_fs: Could not create disk.\n");
     return -1;
   }
 
+  if(open_disk(disk_name)) {
+    fprintf(stderr, "make_fs: Could not open disk.\n");
+    return -1;
+  }
+
+  if (alloc_tables()) {
+    fprintf(stderr, "make_fs: Could not allocate free-space bitmap.\n");
+    close_disk();
+    return -1;
+  }
+
+  /* A zeroed disk already has an empty directory, block table and journal, so
+   * only the super block header and the reserved blocks need to be recorded */
+  int i;
+  for (i = SUPER_BLOCK; i < DATA_START; i++) {
+    block_bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+  }
+
+  journal_seq = 1;
+  int failed = sync_super_block()
+    || region_io(1, BITMAP_START, BITMAP_BLOCKS, (char*) block_bitmap, NULL);
+  free_tables();
+  if (failed) {
+    fprintf(stderr, "make_fs: Could not write super block.\n");
+    close_disk();
+    return -1;
+  }
+
+  if(close_disk()) {
+    fprintf(stderr, "make_fs: Could not close disk.\n");
+    return -1;
+  }
+
   return 0;
 }
 
 int mount_fs(char* disk_name){
-  if(open_disk(disk_name)) {
+  /* The header sits at the start of the image whatever the block size, so it
+   * can be read with the smallest one before the geometry is known */
+  char buffer[MIN_BLOCK_SIZE];
+  if (disk_set_geometry(1, MIN_BLOCK_SIZE) || open_disk(disk_name)) {
     fprintf(stderr, "mount_fs: Could not open disk.\n");
     return -1;
   }
 
-  /* Read entire super block into buffer */
-  char* buffer = malloc(BLOCK_SIZE);
-  if(block_read(SUPER_BLOCK, buffer)) {
+  int failed = block_read(SUPER_BLOCK, buffer);
+  close_disk();
+  if (failed) {
     fprintf(stderr, "mount_fs: Failed to read super block from disk.\n");
     return -1;
   }
-  /* Extract directory table into memory */
-  memcpy(&directory, buffer, sizeof(directory));
-  free(buffer);
 
-  /* Initialize descriptor table */
+  /* Refuse disks that weren't formatted with this version of the layout */
+  super_header header;
+  memcpy(&header, buffer, sizeof(header));
+  if (header.magic != FS_MAGIC || header.version != FS_VERSION
+      || header.disk_blocks % 64 != 0 || header.disk_blocks > FS_MAX_BLOCKS
+      || disk_set_geometry(header.disk_blocks, header.block_size)
+      || header.bitmap_start != BITMAP_START
+      || header.bitmap_blocks != BITMAP_BLOCKS
+      || header.table_start != TABLE_START
+      || header.table_blocks != TABLE_BLOCKS
+      || header.ref_start != REF_START
+      || header.ref_blocks != REF_BLOCKS
+      || header.hash_start != HASH_START
+      || header.hash_blocks != HASH_BLOCKS
+      || header.dir_start != DIR_START
+      || header.dir_blocks != DIR_BLOCKS
+      || header.journal_start != JOURNAL_START
+      || header.journal_blocks != JOURNAL_BLOCKS
+      || header.data_start != DATA_START) {
+    fprintf(stderr, "mount_fs: Disk does not contain a valid file system.\n");
+    return -1;
+  }
+
+  if(open_disk(disk_name)) {
+    fprintf(stderr, "mount_fs: Could not open disk.\n");
+    return -1;
+  }
+
+  if (alloc_tables()) {
+    fprintf(stderr, "mount_fs: Could not allocate block tables.\n");
+    close_disk();
+    return -1;
+  }
+
+  /* Bring the home blocks up to date with every transaction committed since
+   * the last checkpoint, then start the journal over after them */
+  journal_seq = header.journal_seq;
+  int replayed = journal_replay(&journal_seq);
+  if (replayed < 0
+      || (replayed > 0 && (disk_sync() || sync_super_block() || disk_sync()))) {
+    fprintf(stderr, "mount_fs: Failed to replay journal.\n");
+    free_tables();
+    close_disk();
+    return -1;
+  }
+  journal_head = 0;
+  journal_base = journal_seq;
+  journal_dirty = 0;
+  journal_tid = 1;
+  journal_committed = 0;
+
+  /* Read free-space bitmap into memory */
+  if (region_io(0, BITMAP_START, BITMAP_BLOCKS, (char*) block_bitmap, NULL)) {
+    fprintf(stderr, "mount_fs: Failed to read free-space bitmap from disk.\n");
+    free_tables();
+    close_disk();
+    return -1;
+  }
+  alloc_hint = 0;
+
   int i;
+  free_blocks = DISK_BLOCKS;
+  for (i = 0; i < DISK_BLOCKS / 64; i++) {
+    free_blocks -= __builtin_popcountll(block_bitmap[i]);
+  }
+
+  /* Read the directory region and index it by filename */
+  if (load_directory()) {
+    fprintf(stderr, "mount_fs: Failed to load directory from disk.\n");
+    free_tables();
+    close_disk();
+    return -1;
+  }
+
+  /* Pull every next pointer into memory so chain walks never touch the disk */
+  if (load_block_table()) {
+    fprintf(stderr, "mount_fs: Failed to load block table from disk.\n");
+    free_tables();
+    close_disk();
+    return -1;
+  }
+
+  /* Count the references to each shared block and index their contents */
+  if (load_refs()) {
+    fprintf(stderr, "mount_fs: Failed to load reference nodes from disk.\n");
+    free_tables();
+    close_disk();
+    return -1;
+  }
+
+  /* Initialize descriptor and open file tables */
   for (i = 0; i < MAX_DESCRIPTORS; i++) {
     descriptor_table[i].directory_i = -1;
+    pthread_mutex_init(&descriptor_table[i].lock, NULL);
+    open_files[i].refs = 0;
+    open_files[i].map = NULL;
+    open_files[i].mapped = 0;
+    open_files[i].tail_buf = NULL;
+    open_files[i].tail_n = -1;
+    open_files[i].clusters = NULL;
+    open_files[i].cluster_known = 0;
+    open_files[i].cluster_cap = 0;
+    open_files[i].cluster_buf = NULL;
+    open_files[i].cluster_n = -1;
+    pthread_rwlock_init(&open_files[i].lock, NULL);
+    pthread_mutex_init(&open_files[i].map_lock, NULL);
+    pthread_mutex_init(&open_files[i].cluster_lock, NULL);
   }
   descriptors = 0;
 
+  reclaim_first = 0;
+  reclaim_count = 0;
+  reclaim_pending = 0;
+  mounted = 1;
+  if (deferred_free && start_reclaimer()) {
+    fprintf(stderr, "mount_fs: Could not start reclaimer, freeing inline.\n");
+  }
+
   return 0;
 }
 
 int umount_fs(char* disk_name){
+  if (!mounted) {
+    fprintf(stderr, "umount_fs: No file system is mounted.\n");
+    return -1;
+  }
+
   if (descriptors > 0) {
     fprintf(stderr, "umount_fs: There are still open file descriptors.\n");
     return -1;
   }
 
-  /* Copy directory table into super block buffer */
-  char* buffer = malloc(BLOCK_SIZE);
-  memset(buffer, 0, BLOCK_SIZE);
-  memcpy(buffer, &directory, sizeof(directory));
+  /* Let the reclaimer finish every queued chain before the bitmap is written */
+  stop_reclaimer();
+  mounted = 0;
 
-  /* Write super block to disk */
-  block_write(SUPER_BLOCK, buffer);
-  free(buffer);
+  /* Commit what is left and write all of it home, leaving the journal empty */
+  if (journal_commit(journal_tid, 1)) {
+    fprintf(stderr, "umount_fs: Could not write back metadata.\n");
+    return -1;
+  }
 
-  if(close_disk()) {
+  /* The disk is closed even when its last write-back fails, so the tables
+   * are released either way and only the result reports the failure */
+  int failed = close_disk();
+  if (failed) {
     fprintf(stderr, "umount_fs: Could not close disk.\n");
+  }
+  free_tables();
+
+  int i;
+  for (i = 0; i < MAX_DESCRIPTORS; i++) {
+    pthread_mutex_destroy(&descriptor_table[i].lock);
+    pthread_rwlock_destroy(&open_files[i].lock);
+    pthread_mutex_destroy(&open_files[i].map_lock);
+    pthread_mutex_destroy(&open_files[i].cluster_lock);
+  }
+
+  return failed ? -1 : 0;
+}
+
+int fs_sync(){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_SYNC);
+  journal_quiet = 1;
+  int ret = op_sync();
+  if (journal_retry(ret == -1)) {
+    ret = op_sync();
+  }
+  return stats_end(&timer, FS_OP_SYNC, ret);
+}
+
+int op_sync(){
+  /* Hand buffered writes to the disk first; an unused slot has nothing */
+  journal_begin();
+  int i;
+  for (i = 0; i < MAX_DESCRIPTORS; i++) {
+    pthread_rwlock_wrlock(&open_files[i].lock);
+    int failed = flush_tail(&open_files[i]);
+    pthread_rwlock_unlock(&open_files[i].lock);
+
+    if (failed) {
+      journal_end(-1);
+      journal_report("fs_sync: Could not write buffered data.");
+      return -1;
+    }
+  }
+
+  /* Everything up to here goes in the next commit, which writes back the
+   * block cache too */
+  unsigned long tid = journal_tid;
+  if (journal_end(0) || journal_commit(tid, 0)) {
+    fprintf(stderr, "fs_sync: Could not commit changes.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int fs_set_journal_sync(int enable){
+  journal_sync = enable;
+  return 0;
+}
+
+int fs_set_compressed(int fildes, int enable){
+  journal_begin();
+  if (lock_file(fildes, 1)) {
+    fprintf(stderr, "fs_set_compressed: Invalid file descriptor.\n");
+    return journal_end(-1);
+  }
+
+  /* Only a file without blocks has nothing stored the other way */
+  int di = descriptor_table[fildes].directory_i;
+  if (directory[di].start != BLOCK_INLINE) {
+    unlock_file(fildes);
+    fprintf(stderr, "fs_set_compressed: File already has blocks.\n");
+    return journal_end(-1);
+  }
+
+  pthread_mutex_lock(&dir_lock);
+  if (enable) {
+    directory[di].flags |= FILE_COMPRESSED;
+  } else {
+    directory[di].flags &= ~FILE_COMPRESSED;
+  }
+  dirty_entry(di);
+  pthread_mutex_unlock(&dir_lock);
+
+  unlock_file(fildes);
+  return journal_end(0);
+}
+
+int fs_set_dedup(int enable){
+  dedup_enabled = enable;
+  return 0;
+}
+
+int fs_set_discard(int enable){
+  discard_freed = enable;
+  return 0;
+}
+
+int fs_set_deferred_free(int enable){
+  if (!mounted) {
+    deferred_free = enable;
+    return 0;
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  int running = reclaim_running;
+  pthread_mutex_unlock(&alloc_lock);
+
+  if (enable && !running && start_reclaimer()) {
+    fprintf(stderr, "fs_set_deferred_free: Could not start reclaimer.\n");
+    return -1;
+  }
+  if (!enable) {
+    stop_reclaimer();
+  }
+
+  deferred_free = enable;
+  return 0;
+}
+
+int fs_get_free_blocks(){
+  pthread_mutex_lock(&alloc_lock);
+  int blocks = free_blocks + reclaim_pending;
+  pthread_mutex_unlock(&alloc_lock);
+  return blocks;
+}
+
+int fs_set_stats(int enable){
+  stats_enabled = enable;
+  disk_set_timing(enable);
+  return 0;
+}
+
+int fs_get_stats(fs_stats* stats){
+  /* Every counter is an unsigned long, updated atomically */
+  unsigned long* from = (unsigned long*) &counters;
+  unsigned long* to = (unsigned long*) stats;
+  int i;
+  for (i = 0; i < offsetof(fs_stats, disk) / sizeof(unsigned long); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+
+  disk_get_stats(&stats->disk);
+  return 0;
+}
+
+int fs_reset_stats(){
+  unsigned long* from = (unsigned long*) &counters;
+  int i;
+  for (i = 0; i < offsetof(fs_stats, disk) / sizeof(unsigned long); i++) {
+    __atomic_store_n(&from[i], 0, __ATOMIC_RELAXED);
+  }
+
+  disk_reset_stats();
+  return 0;
+}
+
+int fs_set_readahead(int blocks){
+  if (blocks < 0 || blocks > READAHEAD_MAX) {
+    fprintf(stderr, "fs_set_readahead: Invalid window.\n");
     return -1;
   }
 
+  readahead_max = blocks;
   return 0;
 }
 
 int fs_open(char* name){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_OPEN);
+  return stats_end(&timer, FS_OP_OPEN, op_open(name));
+}
+
+int op_open(char* name){
+  pthread_mutex_lock(&dir_lock);
 
   /* Get file from directory */
   int di = search_directory(name);
   if (di == -1) {
+    pthread_mutex_unlock(&dir_lock);
     fprintf(stderr, "fs_open: Couldn't find file %s.\n", name);
     return -1;
   }
 
-  /* Insert new file descriptor into first open slot in table */
+  /* Find the first open slot in the descriptor table */
   int i;
   for (i = 0; i < MAX_DESCRIPTORS; i++) {
     if (descriptor_table[i].directory_i == -1) {
-      descriptor_table[i].directory_i = di;
-      descriptor_table[i].offset = 0;
-      return i;
+      break;
     }
   }
 
   /* Table is full */
-  fprintf(stderr, "fs_open: Too many open file descriptors.\n");
-  return -1;
+  if (i == MAX_DESCRIPTORS) {
+    pthread_mutex_unlock(&dir_lock);
+    fprintf(stderr, "fs_open: Too many open file descriptors.\n");
+    return -1;
+  }
+
+  /* Share the open file entry with other descriptors on the same file; there
+   * is always a free one, since there are as many as descriptors */
+  int fi, free_fi = -1;
+  for (fi = 0; fi < MAX_DESCRIPTORS; fi++) {
+    if (open_files[fi].refs == 0) {
+      if (free_fi == -1) {
+        free_fi = fi;
+      }
+    } else if (open_files[fi].directory_i == di) {
+      break;
+    }
+  }
+  /* A free entry has nothing buffered, since fs_close only lets go of one
+   * once its buffer is written out, so its tail needs no reset here, where
+   * fs_sync, holding only the file lock, could be looking at it */
+  if (fi == MAX_DESCRIPTORS) {
+    fi = free_fi;
+    open_files[fi].directory_i = di;
+  }
+  open_files[fi].refs++;
+
+  descriptor_table[i].file_i = fi;
+  descriptor_table[i].offset = 0;
+  descriptor_table[i].ra_next = 0;
+  descriptor_table[i].ra_window = 0;
+  descriptor_table[i].ra_mark = 0;
+  descriptor_table[i].directory_i = di;
+  descriptors++;
+
+  pthread_mutex_unlock(&dir_lock);
+  return i;
 }
 
 int fs_close(int fildes){
-  if (fildes < 0 || fildes >= MAX_DESCRIPTORS
-      || descriptor_table[fildes].directory_i == -1) {
+  op_timer timer;
+  stats_begin(&timer, FS_OP_CLOSE);
+  journal_begin();
+  journal_quiet = 1;
+  int ret = journal_end(op_close(fildes));
+  if (journal_retry(ret == -1)) {
+    journal_begin();
+    ret = journal_end(op_close(fildes));
+  }
+  return stats_end(&timer, FS_OP_CLOSE, ret);
+}
+
+int op_close(int fildes){
+  if (fildes < 0 || fildes >= MAX_DESCRIPTORS) {
     fprintf(stderr, "fs_close: Invalid file descriptor.\n");
     return -1;
-  } else {
-    descriptor_table[fildes].directory_i = -1;
-    return 0;
   }
+
+  /* Calls that use the descriptor's offset hold it throughout, so taking it
+   * waits for them and keeps new ones out */
+  file_descriptor* fd = &descriptor_table[fildes];
+  pthread_mutex_lock(&fd->lock);
+
+  if (fd->directory_i == -1) {
+    pthread_mutex_unlock(&fd->lock);
+    fprintf(stderr, "fs_close: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  /* Positional calls only hold the file, so it stays locked until its
+   * buffers are gone, and the last of them to finish has done so already */
+  open_file* file = &open_files[fd->file_i];
+  pthread_rwlock_wrlock(&file->lock);
+
+  /* Data that can't be written out stays buffered on a descriptor that stays
+   * open, so fs_sync or another fs_close can retry once there is room */
+  if (flush_tail(file)) {
+    pthread_rwlock_unlock(&file->lock);
+    pthread_mutex_unlock(&fd->lock);
+    journal_report("fs_close: Could not write buffered data.");
+    return -1;
+  }
+
+  pthread_mutex_lock(&dir_lock);
+
+  /* The block map, cluster index and buffers go with the last descriptor, so
+   * only open files keep them */
+  if (--file->refs == 0) {
+    if (file->map) {
+      int i;
+      for (i = 0; i < MAP_CHUNKS; i++) {
+        free(file->map[i]);
+      }
+    }
+    free(file->map);
+    file->map = NULL;
+    file->mapped = 0;
+    free(file->tail_buf);
+    file->tail_buf = NULL;
+    file->tail_n = -1;
+    free(file->clusters);
+    file->clusters = NULL;
+    file->cluster_known = 0;
+    file->cluster_cap = 0;
+    free(file->cluster_buf);
+    file->cluster_buf = NULL;
+    file->cluster_n = -1;
+  }
+  fd->directory_i = -1;
+  descriptors--;
+
+  pthread_mutex_unlock(&dir_lock);
+  pthread_rwlock_unlock(&file->lock);
+  pthread_mutex_unlock(&fd->lock);
+  return 0;
 }
 
 int fs_create(char* name){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_CREATE);
+  journal_begin();
+  return stats_end(&timer, FS_OP_CREATE, journal_end(op_create(name)));
+}
+
+int op_create(char* name){
   /* Check name length < 15 characters */
   int len = strlen(name);
   if (len >= MAX_FNAME) {
     fprintf(stderr, "fs_create: File name too long (> 15 characters).\n");
     return -1;
   }
-  
-  /* Get first free entry in directory, and check that name is unique */
-  int di = -1;
-  int i;
-  for (i = 0; i < MAX_FILES; i++) {
-    if (directory[i].start == 0) {
-      /* Entry is free */
-      if (di == -1) {
-        di = i;
-      }
-    } else {
-      /* Entry is used */
-      if (!strcmp(name, directory[i].filename)) {
-        /* Entry name matches new file name! */
-        fprintf(stderr, "fs_create: File %s already exists on disk.\n", name);
-        return -1;
-      }
-    }
-  }
 
-  /* If no entries are free, disk is at capacity */
-  if (di == -1) {
-    fprintf(stderr, "fs_create: Disk is at file capacity (64 files).\n");
+  pthread_mutex_lock(&dir_lock);
+  
+  /* Check that name is unique */
+  if (search_directory(name) != -1) {
+    pthread_mutex_unlock(&dir_lock);
+    fprintf(stderr, "fs_create: File %s already exists on disk.\n", name);
     return -1;
   }
 
-  /* Allocate first free block */
-  int block_i = -1;
-  for (i = 1; i < DISK_BLOCKS; i++) {
-    if (get_block_ptr(i) == BLOCK_FREE) {
-      block_i = i;
+  /* Get first free entry in directory */
+  int di;
+  for (di = dir_free_hint; di < MAX_FILES; di++) {
+    if (directory[di].start == 0) {
       break;
     }
   }
+  dir_free_hint = di;
 
-  /* If no blocks are free, disk is at capacity */
-  if (block_i == -1) {
-    fprintf(stderr, "fs_create: Disk is at block capacity.\n");
-    return -1;
-  }
-  
-  /* Mark block as allocated */
-  if(set_block_ptr(block_i, BLOCK_TERMINATOR)) {
-    fprintf(stderr, "fs_create: Block allocation failed.\n");
+  /* If no entries are free, disk is at capacity */
+  if (di == MAX_FILES) {
+    pthread_mutex_unlock(&dir_lock);
+    fprintf(stderr, "fs_create: Disk is at file capacity (%d files).\n",
+            MAX_FILES);
     return -1;
   }
-    
+
   /* Set directory name to new name, and pad with 0s */
+  int i;
   for (i = 0; i < MAX_FNAME; i++) {
     directory[di].filename[i] = (i < len ? name[i] : 0);
   }
 
-  directory[di].start = block_i;
+  /* The file starts out inline, so creating it allocates no block */
+  directory[di].start = BLOCK_INLINE;
   directory[di].size = 0;
+  directory[di].flags = 0;
+  memset(directory[di].data, 0, INLINE_MAX);
+  dirty_entry(di);
+  dir_hash_insert(di);
 
+  pthread_mutex_unlock(&dir_lock);
   return 0;
 }
 
 int fs_delete(char* name){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_DELETE);
+  journal_begin();
+  return stats_end(&timer, FS_OP_DELETE, journal_end(op_delete(name)));
+}
+
+int op_delete(char* name){
+  pthread_mutex_lock(&dir_lock);
+
   /* Find file in directory */
   int di = search_directory(name);
   if (di == -1) {
+    pthread_mutex_unlock(&dir_lock);
     fprintf(stderr, "fs_delete: File %s does not exist on disk.\n", name);
     return -1;
   }
@@ -184,165 +874,3279 @@ int fs_delete(char* name){
   /* Make sure no descriptors to this file exist */
   int i;
   for (i = 0; i < MAX_DESCRIPTORS; i++) {
-    if (descriptor_table[i].directory_i == di) {
+    if (open_files[i].refs > 0 && open_files[i].directory_i == di) {
+      pthread_mutex_unlock(&dir_lock);
       fprintf(stderr, "fs_delete: There are open descriptors to file %s.\n",
               name);
       return -1;
     }
   }
 
-  /* Mark all blocks in list as free */
-  free_list(directory[di].start);
+  /* Mark all blocks in list as free, or leave that to the reclaimer and count
+   * them as free already. A file holds at least as many blocks as its size
+   * needs; blocks reserved past that show up once they are released. An
+   * inline file has none, and a compressed one, or one that shares blocks,
+   * is only counted as one. */
+  pthread_mutex_lock(&alloc_lock);
+  if (directory[di].start == BLOCK_INLINE) {
+    memset(directory[di].data, 0, INLINE_MAX);
+  } else if (reclaim_running && reclaim_count < RECLAIM_QUEUE) {
+    int blocks = (directory[di].size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    if (blocks == 0
+        || (directory[di].flags & (FILE_COMPRESSED | FILE_DEDUP))) {
+      blocks = 1;
+    }
+
+    int slot = (reclaim_first + reclaim_count) % RECLAIM_QUEUE;
+    reclaim_queue[slot] = directory[di].start;
+    reclaim_blocks[slot] = blocks;
+    reclaim_count++;
+    reclaim_pending += blocks;
+    pthread_cond_signal(&reclaim_work);
+  } else {
+    free_list(directory[di].start);
+  }
+  pthread_mutex_unlock(&alloc_lock);
   
   /* Mark directory entry as free */
+  dir_hash_remove(di);
   directory[di].start = 0;
-  
+  dirty_entry(di);
+  if (di < dir_free_hint) {
+    dir_free_hint = di;
+  }
+
+  pthread_mutex_unlock(&dir_lock);
   return 0;
 }
 
 int fs_read(int fildes, void* buf, size_t nbyte){
-  // TODO
-  return -1;
+  op_timer timer;
+  stats_begin(&timer, FS_OP_READ);
+  return stats_end(&timer, FS_OP_READ, op_read(fildes, buf, nbyte));
 }
 
-int fs_write(int fildes, void* buf, size_t nbyte){
-  // TODO
-  return -1;
-}
+int op_read(int fildes, void* buf, size_t nbyte){
+  if (lock_file(fildes, 0)) {
+    fprintf(stderr, "fs_read: Invalid file descriptor.\n");
+    return -1;
+  }
 
-int fs_get_filesize(int fildes){
-  // TODO
-  return -1;
+  file_descriptor* fd = &descriptor_table[fildes];
+  int start = fd->offset;
+  int ret = file_read(fd, buf, nbyte);
+
+  /* Offsets in a compressed file don't map to block positions */
+  if (ret > 0 && !(directory[fd->directory_i].flags & FILE_COMPRESSED)) {
+    readahead(fd, start >> BLOCK_SHIFT, (start + ret - 1) >> BLOCK_SHIFT);
+  }
+
+  unlock_file(fildes);
+  return ret;
 }
 
-int fs_lseek(int fildes, off_t offset){
-  
-  int fsize = fs_get_filesize(fildes);
+int fs_write(int fildes, void* buf, size_t nbyte){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_WRITE);
+  journal_begin();
+  journal_quiet = 1;
+  int ret = journal_end(op_write(fildes, buf, nbyte));
 
-  if (fsize == -1) {
-    fprintf(stderr, "fs_lseek: Cannot determine size of file.\n");
-    return -1;
+  /* A write that ran out of blocks waiting for a commit carries on from
+   * where it stopped; one that failed outright wrote nothing */
+  if (journal_retry(ret != nbyte)) {
+    int done = ret > 0 ? ret : 0;
+    journal_begin();
+    int more = journal_end(op_write(fildes, (char*) buf + done, nbyte - done));
+    ret = more > 0 ? done + more : (done ? done : more);
   }
-  
-  if (offset < 0 || offset > fsize) {
-    fprintf(stderr, "fs_lseek: Seek offset out of bounds.\n");
+  return stats_end(&timer, FS_OP_WRITE, ret);
+}
+
+int op_write(int fildes, void* buf, size_t nbyte){
+  if (lock_file(fildes, 1)) {
+    fprintf(stderr, "fs_write: Invalid file descriptor.\n");
     return -1;
   }
 
-  descriptor_table[fildes].offset = offset;
-  return 0;
+  int ret = file_write(&descriptor_table[fildes], buf, nbyte);
+  unlock_file(fildes);
+  return ret;
 }
 
-int fs_truncate(int fildes, off_t length){
+int fs_pread(int fildes, void* buf, size_t nbyte, off_t offset){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_PREAD);
+  return stats_end(&timer, FS_OP_PREAD, op_pread(fildes, buf, nbyte, offset));
+}
 
-  int fsize = fs_get_filesize(fildes);
-  if (fsize == -1) {
-    fprintf(stderr, "fs_truncate: Cannot determine size of file.\n");
+int op_pread(int fildes, void* buf, size_t nbyte, off_t offset){
+  open_file* file = lock_open_file(fildes, 0);
+  if (!file) {
+    fprintf(stderr, "fs_pread: Invalid file descriptor.\n");
     return -1;
   }
 
-  if (length > fsize) {
-    fprintf(stderr,
-            "fs_truncate: Cannot truncate to length greater than file size.\n");
+  if (offset < 0) {
+    unlock_open_file(file);
+    fprintf(stderr, "fs_pread: Invalid offset.\n");
     return -1;
-  } else if (length < fsize) {
-    int new_blocksize = length / (BLOCK_SIZE - 2);
+  }
 
-    int block_i = directory[descriptor_table[fildes].directory_i].start;
-    int i;
-    for (i = 0; i < new_blocksize; i++) {
-      block_i = get_block_ptr(block_i);
-    }
+  /* Read through a private copy, so the descriptor's offset is left alone */
+  file_descriptor cursor;
+  cursor.directory_i = file->directory_i;
+  cursor.file_i = file - open_files;
 
-    int tail = get_block_ptr(block_i);
+  int ret = 0;
+  if (offset < directory[file->directory_i].size) {
+    cursor.offset = offset;
+    ret = file_read(&cursor, buf, nbyte);
+  }
 
-    if (set_block_ptr(tail, BLOCK_TERMINATOR)) {
-      fprintf(stderr, "fs_truncate: Couldn't set new file end block.\n");
-      return -1;
-    }
+  unlock_open_file(file);
+  return ret;
+}
+
+int fs_pwrite(int fildes, void* buf, size_t nbyte, off_t offset){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_PWRITE);
+  journal_begin();
+  journal_quiet = 1;
+  int ret = journal_end(op_pwrite(fildes, buf, nbyte, offset));
+
+  /* Like fs_write, once blocks waiting for a commit are back */
+  if (journal_retry(ret != nbyte)) {
+    int done = ret > 0 ? ret : 0;
+    journal_begin();
+    int more = journal_end(op_pwrite(fildes, (char*) buf + done, nbyte - done,
+                                     offset + done));
+    ret = more > 0 ? done + more : (done ? done : more);
+  }
+  return stats_end(&timer, FS_OP_PWRITE, ret);
+}
 
-    free_list(tail);
+int op_pwrite(int fildes, void* buf, size_t nbyte, off_t offset){
+  open_file* file = lock_open_file(fildes, 1);
+  if (!file) {
+    fprintf(stderr, "fs_pwrite: Invalid file descriptor.\n");
+    return -1;
   }
 
-  return 0;
+  /* Like fs_lseek, writing may start at the end of the file but not past it */
+  if (offset < 0 || offset > directory[file->directory_i].size) {
+    unlock_open_file(file);
+    fprintf(stderr, "fs_pwrite: Write offset out of bounds.\n");
+    return -1;
+  }
+
+  file_descriptor cursor;
+  cursor.directory_i = file->directory_i;
+  cursor.file_i = file - open_files;
+  cursor.offset = offset;
+
+  int ret = file_write(&cursor, buf, nbyte);
+  unlock_open_file(file);
+  return ret;
+}
+
+int fs_get_filesize(int fildes){
+  if (lock_file(fildes, 0)) {
+    fprintf(stderr, "fs_get_filesize: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  int size = directory[descriptor_table[fildes].directory_i].size;
+  unlock_file(fildes);
+  return size;
+}
+
+int fs_fallocate(int fildes, off_t length){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_FALLOCATE);
+  journal_begin();
+  journal_quiet = 1;
+  int ret = journal_end(op_fallocate(fildes, length));
+  if (journal_retry(ret == -1)) {
+    journal_begin();
+    ret = journal_end(op_fallocate(fildes, length));
+  }
+  return stats_end(&timer, FS_OP_FALLOCATE, ret);
+}
+
+int op_fallocate(int fildes, off_t length){
+  if (lock_file(fildes, 1)) {
+    fprintf(stderr, "fs_fallocate: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  int ret = file_fallocate(&descriptor_table[fildes], length);
+  unlock_file(fildes);
+  return ret;
+}
+
+int fs_get_fragments(int fildes){
+  if (lock_file(fildes, 0)) {
+    fprintf(stderr, "fs_get_fragments: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  int block_i = directory[descriptor_table[fildes].directory_i].start;
+  if (block_i == BLOCK_INLINE) {
+    unlock_file(fildes);
+    return 0;
+  }
+
+  /* With dedup the chain holds reference nodes, so compare the blocks their
+   * data is in */
+  int fragments = 1;
+  int hops = 0;
+  int next;
+  while ((next = get_block_ptr(block_i)) != BLOCK_TERMINATOR) {
+    if (data_block(next) != data_block(block_i) + 1) {
+      fragments++;
+    }
+    block_i = next;
+    hops++;
+  }
+  COUNT(chain_hops, hops);
+
+  unlock_file(fildes);
+  return fragments;
+}
+
+int fs_lseek(int fildes, off_t offset){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_LSEEK);
+  return stats_end(&timer, FS_OP_LSEEK, op_lseek(fildes, offset));
+}
+
+int op_lseek(int fildes, off_t offset){
+  if (lock_file(fildes, 0)) {
+    fprintf(stderr, "fs_lseek: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  int fsize = directory[descriptor_table[fildes].directory_i].size;
+  
+  if (offset < 0 || offset > fsize) {
+    unlock_file(fildes);
+    fprintf(stderr, "fs_lseek: Seek offset out of bounds.\n");
+    return -1;
+  }
+
+  descriptor_table[fildes].offset = offset;
+  unlock_file(fildes);
+  return 0;
+}
+
+int fs_truncate(int fildes, off_t length){
+  op_timer timer;
+  stats_begin(&timer, FS_OP_TRUNCATE);
+  journal_begin();
+  journal_quiet = 1;
+  int ret = journal_end(op_truncate(fildes, length));
+  if (journal_retry(ret == -1)) {
+    journal_begin();
+    ret = journal_end(op_truncate(fildes, length));
+  }
+  return stats_end(&timer, FS_OP_TRUNCATE, ret);
+}
+
+int op_truncate(int fildes, off_t length){
+  if (lock_file(fildes, 1)) {
+    fprintf(stderr, "fs_truncate: Invalid file descriptor.\n");
+    return -1;
+  }
+
+  int ret = file_truncate(&descriptor_table[fildes], length);
+  unlock_file(fildes);
+  return ret;
+}
+
+/**
+ * Reads from the file open on a descriptor at the descriptor's offset, which
+ * is advanced past the bytes read. The caller holds the file's lock.
+ *
+ * @param fd  Descriptor, or a private copy of one for positional reads.
+ * @return    Number of bytes read, or -1 on failure.
+ */
+int file_read(file_descriptor* fd, void* buf, size_t nbyte){
+  int size = directory[fd->directory_i].size;
+
+  /* Never read past the end of the file */
+  if (fd->offset >= size) {
+    return 0;
+  }
+  if (nbyte > size - fd->offset) {
+    nbyte = size - fd->offset;
+  }
+
+  /* An inline file is read straight from the directory, without any I/O */
+  if (directory[fd->directory_i].start == BLOCK_INLINE) {
+    memcpy(buf, directory[fd->directory_i].data + fd->offset, nbyte);
+    fd->offset += nbyte;
+    return nbyte;
+  }
+
+  if (directory[fd->directory_i].flags & FILE_COMPRESSED) {
+    return cluster_read(fd, buf, nbyte);
+  }
+
+  /* Only the first and last block of a request can be partial */
+  char head[BLOCK_SIZE], tail[BLOCK_SIZE];
+  int head_off = 0, head_len = 0, tail_len = 0;
+
+  char* dst = buf;
+  size_t done = 0;
+  while (done < nbyte) {
+    int block_off = fd->offset & (BLOCK_SIZE - 1);
+    int chunk = BLOCK_SIZE - block_off;
+    if (chunk > nbyte - done) {
+      chunk = nbyte - done;
+    }
+
+    /* A block held in the write buffer may not even be on the disk yet */
+    open_file* file = &open_files[fd->file_i];
+    int block_n = fd->offset >> BLOCK_SHIFT;
+    if (block_n == file->tail_n) {
+      memcpy(dst + done, file->tail_buf + block_off, chunk);
+      done += chunk;
+      fd->offset += chunk;
+      continue;
+    }
+
+    int node = map_block(file, block_n, 0);
+    if (node < 0) {
+      fprintf(stderr, "fs_read: File chain is shorter than file size.\n");
+      block_wait();
+      return -1;
+    }
+
+    /* Queue every block before waiting on any; whole blocks land straight in
+     * the caller's buffer, and a reference to zeros needs no read at all */
+    char* target = dst + done;
+    if (chunk < BLOCK_SIZE && done == 0) {
+      target = head;
+      head_off = block_off;
+      head_len = chunk;
+    } else if (chunk < BLOCK_SIZE) {
+      target = tail;
+      tail_len = chunk;
+    }
+
+    int block_i = data_block(node);
+    if (block_i == REF_EMPTY) {
+      memset(target, 0, BLOCK_SIZE);
+    } else if (block_read_async(block_i, target)) {
+      fprintf(stderr, "fs_read: Error reading block %d.\n", block_i);
+      block_wait();
+      return -1;
+    }
+
+    done += chunk;
+    fd->offset += chunk;
+  }
+
+  if (block_wait()) {
+    fprintf(stderr, "fs_read: Error reading blocks.\n");
+    return -1;
+  }
+
+  memcpy(dst, head + head_off, head_len);
+  memcpy(dst + done - tail_len, tail, tail_len);
+
+  return done;
+}
+
+/**
+ * Writes to the file open on a descriptor at the descriptor's offset, which is
+ * advanced past the bytes written. The caller holds the file's lock
+ * exclusively.
+ *
+ * @param fd  Descriptor, or a private copy of one for positional writes.
+ * @return    Number of bytes written, or -1 on failure.
+ */
+int file_write(file_descriptor* fd, void* buf, size_t nbyte){
+  directory_entry* file = &directory[fd->directory_i];
+
+  /* Offsets and sizes are ints, so no write may end past INT_MAX */
+  if (nbyte > (size_t) (INT_MAX - fd->offset)) {
+    fprintf(stderr, "fs_write: File would grow past its largest size.\n");
+    return -1;
+  }
+
+  /* An inline file stays in its directory entry as long as it fits */
+  if (file->start == BLOCK_INLINE) {
+    if (fd->offset + nbyte <= INLINE_MAX) {
+      pthread_mutex_lock(&dir_lock);
+      memcpy(file->data + fd->offset, buf, nbyte);
+      fd->offset += nbyte;
+      if (fd->offset > file->size) {
+        file->size = fd->offset;
+      }
+      dirty_entry(fd->directory_i);
+      pthread_mutex_unlock(&dir_lock);
+      return nbyte;
+    }
+
+    if (promote_file(&open_files[fd->file_i])) {
+      return -1;
+    }
+  }
+
+  if (file->flags & FILE_COMPRESSED) {
+    return cluster_write(fd, buf, nbyte);
+  }
+
+  unsigned int size = file->size;
+  char buffer[BLOCK_SIZE];
+
+  char* src = buf;
+  size_t done = 0;
+  while (done < nbyte) {
+    int block_off = fd->offset & (BLOCK_SIZE - 1);
+    int chunk = BLOCK_SIZE - block_off;
+    if (chunk > nbyte - done) {
+      chunk = nbyte - done;
+    }
+
+    open_file* of = &open_files[fd->file_i];
+    int block_n = fd->offset >> BLOCK_SHIFT;
+    int block_i;
+
+    if (block_n == of->tail_n
+        || (chunk < BLOCK_SIZE && block_n == size >> BLOCK_SHIFT)) {
+      /* Small writes at the end of the file gather in the write buffer, and
+       * only go to the disk once their block is full */
+      if (hold_tail(of, block_n, size)) {
+        fprintf(stderr, "fs_write: Error buffering block %d.\n", block_n);
+        block_wait();
+        return -1;
+      }
+
+      memcpy(of->tail_buf + block_off, src + done, chunk);
+      if (block_off + chunk == BLOCK_SIZE && flush_tail(of)) {
+        /* Disk is full; report what made it */
+        journal_report("fs_write: Disk is at block capacity.");
+        break;
+      }
+    } else if ((block_i = map_block(of, block_n, 1)) < 0) {
+      /* Disk is full; report what made it */
+      journal_report("fs_write: Disk is at block capacity.");
+      break;
+    } else if (chunk == BLOCK_SIZE) {
+      /* Whole block: queue a write straight from the caller's buffer, unless
+       * it goes through a reference node */
+      if (block_i < DISK_BLOCKS ? block_write_async(block_i, src + done)
+          : dedup_store(block_i, src + done)) {
+        fprintf(stderr, "fs_write: Error writing block %d.\n", block_i);
+        block_wait();
+        return -1;
+      }
+    } else {
+      /* Partial block inside the file: merge with its existing contents */
+      if (node_read(block_i, buffer)) {
+        fprintf(stderr, "fs_write: Error reading block %d.\n", block_i);
+        block_wait();
+        return -1;
+      }
+      memcpy(buffer + block_off, src + done, chunk);
+      if (node_write(block_i, buffer)) {
+        fprintf(stderr, "fs_write: Error writing block %d.\n", block_i);
+        block_wait();
+        return -1;
+      }
+    }
+
+    done += chunk;
+    fd->offset += chunk;
+    if (fd->offset > size) {
+      size = fd->offset;
+    }
+  }
+
+  if (size != file->size) {
+    pthread_mutex_lock(&dir_lock);
+    file->size = size;
+    dirty_entry(fd->directory_i);
+    pthread_mutex_unlock(&dir_lock);
+  }
+
+  if (block_wait()) {
+    fprintf(stderr, "fs_write: Error writing blocks.\n");
+    return -1;
+  }
+
+  return done;
+}
+
+/**
+ * Reserves blocks for the file open on a descriptor; see fs_fallocate. The
+ * caller holds the file's lock exclusively.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int file_fallocate(file_descriptor* fd, off_t length){
+  if (length < 0 || length > INT_MAX) {
+    fprintf(stderr, "fs_fallocate: Invalid length.\n");
+    return -1;
+  }
+
+  /* Space an inline file already has needs no block, and how many blocks a
+   * compressed file will need can't be told in advance */
+  open_file* file = &open_files[fd->file_i];
+  if (directory[fd->directory_i].start == BLOCK_INLINE
+      && length <= INLINE_MAX) {
+    return 0;
+  }
+  if (directory[fd->directory_i].flags & FILE_COMPRESSED) {
+    fprintf(stderr,
+            "fs_fallocate: Cannot reserve space for a compressed file.\n");
+    return -1;
+  }
+  if (directory[fd->directory_i].start == BLOCK_INLINE) {
+    if (promote_file(file)) {
+      return -1;
+    }
+  }
+
+  /* The reservation goes after the last block, so that must exist */
+  if (flush_tail(file)) {
+    journal_report("fs_fallocate: Could not write buffered data.");
+    return -1;
+  }
+
+  int want = (length + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+  int tail_n = map_tail(file);
+  if (tail_n < 0) {
+    fprintf(stderr, "fs_fallocate: Couldn't map file.\n");
+    return -1;
+  }
+  int tail = MAP_ENTRY(file, tail_n);
+  int need = want - (tail_n + 1);
+  if (need <= 0) {
+    return 0;
+  }
+
+  /* Prefer one run, starting right after the current tail if possible */
+  pthread_mutex_lock(&alloc_lock);
+  int start = find_free_run(tail + 1, need);
+  if (start != -1) {
+    int i;
+    for (i = 0; i < need; i++) {
+      block_bitmap[(start + i) / 64] |= (uint64_t) 1 << ((start + i) % 64);
+      dirty_bitmap(start + i);
+      free_blocks--;
+      COUNT(allocs, 1);
+      set_block_ptr(start + i, i + 1 < need ? start + i + 1 : BLOCK_TERMINATOR);
+    }
+    set_block_ptr(tail, start);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  /* Otherwise grow the chain a block at a time, with blocks of its own even
+   * if the file shares blocks, since that is what it asked for */
+  if (map_block(file, want - 1, 2) == -1) {
+    journal_report("fs_fallocate: Disk is at block capacity.");
+
+    /* Give back whatever was added */
+    pthread_mutex_lock(&alloc_lock);
+    int added = get_block_ptr(tail);
+    set_block_ptr(tail, BLOCK_TERMINATOR);
+    free_list(added);
+    pthread_mutex_unlock(&alloc_lock);
+    file->mapped = tail_n + 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Truncates the file open on a descriptor; see fs_truncate. The caller holds
+ * the file's lock exclusively.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int file_truncate(file_descriptor* fd, off_t length){
+  int fsize = directory[fd->directory_i].size;
+
+  if (length > fsize) {
+    fprintf(stderr,
+            "fs_truncate: Cannot truncate to length greater than file size.\n");
+    return -1;
+  } else if (length < fsize) {
+    int di = fd->directory_i;
+
+    /* An inline file only has its entry to change */
+    if (directory[di].start != BLOCK_INLINE) {
+      /* Every file with a chain keeps at least one block */
+      int new_blocks = (length + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+      if (new_blocks == 0) {
+        new_blocks = 1;
+      }
+
+      /* Buffered data may be cut off too, so it goes through the chain first */
+      open_file* file = &open_files[fd->file_i];
+      if (flush_tail(file)) {
+        journal_report("fs_truncate: Could not write buffered data.");
+        return -1;
+      }
+
+      /* A compressed file keeps the blocks up to the end of the cluster that
+       * holds its new last byte. That cluster goes into the write buffer, to
+       * be stored again without the bytes cut off. */
+      int compressed = directory[di].flags & FILE_COMPRESSED;
+      int clusters = 0;
+      if (compressed && length > 0) {
+        int c = (length - 1) / CLUSTER_SIZE;
+        if (hold_cluster(file, c)) {
+          fprintf(stderr, "fs_truncate: Could not read cluster %d.\n", c);
+          return -1;
+        }
+
+        file->tail_len = length - c * CLUSTER_SIZE;
+        memset(file->tail_buf + file->tail_len, 0,
+               CLUSTER_SIZE - file->tail_len);
+        new_blocks = file->tail_pos + file->tail_blocks;
+        clusters = c + 1;
+      }
+
+      int block_i = map_block(file, new_blocks - 1, 0);
+      if (block_i < 0) {
+        fprintf(stderr, "fs_truncate: File chain is shorter than file size.\n");
+        return -1;
+      }
+
+      int tail = get_block_ptr(block_i);
+      if (tail != BLOCK_TERMINATOR) {
+        pthread_mutex_lock(&alloc_lock);
+        if (set_block_ptr(block_i, BLOCK_TERMINATOR)) {
+          pthread_mutex_unlock(&alloc_lock);
+          fprintf(stderr, "fs_truncate: Couldn't set new file end block.\n");
+          return -1;
+        }
+
+        free_list(tail);
+        pthread_mutex_unlock(&alloc_lock);
+      }
+
+      /* Forget the freed blocks; nobody else uses the map meanwhile */
+      if (file->mapped > new_blocks) {
+        file->mapped = new_blocks;
+      }
+      if (compressed) {
+        pthread_mutex_lock(&file->cluster_lock);
+        if (file->cluster_known > clusters) {
+          file->cluster_known = clusters;
+        }
+        file->cluster_n = -1;
+        pthread_mutex_unlock(&file->cluster_lock);
+      }
+    }
+
+    /* Other descriptors on the file are idle while its lock is held */
+    pthread_mutex_lock(&dir_lock);
+    if (directory[di].start == BLOCK_INLINE) {
+      memset(directory[di].data + length, 0, fsize - length);
+    }
+    directory[di].size = length;
+    dirty_entry(di);
+
+    /* Pull back descriptors that now point past the end of the file */
+    int i;
+    for (i = 0; i < MAX_DESCRIPTORS; i++) {
+      if (descriptor_table[i].directory_i != di) {
+        continue;
+      }
+      if (descriptor_table[i].offset > length) {
+        descriptor_table[i].offset = length;
+      }
+    }
+    pthread_mutex_unlock(&dir_lock);
+  }
+
+  return 0;
+}
+
+/**
+ * Looks a file up by name in the filename index.
+ *
+ * @param fname  Name of file to search for.
+ * @return       Either the index of the file in the directory table,
+ *               or -1 on failure.
+ */
+int search_directory(char* fname) {
+  unsigned int slot = hash_name(fname);
+
+  while (dir_hash[slot] != -1) {
+    if (!strncmp(fname, directory[dir_hash[slot]].filename, MAX_FNAME)) {
+      return dir_hash[slot];
+    }
+    slot = (slot + 1) & (DIR_HASH_SIZE - 1);
+  }
+
+  return -1;
+}
+
+/**
+ * FNV-1a hash of a filename, reduced to a slot of the filename index.
+ *
+ * @param fname  Name to hash.
+ * @return       Home slot of the name in dir_hash.
+ */
+unsigned int hash_name(char* fname) {
+  unsigned int hash = 2166136261u;
+
+  int i;
+  for (i = 0; i < MAX_FNAME && fname[i]; i++) {
+    hash = (hash ^ (unsigned char) fname[i]) * 16777619u;
+  }
+
+  return hash & (DIR_HASH_SIZE - 1);
+}
+
+/**
+ * Adds a used directory entry to the filename index.
+ *
+ * @param di  Index of the entry in the directory table.
+ */
+void dir_hash_insert(int di) {
+  unsigned int slot = hash_name(directory[di].filename);
+
+  while (dir_hash[slot] != -1) {
+    slot = (slot + 1) & (DIR_HASH_SIZE - 1);
+  }
+
+  dir_hash[slot] = di;
+}
+
+/**
+ * Removes a directory entry from the filename index. Later entries of the same
+ * probe run are shifted back into the hole, so lookups never need tombstones.
+ *
+ * @param di  Index of the entry in the directory table.
+ */
+void dir_hash_remove(int di) {
+  unsigned int slot = hash_name(directory[di].filename);
+
+  while (dir_hash[slot] != di) {
+    if (dir_hash[slot] == -1) {
+      return;
+    }
+    slot = (slot + 1) & (DIR_HASH_SIZE - 1);
+  }
+
+  unsigned int hole = slot;
+  for (;;) {
+    dir_hash[hole] = -1;
+
+    /* Find the next entry that may move back into the hole */
+    unsigned int next = hole;
+    for (;;) {
+      next = (next + 1) & (DIR_HASH_SIZE - 1);
+      if (dir_hash[next] == -1) {
+        return;
+      }
+
+      unsigned int home = hash_name(directory[dir_hash[next]].filename);
+      /* It may move unless its home slot lies cyclically in (hole, next] */
+      if (((next - home) & (DIR_HASH_SIZE - 1))
+          >= ((next - hole) & (DIR_HASH_SIZE - 1))) {
+        break;
+      }
+    }
+
+    dir_hash[hole] = dir_hash[next];
+    hole = next;
+  }
+}
+
+/**
+ * Marks the directory block holding an entry as changed since the last
+ * commit.
+ *
+ * @param di  Index of the entry in the directory table.
+ */
+void dirty_entry(int di) {
+  mark_dirty(&directory_dirty[di * sizeof(directory_entry) / BLOCK_SIZE]);
+}
+
+/**
+ * Reads the directory region into the in-memory directory table and builds
+ * the filename index from the used entries.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int load_directory() {
+  if (region_io(0, DIR_START, DIR_BLOCKS, (char*) directory, NULL)) {
+    fprintf(stderr, "load_directory: Error reading directory.\n");
+    return -1;
+  }
+
+  memset(dir_hash, -1, sizeof(dir_hash));
+  int i;
+  for (i = 0; i < MAX_FILES; i++) {
+    if (directory[i].start != 0) {
+      dir_hash_insert(i);
+    }
+  }
+
+  memset(directory_dirty, 0, sizeof(directory_dirty));
+  dir_free_hint = 0;
+  return 0;
+}
+
+/**
+ * Locks a descriptor against other calls made on it, then the file open on it
+ * for reading (shared) or writing (exclusive).
+ *
+ * @param fildes  Descriptor to lock.
+ * @param write   Nonzero to lock the file exclusively.
+ * @return        0 on success, -1 if the descriptor is not open.
+ */
+int lock_file(int fildes, int write) {
+  if (fildes < 0 || fildes >= MAX_DESCRIPTORS) {
+    return -1;
+  }
+
+  file_descriptor* fd = &descriptor_table[fildes];
+  pthread_mutex_lock(&fd->lock);
+  if (fd->directory_i == -1) {
+    pthread_mutex_unlock(&fd->lock);
+    return -1;
+  }
+
+  if (write) {
+    pthread_rwlock_wrlock(&open_files[fd->file_i].lock);
+  } else {
+    pthread_rwlock_rdlock(&open_files[fd->file_i].lock);
+  }
+  return 0;
+}
+
+/**
+ * Releases the locks taken by lock_file.
+ *
+ * @param fildes  Descriptor to unlock.
+ */
+void unlock_file(int fildes) {
+  file_descriptor* fd = &descriptor_table[fildes];
+  pthread_rwlock_unlock(&open_files[fd->file_i].lock);
+  pthread_mutex_unlock(&fd->lock);
+}
+
+/**
+ * Locks the file open on a descriptor for reading (shared) or writing
+ * (exclusive), for calls that neither use nor move its offset and cursor.
+ * The descriptor is only held while the file is looked up and locked, so
+ * such calls don't wait for each other, but fs_close, which locks the file
+ * exclusively to release it, can't free it under them.
+ *
+ * @param fildes  Descriptor whose file to lock.
+ * @param write   Nonzero to lock the file exclusively.
+ * @return        The locked file, or NULL if the descriptor is not open.
+ */
+open_file* lock_open_file(int fildes, int write) {
+  if (fildes < 0 || fildes >= MAX_DESCRIPTORS) {
+    return NULL;
+  }
+
+  file_descriptor* fd = &descriptor_table[fildes];
+  pthread_mutex_lock(&fd->lock);
+  if (fd->directory_i == -1) {
+    pthread_mutex_unlock(&fd->lock);
+    return NULL;
+  }
+
+  open_file* file = &open_files[fd->file_i];
+  if (write) {
+    pthread_rwlock_wrlock(&file->lock);
+  } else {
+    pthread_rwlock_rdlock(&file->lock);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return file;
+}
+
+/**
+ * Releases the lock taken by lock_open_file. The file is passed back rather
+ * than looked up again, since the descriptor may have been closed and
+ * reopened on another file in the meantime.
+ *
+ * @param file  File returned by lock_open_file.
+ */
+void unlock_open_file(open_file* file) {
+  pthread_rwlock_unlock(&file->lock);
+}
+
+/**
+ * Updates a descriptor's readahead state after fs_read covered blocks (first)
+ * through (last) of its file. A read that carries on where the previous one
+ * stopped doubles the window, up to readahead_max; any other read halves it.
+ * While reads are sequential, the blocks in the window past (last) are loaded
+ * into the block cache in one batch, as soon as less than half a window of
+ * them is left from the previous batch.
+ *
+ * @param fd     Descriptor that was read from, with its file locked.
+ * @param first  Position of the first block the read touched.
+ * @param last   Position of the last block the read touched.
+ */
+void readahead(file_descriptor* fd, int first, int last) {
+  int sequential = first == fd->ra_next || first == fd->ra_next - 1;
+  fd->ra_next = last + 1;
+
+  if (!sequential) {
+    fd->ra_window /= 2;
+    fd->ra_mark = last + 1;
+    return;
+  }
+
+  fd->ra_window = fd->ra_window ? fd->ra_window * 2 : READAHEAD_MIN;
+  if (fd->ra_window > readahead_max) {
+    fd->ra_window = readahead_max;
+  }
+
+  if (fd->ra_mark < last + 1) {
+    fd->ra_mark = last + 1;
+  }
+  if (2 * (fd->ra_mark - (last + 1)) >= fd->ra_window) {
+    return;
+  }
+
+  /* Never past the end of the file */
+  open_file* file = &open_files[fd->file_i];
+  int size = directory[fd->directory_i].size;
+  int end = last + 1 + fd->ra_window;
+  if (end > (size + BLOCK_SIZE - 1) >> BLOCK_SHIFT) {
+    end = (size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+  }
+
+  int blocks[READAHEAD_MAX];
+  int count = 0;
+  int n;
+  for (n = fd->ra_mark; n < end; n++) {
+    int node = map_block(file, n, 0);
+    if (node < 0) {
+      break;
+    }
+    if ((blocks[count] = data_block(node)) != REF_EMPTY) {
+      count++;
+    }
+  }
+
+  /* Best effort; the read itself already succeeded */
+  if (count > 0) {
+    block_prefetch(count, blocks);
+  }
+  fd->ra_mark = n;
+}
+
+/**
+ * Makes the write buffer of an open file hold its (n)th block, which must be
+ * the one holding the end of the file. Whatever part of the block the file
+ * already has is read in; a block past the end of the chain is left
+ * unallocated for now.
+ *
+ * @param file  Open file whose buffer to use, locked exclusively.
+ * @param n     Position of the block within the file.
+ * @param size  Current size of the file.
+ * @return      0 on success, -1 on failure.
+ */
+int hold_tail(open_file* file, int n, unsigned int size) {
+  if (file->tail_n == n) {
+    return 0;
+  }
+
+  if (flush_tail(file)) {
+    return -1;
+  }
+
+  if (!file->tail_buf && !(file->tail_buf = malloc(BLOCK_SIZE))) {
+    fprintf(stderr, "hold_tail: Couldn't allocate write buffer.\n");
+    return -1;
+  }
+
+  if ((unsigned int) n << BLOCK_SHIFT < size) {
+    int block_i = map_block(file, n, 0);
+    if (block_i < 0 || node_read(block_i, file->tail_buf)) {
+      fprintf(stderr, "hold_tail: Error reading block %d.\n", block_i);
+      return -1;
+    }
+  } else {
+    memset(file->tail_buf, 0, BLOCK_SIZE);
+  }
+
+  file->tail_n = n;
+  return 0;
+}
+
+/**
+ * Writes out the block held in the write buffer of an open file, allocating
+ * it first if the file's chain doesn't reach it yet.
+ *
+ * @param file  Open file whose buffer to flush, locked exclusively.
+ * @return      0 on success (or if nothing is buffered), -1 on failure.
+ */
+int flush_tail(open_file* file) {
+  if (file->tail_n < 0) {
+    return 0;
+  }
+  if (directory[file->directory_i].flags & FILE_COMPRESSED) {
+    return flush_cluster(file);
+  }
+
+  int block_i = map_block(file, file->tail_n, 1);
+  if (block_i < 0) {
+    journal_report("flush_tail: Disk is at block capacity.");
+    return -1;
+  }
+
+  if (node_write(block_i, file->tail_buf)) {
+    fprintf(stderr, "flush_tail: Error writing block %d.\n", block_i);
+    return -1;
+  }
+
+  file->tail_n = -1;
+  return 0;
+}
+
+/**
+ * Moves an inline file out of its directory entry: a block is allocated to
+ * start its chain, and the data it had becomes the contents of the write
+ * buffer, to be written out with whatever follows it. For a compressed file,
+ * the buffer holds its first cluster, which the new block is reserved for.
+ * While fs_set_dedup is on, any other file starts with a reference node
+ * instead, and goes on sharing blocks.
+ *
+ * @param file  Open file to promote, locked exclusively.
+ * @return      0 on success, -1 if no block or buffer could be allocated.
+ */
+int promote_file(open_file* file) {
+  directory_entry* entry = &directory[file->directory_i];
+  int bytes = entry->flags & FILE_COMPRESSED ? CLUSTER_SIZE : BLOCK_SIZE;
+  if (!file->tail_buf && !(file->tail_buf = malloc(bytes))) {
+    fprintf(stderr, "promote_file: Couldn't allocate write buffer.\n");
+    return -1;
+  }
+
+  int dedup = dedup_enabled && !(entry->flags & FILE_COMPRESSED);
+  pthread_mutex_lock(&dir_lock);
+  pthread_mutex_lock(&alloc_lock);
+  int block_i = dedup ? alloc_ref() : alloc_block();
+  if (block_i != -1) {
+    set_block_ptr(block_i, BLOCK_TERMINATOR);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  if (block_i == -1) {
+    pthread_mutex_unlock(&dir_lock);
+    journal_report("promote_file: Disk is at block capacity.");
+    return -1;
+  }
+
+  memset(file->tail_buf, 0, bytes);
+  memcpy(file->tail_buf, entry->data, entry->size);
+  file->tail_n = 0;
+  file->tail_len = entry->size;
+  file->tail_pos = 0;
+  file->tail_blocks = 1;
+
+  memset(entry->data, 0, INLINE_MAX);
+  entry->start = block_i;
+  if (dedup) {
+    entry->flags |= FILE_DEDUP;
+  }
+  dirty_entry(file->directory_i);
+  pthread_mutex_unlock(&dir_lock);
+  return 0;
+}
+
+/**
+ * @param size  Size of a compressed file.
+ * @param c     Index of a cluster of the file.
+ * @return      Bytes of the file that fall in cluster (c).
+ */
+int cluster_bytes(unsigned int size, int c) {
+  unsigned int start = (unsigned int) c * CLUSTER_SIZE;
+  if (size <= start) {
+    return 0;
+  }
+  return size - start < CLUSTER_SIZE ? size - start : CLUSTER_SIZE;
+}
+
+/**
+ * Finds where cluster (c) of a compressed file is in its chain. The clusters
+ * follow each other in the chain, each taking as many blocks as it needs, so
+ * the index of where they start is built by reading the first block of each
+ * one not yet indexed: a header gives the length of a compressed cluster, and
+ * one stored as is takes as many blocks as the file has bytes in it. The
+ * cluster held in the write buffer is indexed by what is on the disk, which
+ * is what the chain holds until the buffer is written out. The caller holds
+ * the file's cluster_lock.
+ *
+ * @param file    Open file whose index to use.
+ * @param c       Index of a cluster that is in the chain.
+ * @param blocks  Set to the number of blocks the cluster takes.
+ * @return        Chain position of the cluster's first block, or -1 if the
+ *                chain couldn't be read or doesn't match the file.
+ */
+int locate_cluster(open_file* file, int c, int* blocks) {
+  unsigned int size = directory[file->directory_i].size;
+  char buffer[BLOCK_SIZE];
+
+  if (!file->clusters) {
+    if (!(file->clusters = malloc(MAP_CHUNK * sizeof(int)))) {
+      fprintf(stderr, "locate_cluster: Couldn't allocate cluster index.\n");
+      return -1;
+    }
+    file->cluster_cap = MAP_CHUNK;
+    file->clusters[0] = 0;
+    file->cluster_known = 0;
+  }
+
+  while (file->cluster_known <= c) {
+    int k = file->cluster_known;
+    int pos = file->clusters[k];
+    int bytes = cluster_bytes(size, k);
+
+    /* Every cluster in the chain, even an empty one, takes a block */
+    int n = (bytes + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+    if (n == 0) {
+      n = 1;
+    } else {
+      int block_i = map_block(file, pos, 0);
+      if (block_i < 0 || block_read(block_i, buffer)) {
+        fprintf(stderr, "locate_cluster: Error reading cluster %d.\n", k);
+        return -1;
+      }
+
+      cluster_header header;
+      memcpy(&header, buffer, sizeof(header));
+      if (header.magic == CLUSTER_MAGIC) {
+        if (header.length < 0 || header.length > 2 * CLUSTER_SIZE) {
+          fprintf(stderr, "locate_cluster: Cluster %d is corrupt.\n", k);
+          return -1;
+        }
+        n = (sizeof(header) + header.length + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+      }
+    }
+
+    if (k + 2 > file->cluster_cap) {
+      int* grown = realloc(file->clusters,
+                           2 * file->cluster_cap * sizeof(int));
+      if (!grown) {
+        fprintf(stderr, "locate_cluster: Couldn't allocate cluster index.\n");
+        return -1;
+      }
+      file->clusters = grown;
+      file->cluster_cap *= 2;
+    }
+
+    file->clusters[k + 1] = pos + n;
+    file->cluster_known++;
+  }
+
+  *blocks = file->clusters[c + 1] - file->clusters[c];
+  return file->clusters[c];
+}
+
+/**
+ * Reads cluster (c) of a compressed file from the disk and decompresses it.
+ * The caller holds the file's cluster_lock.
+ *
+ * @param file  Open file to read from.
+ * @param c     Index of a cluster that is in the chain.
+ * @param dst   Where to put the cluster's CLUSTER_SIZE bytes; those past the
+ *              end of the file are zeroed.
+ * @return      0 on success, -1 on failure.
+ */
+int load_cluster(open_file* file, int c, char* dst) {
+  int blocks;
+  int pos = locate_cluster(file, c, &blocks);
+  if (pos < 0) {
+    return -1;
+  }
+
+  int bytes = cluster_bytes(directory[file->directory_i].size, c);
+  if (bytes == 0) {
+    memset(dst, 0, CLUSTER_SIZE);
+    return 0;
+  }
+
+  int block_list[CLUSTER_SIZE / MIN_BLOCK_SIZE + 2];
+  char* bufs[CLUSTER_SIZE / MIN_BLOCK_SIZE + 2];
+  char* packed = malloc((size_t) blocks << BLOCK_SHIFT);
+  if (!packed || blocks > CLUSTER_SIZE / MIN_BLOCK_SIZE + 2) {
+    fprintf(stderr, "load_cluster: Couldn't allocate buffer.\n");
+    free(packed);
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < blocks; i++) {
+    block_list[i] = map_block(file, pos + i, 0);
+    bufs[i] = packed + ((size_t) i << BLOCK_SHIFT);
+    if (block_list[i] < 0) {
+      fprintf(stderr, "load_cluster: File chain is shorter than file size.\n");
+      free(packed);
+      return -1;
+    }
+  }
+
+  if (block_readv(blocks, block_list, bufs)) {
+    fprintf(stderr, "load_cluster: Error reading cluster %d.\n", c);
+    free(packed);
+    return -1;
+  }
+
+  cluster_header header;
+  memcpy(&header, packed, sizeof(header));
+  if (header.magic != CLUSTER_MAGIC) {
+    memcpy(dst, packed, bytes);
+  } else if (header.length > (blocks << BLOCK_SHIFT) - (int) sizeof(header)
+             || lz_decompress(packed + sizeof(header), header.length, dst,
+                              CLUSTER_SIZE) < bytes) {
+    fprintf(stderr, "load_cluster: Cluster %d is corrupt.\n", c);
+    free(packed);
+    return -1;
+  }
+  memset(dst + bytes, 0, CLUSTER_SIZE - bytes);
+
+  free(packed);
+  return 0;
+}
+
+/**
+ * Makes the write buffer of a compressed file hold its cluster (c), which is
+ * decompressed into it if the file has any bytes in it. A cluster past the
+ * end of the chain takes no blocks until it is written out.
+ *
+ * @param file  Open file whose buffer to use, locked exclusively.
+ * @param c     Index of the cluster, at most one past the file's last.
+ * @return      0 on success, -1 on failure.
+ */
+int hold_cluster(open_file* file, int c) {
+  if (file->tail_n == c) {
+    return 0;
+  }
+
+  if (flush_tail(file)) {
+    return -1;
+  }
+
+  if (!file->tail_buf && !(file->tail_buf = malloc(CLUSTER_SIZE))) {
+    fprintf(stderr, "hold_cluster: Couldn't allocate write buffer.\n");
+    return -1;
+  }
+
+  unsigned int size = directory[file->directory_i].size;
+  int failed;
+
+  pthread_mutex_lock(&file->cluster_lock);
+  if (c == 0 || (unsigned int) c * CLUSTER_SIZE < size) {
+    file->tail_pos = locate_cluster(file, c, &file->tail_blocks);
+    file->tail_len = cluster_bytes(size, c);
+    failed = file->tail_pos < 0 || load_cluster(file, c, file->tail_buf);
+  } else {
+    /* A new cluster goes right after the one before it */
+    int blocks;
+    int pos = locate_cluster(file, c - 1, &blocks);
+    file->tail_pos = pos + blocks;
+    file->tail_blocks = 0;
+    file->tail_len = 0;
+    memset(file->tail_buf, 0, CLUSTER_SIZE);
+    failed = pos < 0;
+  }
+  pthread_mutex_unlock(&file->cluster_lock);
+
+  if (failed) {
+    fprintf(stderr, "hold_cluster: Couldn't read cluster %d.\n", c);
+    return -1;
+  }
+
+  file->tail_n = c;
+  return 0;
+}
+
+/**
+ * Compresses the cluster held in the write buffer of a compressed file and
+ * writes it out in place of its old contents. The cluster is stored as is
+ * unless compressing saves at least a block, or unless its data starts the
+ * way a header does. When it takes a different number of blocks than before,
+ * blocks are linked into or cut out of the chain right there, and the block
+ * map and cluster index past it are adjusted.
+ *
+ * @param file  Open file whose buffer to flush, locked exclusively.
+ * @return      0 on success, -1 on failure.
+ */
+int flush_cluster(open_file* file) {
+  int c = file->tail_n;
+  int bytes = file->tail_len;
+  char* packed = malloc(CLUSTER_SIZE + BLOCK_SIZE);
+  if (!packed) {
+    fprintf(stderr, "flush_cluster: Couldn't allocate buffer.\n");
+    return -1;
+  }
+
+  /* The codec never grows data by more than a block's worth */
+  cluster_header header;
+  header.magic = CLUSTER_MAGIC;
+  header.length = lz_compress(file->tail_buf, bytes, packed + sizeof(header),
+                              CLUSTER_SIZE + BLOCK_SIZE - sizeof(header));
+
+  int raw = (bytes + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+  if (raw == 0) {
+    raw = 1;
+  }
+  int n = (sizeof(header) + header.length + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+
+  unsigned int magic;
+  memcpy(&magic, file->tail_buf, sizeof(magic));
+  if (header.length >= 0 && (n < raw || magic == CLUSTER_MAGIC)) {
+    memcpy(packed, &header, sizeof(header));
+    memset(packed + sizeof(header) + header.length, 0,
+           (n << BLOCK_SHIFT) - sizeof(header) - header.length);
+  } else {
+    n = raw;
+    memcpy(packed, file->tail_buf, bytes);
+    memset(packed + bytes, 0, (n << BLOCK_SHIFT) - bytes);
+  }
+
+  /* Keep the blocks the cluster had, up to the ones it needs */
+  int pos = file->tail_pos;
+  int old = file->tail_blocks;
+  int block_list[CLUSTER_SIZE / MIN_BLOCK_SIZE + 2];
+  char* bufs[CLUSTER_SIZE / MIN_BLOCK_SIZE + 2];
+  int i;
+  for (i = 0; i < n && i < old; i++) {
+    block_list[i] = map_block(file, pos + i, 0);
+  }
+  int last = map_block(file, pos + old - 1, 0);
+  for (i = 0; i < n && i < old; i++) {
+    if (block_list[i] < 0) {
+      last = -1;
+    }
+  }
+  if (last < 0) {
+    fprintf(stderr, "flush_cluster: File chain is shorter than file size.\n");
+    free(packed);
+    return -1;
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  int after = get_block_ptr(last);
+  if (n < old) {
+    int dropped = get_block_ptr(block_list[n - 1]);
+    set_block_ptr(last, BLOCK_TERMINATOR);
+    set_block_ptr(block_list[n - 1], after);
+    free_list(dropped);
+  } else if (n > old) {
+    int prev = last;
+    for (i = old; i < n; i++) {
+      if ((block_list[i] = alloc_block_near(prev + 1)) == -1) {
+        break;
+      }
+      set_block_ptr(prev, block_list[i]);
+      prev = block_list[i];
+    }
+
+    if (i < n) {
+      /* Give back whatever was added */
+      set_block_ptr(prev, BLOCK_TERMINATOR);
+      int added = get_block_ptr(last);
+      set_block_ptr(last, after);
+      if (added != after) {
+        free_list(added);
+      }
+      pthread_mutex_unlock(&alloc_lock);
+      journal_report("flush_cluster: Disk is at block capacity.");
+      free(packed);
+      return -1;
+    }
+    set_block_ptr(prev, after);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  /* Positions past the blocks both versions share may have moved */
+  int shared = pos + (n < old ? n : old);
+  if (n != old && file->mapped > shared) {
+    file->mapped = shared;
+  }
+
+  for (i = 0; i < n; i++) {
+    bufs[i] = packed + ((size_t) i << BLOCK_SHIFT);
+  }
+  int failed = block_writev(n, block_list, bufs);
+  free(packed);
+  if (failed) {
+    fprintf(stderr, "flush_cluster: Error writing cluster %d.\n", c);
+    return -1;
+  }
+  COUNT(compressed_bytes, bytes);
+  COUNT(compressed_blocks, n);
+
+  /* Clusters after this one start (n - old) blocks later */
+  pthread_mutex_lock(&file->cluster_lock);
+  if (file->cluster_known > c) {
+    int k;
+    for (k = c + 1; k <= file->cluster_known; k++) {
+      file->clusters[k] += n - old;
+    }
+  } else if (file->cluster_known == c && c + 2 <= file->cluster_cap) {
+    file->clusters[c + 1] = pos + n;
+    file->cluster_known++;
+  }
+  if (file->cluster_n == c) {
+    file->cluster_n = -1;
+  }
+  pthread_mutex_unlock(&file->cluster_lock);
+
+  file->tail_n = -1;
+  return 0;
+}
+
+/**
+ * Reads from a compressed file at the descriptor's offset, which is advanced
+ * past the bytes read; see file_read, which has already kept the request
+ * within the file. Each cluster the request touches is decompressed into the
+ * file's read buffer, unless it is already there, and copied out from it.
+ *
+ * @param fd  Descriptor, or a private copy of one for positional reads.
+ * @return    Number of bytes read, or -1 on failure.
+ */
+int cluster_read(file_descriptor* fd, void* buf, size_t nbyte) {
+  open_file* file = &open_files[fd->file_i];
+
+  char* dst = buf;
+  size_t done = 0;
+  while (done < nbyte) {
+    int c = fd->offset / CLUSTER_SIZE;
+    int cluster_off = fd->offset % CLUSTER_SIZE;
+    int chunk = CLUSTER_SIZE - cluster_off;
+    if (chunk > nbyte - done) {
+      chunk = nbyte - done;
+    }
+
+    /* The cluster held in the write buffer may not be on the disk yet */
+    if (c == file->tail_n) {
+      memcpy(dst + done, file->tail_buf + cluster_off, chunk);
+    } else {
+      pthread_mutex_lock(&file->cluster_lock);
+      if (file->cluster_n != c) {
+        file->cluster_n = -1;
+        if ((!file->cluster_buf
+             && !(file->cluster_buf = malloc(CLUSTER_SIZE)))
+            || load_cluster(file, c, file->cluster_buf)) {
+          pthread_mutex_unlock(&file->cluster_lock);
+          fprintf(stderr, "fs_read: Error reading cluster %d.\n", c);
+          return -1;
+        }
+        file->cluster_n = c;
+      }
+      memcpy(dst + done, file->cluster_buf + cluster_off, chunk);
+      pthread_mutex_unlock(&file->cluster_lock);
+    }
+
+    done += chunk;
+    fd->offset += chunk;
+  }
+
+  return done;
+}
+
+/**
+ * Writes to a compressed file at the descriptor's offset, which is advanced
+ * past the bytes written. Every write goes through the write buffer a cluster
+ * at a time, and a cluster is compressed and written out once it is full, or
+ * when another one is written to. The caller holds the file's lock
+ * exclusively.
+ *
+ * @param fd  Descriptor, or a private copy of one for positional writes.
+ * @return    Number of bytes written, or -1 on failure.
+ */
+int cluster_write(file_descriptor* fd, void* buf, size_t nbyte) {
+  directory_entry* file = &directory[fd->directory_i];
+  open_file* of = &open_files[fd->file_i];
+
+  char* src = buf;
+  size_t done = 0;
+  while (done < nbyte) {
+    int c = fd->offset / CLUSTER_SIZE;
+    int cluster_off = fd->offset % CLUSTER_SIZE;
+    int chunk = CLUSTER_SIZE - cluster_off;
+    if (chunk > nbyte - done) {
+      chunk = nbyte - done;
+    }
+
+    if (hold_cluster(of, c)) {
+      fprintf(stderr, "fs_write: Error buffering cluster %d.\n", c);
+      return -1;
+    }
+
+    int len = of->tail_len;
+    memcpy(of->tail_buf + cluster_off, src + done, chunk);
+    if (cluster_off + chunk > len) {
+      of->tail_len = cluster_off + chunk;
+    }
+    if (cluster_off + chunk == CLUSTER_SIZE && flush_tail(of)) {
+      /* Disk is full; report what made it */
+      of->tail_len = len;
+      journal_report("fs_write: Disk is at block capacity.");
+      break;
+    }
+
+    done += chunk;
+    fd->offset += chunk;
+
+    /* The length of each cluster follows from the size, so it has to cover
+     * every cluster written out before the next one is located */
+    if (fd->offset > file->size) {
+      pthread_mutex_lock(&dir_lock);
+      file->size = fd->offset;
+      dirty_entry(fd->directory_i);
+      pthread_mutex_unlock(&dir_lock);
+    }
+  }
+
+  return done;
+}
+
+/**
+ * Compresses (len) bytes, at most 65536, with a byte-oriented LZ77 codec in
+ * the style of LZ4. The output is a series of sequences, each a token byte
+ * (count of literals in the high nibble, match length less LZ_MIN_MATCH in
+ * the low one, 15 meaning that length bytes follow), the literals, and the
+ * 2-byte distance back to the match; the last sequence has only literals.
+ * Matches are found through a table of where each hash of 4 bytes was last
+ * seen, and the scan skips ahead faster the longer it finds none.
+ *
+ * @param src  Data to compress.
+ * @param len  Bytes of data.
+ * @param dst  Where to put the compressed data.
+ * @param cap  Most bytes (dst) may take.
+ * @return     Length of the compressed data, or -1 if it needs more than
+ *             (cap).
+ */
+int lz_compress(char* src, int len, char* dst, int cap) {
+  int table[1 << LZ_HASH_BITS];
+  memset(table, -1, sizeof(table));
+
+  int out = 0;
+  int anchor = 0;
+  int i = 0;
+  while (i + LZ_MIN_MATCH <= len && out >= 0) {
+    uint32_t word, seen;
+    memcpy(&word, src + i, sizeof(word));
+    int slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int ref = table[slot];
+    table[slot] = i;
+
+    if (ref < 0 || i - ref > 0xffff
+        || (memcpy(&seen, src + ref, sizeof(seen)), seen != word)) {
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
+
+    /* Extend the match 8 bytes at a time, then to the first that differs */
+    int match = LZ_MIN_MATCH;
+    while (i + match + 8 <= len) {
+      uint64_t ahead, behind;
+      memcpy(&ahead, src + i + match, sizeof(ahead));
+      memcpy(&behind, src + ref + match, sizeof(behind));
+      if (ahead != behind) {
+        break;
+      }
+      match += 8;
+    }
+    while (i + match < len && src[ref + match] == src[i + match]) {
+      match++;
+    }
+
+    out = lz_sequence(dst, out, cap, src + anchor, i - anchor, i - ref, match);
+    i += match;
+    anchor = i;
+  }
+
+  if (out < 0) {
+    return -1;
+  }
+  return lz_sequence(dst, out, cap, src + anchor, len - anchor, 0, 0);
+}
+
+/**
+ * Appends one sequence to the output of lz_compress.
+ *
+ * @param dst       Compressed data so far.
+ * @param out       Bytes of it.
+ * @param cap       Most bytes (dst) may take.
+ * @param literals  Bytes to copy before the match.
+ * @param count     Number of literals.
+ * @param offset    Distance back to the match.
+ * @param match     Length of the match, 0 for the last sequence.
+ * @return          New length of the compressed data, or -1 if it would
+ *                  exceed (cap).
+ */
+int lz_sequence(char* dst, int out, int cap, char* literals, int count,
+                int offset, int match) {
+  int extra = match ? match - LZ_MIN_MATCH : 0;
+  if (out + 1 + count / 255 + 1 + count + 2 + extra / 255 + 1 > cap) {
+    return -1;
+  }
+
+  dst[out++] = (count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15);
+  out = lz_put_length(dst, out, count);
+  memcpy(dst + out, literals, count);
+  out += count;
+
+  if (match) {
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    out = lz_put_length(dst, out, extra);
+  }
+  return out;
+}
+
+/**
+ * Appends the length bytes for a count of (n) that didn't fit in its nibble:
+ * (n - 15) as a run of 255s and a last byte below 255.
+ *
+ * @return  New length of the compressed data.
+ */
+int lz_put_length(char* dst, int out, int n) {
+  if (n < 15) {
+    return out;
+  }
+
+  for (n -= 15; n >= 255; n -= 255) {
+    dst[out++] = (char) 255;
+  }
+  dst[out++] = n;
+  return out;
+}
+
+/**
+ * Reads the length bytes that follow a nibble of (n), if it is 15.
+ *
+ * @param src  Compressed data.
+ * @param in   Position of the next byte, advanced past the length bytes.
+ * @param len  Bytes of compressed data.
+ * @return     The full count, or -1 if the data ends first.
+ */
+int lz_get_length(unsigned char* src, int* in, int len, int n) {
+  if (n < 15) {
+    return n;
+  }
+
+  int byte;
+  do {
+    if (*in >= len) {
+      return -1;
+    }
+    byte = src[(*in)++];
+    n += byte;
+  } while (byte == 255);
+  return n;
+}
+
+/**
+ * Decompresses data made by lz_compress. Every length and distance is checked,
+ * so corrupt data fails rather than reading or writing out of bounds.
+ *
+ * @param src  Compressed data.
+ * @param len  Bytes of compressed data.
+ * @param dst  Where to put the decompressed data.
+ * @param cap  Most bytes (dst) may take.
+ * @return     Length of the decompressed data, or -1 if it is corrupt.
+ */
+int lz_decompress(char* src, int len, char* dst, int cap) {
+  unsigned char* in = (unsigned char*) src;
+  int pos = 0;
+  int out = 0;
+
+  while (pos < len) {
+    int token = in[pos++];
+    int count = lz_get_length(in, &pos, len, token >> 4);
+    if (count < 0 || count > len - pos || count > cap - out) {
+      return -1;
+    }
+    memcpy(dst + out, src + pos, count);
+    pos += count;
+    out += count;
+
+    /* Only the last sequence ends without a match */
+    if (pos == len) {
+      break;
+    }
+    if (len - pos < 2) {
+      return -1;
+    }
+    int offset = in[pos] | in[pos + 1] << 8;
+    pos += 2;
+
+    int match = lz_get_length(in, &pos, len, token & 15);
+    if (match < 0 || offset == 0 || offset > out
+        || (match += LZ_MIN_MATCH) > cap - out) {
+      return -1;
+    }
+
+    /* A match may overlap the bytes it produces */
+    if (offset >= match) {
+      memcpy(dst + out, dst + out - offset, match);
+    } else {
+      int i;
+      for (i = 0; i < match; i++) {
+        dst[out + i] = dst[out + i - offset];
+      }
+    }
+    out += match;
+  }
+
+  return out;
+}
+
+/**
+ * Finds the (n)th block of an open file through its block map. Positions
+ * already in the map are looked up directly, without a lock; otherwise the map
+ * is extended by walking the chain on from its last entry. Entries only ever
+ * change under the file's exclusive lock, so readers sharing the file can rely
+ * on whatever they find mapped.
+ *
+ * @param file  Open file whose map to use.
+ * @param n     Position of the wanted block within the file.
+ * @param grow  If nonzero, nodes are appended when the chain is too short:
+ *              reference nodes to a file that shares blocks, unless (grow) is
+ *              2, and disk blocks otherwise.
+ * @return      Node of the block, or -1 if the chain is too short (and could
+ *              not be grown).
+ */
+int map_block(open_file* file, int n, int grow) {
+  if (n < __atomic_load_n(&file->mapped, __ATOMIC_ACQUIRE)) {
+    return MAP_ENTRY(file, n);
+  }
+
+  pthread_mutex_lock(&file->map_lock);
+
+  /* A chain can't be longer than there are nodes, so the chunk list never
+   * needs to grow; chunks are added but never moved, which keeps lock-free
+   * lookups valid */
+  if (!file->map && !(file->map = calloc(MAP_CHUNKS, sizeof(int*)))) {
+    pthread_mutex_unlock(&file->map_lock);
+    fprintf(stderr, "map_block: Couldn't allocate block map.\n");
+    return -1;
+  }
+
+  int mapped = file->mapped;
+  int walked = mapped;
+
+  while (mapped <= n && mapped < NODE_COUNT) {
+    int** chunk = &file->map[mapped / MAP_CHUNK];
+    if (!*chunk && !(*chunk = malloc(MAP_CHUNK * sizeof(int)))) {
+      fprintf(stderr, "map_block: Couldn't allocate block map.\n");
+      break;
+    }
+
+    if (mapped == 0) {
+      /* An inline file has no chain to map */
+      if (directory[file->directory_i].start == BLOCK_INLINE) {
+        break;
+      }
+      MAP_ENTRY(file, 0) = directory[file->directory_i].start;
+      mapped++;
+      continue;
+    }
+
+    int block_i = MAP_ENTRY(file, mapped - 1);
+    int next = get_block_ptr(block_i);
+
+    if (next == BLOCK_TERMINATOR) {
+      if (!grow) {
+        break;
+      }
+
+      pthread_mutex_lock(&alloc_lock);
+      if (grow == 1 && (directory[file->directory_i].flags & FILE_DEDUP)) {
+        next = alloc_ref();
+      } else {
+        next = alloc_block_near(block_i + 1);
+      }
+      if (next != -1) {
+        set_block_ptr(next, BLOCK_TERMINATOR);
+        set_block_ptr(block_i, next);
+      }
+      pthread_mutex_unlock(&alloc_lock);
+
+      if (next == -1) {
+        break;
+      }
+    }
+
+    MAP_ENTRY(file, mapped) = next;
+    mapped++;
+  }
+
+  COUNT(chain_hops, mapped - walked);
+
+  /* Publish the new entries before the count that covers them */
+  __atomic_store_n(&file->mapped, mapped, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&file->map_lock);
+
+  return n < mapped ? MAP_ENTRY(file, n) : -1;
+}
+
+/**
+ * Maps an open file all the way to the end of its chain.
+ *
+ * @param file  Open file whose map to use.
+ * @return      Position of the last block within the file, or -1 if the map
+ *              couldn't be allocated.
+ */
+int map_tail(open_file* file) {
+  map_block(file, NODE_COUNT, 0);
+  return file->mapped - 1;
+}
+
+/**
+ * Gets the next node in the chain from the in-memory block table.
+ *
+ * @param block  Node in question.
+ * @return       Next node.
+ */
+int get_block_ptr(int block) {
+  if (block < 0 || block >= NODE_COUNT) {
+    fprintf(stderr, "get_block_ptr: Block %d out of bounds.\n", block);
+    return -1;
+  }
+
+  return block_table[block];
+}
+
+/**
+ * Sets the next node in the chain. Only the in-memory block table is updated;
+ * the change reaches the disk with the next commit.
+ *
+ * @param block  Node in question.
+ * @param ptr    Next node.
+ * @return       0 on success, -1 on failure.
+ */
+int set_block_ptr(int block, int ptr) {
+  if (block < 0 || block >= NODE_COUNT) {
+    fprintf(stderr, "set_block_ptr: Block %d out of bounds.\n", block);
+    return -1;
+  }
+
+  if (block_table[block] != ptr) {
+    block_table[block] = ptr;
+    mark_dirty(&block_table_dirty[block * sizeof(int) / BLOCK_SIZE]);
+  }
+
+  return 0;
+}
+
+/**
+ * Frees every block in the list, starting with (head). The caller holds
+ * alloc_lock.
+ *
+ * @param head  Index of block to start freeing from.
+ */
+void free_list(int head) {
+  while (head > 0) {
+    head = free_batch(head, RECLAIM_BATCH);
+  }
+}
+
+/**
+ * Frees up to (max) blocks of a list in one pass, starting with (head). The
+ * chain is walked first, so each block is visited once. A reference node
+ * gives up its reference instead, and the block it stands for is only freed
+ * along with the last one. The caller holds alloc_lock.
+ *
+ * @param head  Index of block to start freeing from.
+ * @param max   Most blocks to free, at most RECLAIM_BATCH.
+ * @return      Index of the first block left unfreed, or BLOCK_TERMINATOR if
+ *              the whole list was freed.
+ */
+int free_batch(int head, int max) {
+  int blocks[RECLAIM_BATCH];
+  int n = 0;
+
+  /* BLOCK_TERMINATOR, BLOCK_FREE and out of bounds pointers all end the list */
+  while (head > 0 && n < max) {
+    blocks[n++] = head;
+    head = get_block_ptr(head);
+  }
+  COUNT(chain_hops, n);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    set_block_ptr(blocks[i], BLOCK_FREE);
+    if (blocks[i] < DISK_BLOCKS) {
+      release_block(blocks[i]);
+    } else {
+      release_ref(blocks[i]);
+    }
+  }
+
+  return head > 0 ? head : BLOCK_TERMINATOR;
+}
+
+/**
+ * Body of the reclaimer thread. Frees queued chains in order, a batch at a
+ * time, dropping alloc_lock between batches so allocations are not held up
+ * behind a long chain. Exits once stop is requested and the queue is empty.
+ */
+void* reclaimer(void* arg) {
+  pthread_mutex_lock(&alloc_lock);
+
+  for (;;) {
+    while (reclaim_count == 0 && !reclaim_stop) {
+      pthread_cond_wait(&reclaim_work, &alloc_lock);
+    }
+    if (reclaim_count == 0) {
+      break;
+    }
+
+    /* The chain stays queued until it is gone, so waiters see it pending */
+    int head = reclaim_queue[reclaim_first];
+    while (head > 0) {
+      int before = free_blocks;
+      head = free_batch(head, RECLAIM_BATCH);
+      reclaim_queue[reclaim_first] = head;
+
+      /* Released blocks stop being pending as they become free */
+      int freed = free_blocks - before;
+      if (freed > reclaim_blocks[reclaim_first]) {
+        freed = reclaim_blocks[reclaim_first];
+      }
+      reclaim_blocks[reclaim_first] -= freed;
+      reclaim_pending -= freed;
+
+      pthread_mutex_unlock(&alloc_lock);
+      pthread_mutex_lock(&alloc_lock);
+    }
+
+    reclaim_pending -= reclaim_blocks[reclaim_first];
+    reclaim_first = (reclaim_first + 1) % RECLAIM_QUEUE;
+    reclaim_count--;
+    pthread_cond_broadcast(&reclaim_done);
+  }
+
+  pthread_mutex_unlock(&alloc_lock);
+  return NULL;
+}
+
+/**
+ * Starts the reclaimer thread.
+ *
+ * @return  0 on success, -1 if the thread could not be created.
+ */
+int start_reclaimer() {
+  reclaim_stop = 0;
+  if (pthread_create(&reclaim_thread, NULL, reclaimer, NULL)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  reclaim_running = 1;
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
+}
+
+/**
+ * Stops the reclaimer thread, if running, once it has freed every queued
+ * chain. fs_delete frees inline from then on.
+ */
+void stop_reclaimer() {
+  pthread_mutex_lock(&alloc_lock);
+  if (!reclaim_running) {
+    pthread_mutex_unlock(&alloc_lock);
+    return;
+  }
+
+  reclaim_running = 0;
+  reclaim_stop = 1;
+  pthread_cond_broadcast(&reclaim_work);
+  pthread_mutex_unlock(&alloc_lock);
+
+  pthread_join(reclaim_thread, NULL);
+}
+
+/**
+ * Finds a free block in the free-space bitmap and marks it as in use. The scan
+ * starts at the allocation hint and looks at 64 blocks per step, so repeated
+ * allocations cost O(1) amortized. If the disk is full while the reclaimer
+ * still has chains to free, waits for them rather than failing. Blocks freed
+ * since the last commit are not taken; if only those are left, the failure
+ * is flagged for journal_retry.
+ *
+ * @return  Disk index of the allocated block, or -1 if the disk is full.
+ */
+int alloc_block() {
+  int words = DISK_BLOCKS / 64;
+
+  for (;;) {
+    int n;
+    for (n = 0; n < words; n++) {
+      int w = (alloc_hint + n) % words;
+      uint64_t taken = taken_word(w);
+      if (taken != ~(uint64_t) 0) {
+        int bit = __builtin_ctzll(~taken);
+        block_bitmap[w] |= (uint64_t) 1 << bit;
+        dirty_bitmap(w * 64);
+        free_blocks--;
+        alloc_hint = w;
+        COUNT(allocs, 1);
+        COUNT(alloc_scanned, n + 1);
+        return w * 64 + bit;
+      }
+    }
+    COUNT(alloc_scanned, words);
+
+    if (reclaim_count == 0) {
+      /* Blocks waiting for their free to commit come back after it */
+      if (pending_free_count || committing_free_count) {
+        journal_starved = journal_tid;
+      }
+      return -1;
+    }
+    pthread_cond_wait(&reclaim_done, &alloc_lock);
+  }
+}
+
+/**
+ * Allocates a block for a file that is growing past (goal - 1). The goal block
+ * itself is taken if it is free, so a file written alone stays contiguous.
+ * Otherwise the file moves on to the first completely free, aligned window of
+ * ALLOC_RUN blocks at or after the goal, which keeps files that grow side by
+ * side from interleaving block by block. Failing both, any free block will do.
+ *
+ * @param goal  Disk index of the preferred block.
+ * @return      Disk index of the allocated block, or -1 if the disk is full.
+ */
+int alloc_block_near(int goal) {
+  if (goal < DATA_START || goal >= DISK_BLOCKS) {
+    goal = DATA_START;
+  }
+
+  if (!(taken_word(goal / 64) & ((uint64_t) 1 << (goal % 64)))) {
+    block_bitmap[goal / 64] |= (uint64_t) 1 << (goal % 64);
+    dirty_bitmap(goal);
+    free_blocks--;
+    COUNT(allocs, 1);
+    COUNT(alloc_scanned, 1);
+    return goal;
+  }
+
+  uint64_t window = ((uint64_t) 1 << ALLOC_RUN) - 1;
+  int windows = DISK_BLOCKS / ALLOC_RUN;
+  int first = goal / ALLOC_RUN;
+
+  int n;
+  for (n = 1; n < windows; n++) {
+    int block = ((first + n) % windows) * ALLOC_RUN;
+    if (!((taken_word(block / 64) >> (block % 64)) & window)) {
+      block_bitmap[block / 64] |= (uint64_t) 1 << (block % 64);
+      dirty_bitmap(block);
+      free_blocks--;
+      COUNT(allocs, 1);
+      COUNT(alloc_scanned, n + 1);
+      return block;
+    }
+  }
+  COUNT(alloc_scanned, windows);
+
+  return alloc_block();
+}
+
+/**
+ * Finds the first run of (want) consecutive free blocks starting at or after
+ * (from), wrapping around to the start of the data region once. Fully used and
+ * fully free bitmap words are stepped over 64 blocks at a time. Blocks freed
+ * since the last commit count as used. Nothing is marked as allocated.
+ *
+ * @param from  Disk index to start looking at.
+ * @param want  Length of the run.
+ * @return      Disk index of the first block of the run, or -1 if there is no
+ *              such run.
+ */
+int find_free_run(int from, int want) {
+  if (from < DATA_START || from >= DISK_BLOCKS) {
+    from = DATA_START;
+  }
+
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    int b = pass ? DATA_START : from;
+    int end = pass ? from : DISK_BLOCKS;
+    int run_start = b;
+    int run = 0;
+
+    while (b < end) {
+      uint64_t word = taken_word(b / 64);
+      COUNT(alloc_scanned, 1);
+
+      if (b % 64 == 0 && b + 64 <= end && (word == 0 || word == ~(uint64_t) 0)) {
+        if (word) {
+          run = 0;
+        } else {
+          if (run == 0) {
+            run_start = b;
+          }
+          run += 64;
+        }
+        b += 64;
+      } else {
+        if (word & ((uint64_t) 1 << (b % 64))) {
+          run = 0;
+        } else {
+          if (run == 0) {
+            run_start = b;
+          }
+          run++;
+        }
+        b++;
+      }
+
+      if (run >= want) {
+        return run_start;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Returns a word of the free-space bitmap with the blocks held back until
+ * their free is committed also marked as in use, which is how the allocators
+ * see it.
+ *
+ * @param w  Index of the word.
+ * @return   Bits of the blocks that can't be allocated.
+ */
+uint64_t taken_word(int w) {
+  return block_bitmap[w] | pending_free[w] | committing_free[w];
+}
+
+/**
+ * Marks a block as free in the free-space bitmap, and moves the allocation hint
+ * back so the hole is found by the next scan. The block counts as free at
+ * once, but is only reused (or discarded) after the next commit.
+ *
+ * @param block  Disk index of the block to release.
+ */
+void release_block(int block) {
+  if (block < DATA_START || block >= DISK_BLOCKS) {
+    return;
+  }
+
+  if (block_bitmap[block / 64] & ((uint64_t) 1 << (block % 64))) {
+    free_blocks++;
+    pending_free[block / 64] |= (uint64_t) 1 << (block % 64);
+    pending_free_count++;
+  }
+  block_bitmap[block / 64] &= ~((uint64_t) 1 << (block % 64));
+  dirty_bitmap(block);
+  if (block / 64 < alloc_hint) {
+    alloc_hint = block / 64;
+  }
+}
+
+/**
+ * Takes a free reference node, which stands for a block of zeros until data
+ * is stored through it. If every node is taken while the reclaimer still has
+ * chains to free, waits for them rather than failing. The caller holds
+ * alloc_lock.
+ *
+ * @return  The node, or -1 if there is no free one.
+ */
+int alloc_ref() {
+  for (;;) {
+    int n;
+    for (n = 0; n < DISK_BLOCKS; n++) {
+      int i = (ref_hint + n) % DISK_BLOCKS;
+      if (ref_target[i] == 0) {
+        ref_hint = i;
+        set_ref_target(DISK_BLOCKS + i, REF_EMPTY);
+        COUNT(alloc_scanned, n + 1);
+        return DISK_BLOCKS + i;
+      }
+    }
+    COUNT(alloc_scanned, DISK_BLOCKS);
+
+    if (reclaim_count == 0) {
+      return -1;
+    }
+    pthread_cond_wait(&reclaim_done, &alloc_lock);
+  }
+}
+
+/**
+ * Frees a reference node, giving up its reference to the block it stands
+ * for. The caller holds alloc_lock.
+ *
+ * @param node  Node to free.
+ */
+void release_ref(int node) {
+  int block = ref_target[node - DISK_BLOCKS];
+  set_ref_target(node, 0);
+  if (node - DISK_BLOCKS < ref_hint) {
+    ref_hint = node - DISK_BLOCKS;
+  }
+
+  if (block > 0) {
+    put_block(block);
+  }
+}
+
+/**
+ * Points a reference node at a block. The caller holds alloc_lock.
+ *
+ * @param node   Reference node.
+ * @param block  Disk index of the block, REF_EMPTY, or 0 to free the node.
+ */
+void set_ref_target(int node, int block) {
+  int i = node - DISK_BLOCKS;
+  ref_target[i] = block;
+  mark_dirty(&ref_target_dirty[i * sizeof(int) / BLOCK_SIZE]);
+}
+
+/**
+ * Drops one reference to a block that reference nodes stand for. The block
+ * is taken out of the content index and freed along with its last
+ * reference. The caller holds alloc_lock.
+ *
+ * @param block  Disk index of the block.
+ */
+void put_block(int block) {
+  if (--block_refs[block] > 0) {
+    return;
+  }
+
+  if (block_hash[block]) {
+    dedup_remove(block);
+    set_block_hash(block, 0);
+  }
+  release_block(block);
+}
+
+/**
+ * @param node  Node of a chain.
+ * @return      Disk index of the block holding the node's data, or REF_EMPTY
+ *              if it is a reference to zeros.
+ */
+int data_block(int node) {
+  return node < DISK_BLOCKS ? node : ref_target[node - DISK_BLOCKS];
+}
+
+/**
+ * Reads the data of a node of a chain.
+ *
+ * @param node  Node to read.
+ * @param buf   Buffer of BLOCK_SIZE bytes.
+ * @return      0 on success, -1 on failure.
+ */
+int node_read(int node, char* buf) {
+  int block = data_block(node);
+  if (block == REF_EMPTY) {
+    memset(buf, 0, BLOCK_SIZE);
+    return 0;
+  }
+
+  return block_read(block, buf);
+}
+
+/**
+ * Writes the data of a node of a chain: a disk block is written in place,
+ * and a reference node stores its data with dedup_store.
+ *
+ * @param node  Node to write, of a file locked exclusively.
+ * @param data  BLOCK_SIZE bytes of data.
+ * @return      0 on success, -1 on failure.
+ */
+int node_write(int node, char* data) {
+  return node < DISK_BLOCKS ? block_write(node, data) : dedup_store(node, data);
+}
+
+/**
+ * Stores a block of data through a reference node. Zeros take no block, and
+ * data that a block in the content index already holds, as checked by
+ * reading it back, is shared with a new reference rather than written. Any
+ * other data is written to the block the node stood for if no other node
+ * shares it, and to a newly allocated block if one does, so that writing to
+ * a shared block copies it. Either way the block is indexed under the hash
+ * of its new contents, and the node's old block loses its reference.
+ *
+ * A block is pinned with a reference while it is compared, and only
+ * rewritten while it has a single one and is out of the index, so no block
+ * changes or goes away while another file is comparing against it.
+ *
+ * @param node  Reference node, of a file locked exclusively.
+ * @param data  BLOCK_SIZE bytes of data.
+ * @return      0 on success, -1 if no block could be allocated or the data
+ *              could not be written.
+ */
+int dedup_store(int node, char* data) {
+  int old = ref_target[node - DISK_BLOCKS];
+
+  if (data[0] == 0 && !memcmp(data, data + 1, BLOCK_SIZE - 1)) {
+    pthread_mutex_lock(&alloc_lock);
+    set_ref_target(node, REF_EMPTY);
+    if (old > 0) {
+      put_block(old);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    COUNT(dedup_hits, 1);
+    return 0;
+  }
+
+  unsigned int hash = dedup_hash(data);
+  pthread_mutex_lock(&alloc_lock);
+  int match = dedup_lookup(hash);
+  if (match) {
+    block_refs[match]++;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  if (match) {
+    char buffer[BLOCK_SIZE];
+    int same = !block_read(match, buffer)
+      && !memcmp(buffer, data, BLOCK_SIZE);
+
+    /* The pin becomes the node's reference, or is dropped again */
+    pthread_mutex_lock(&alloc_lock);
+    if (same) {
+      set_ref_target(node, match);
+      if (old > 0) {
+        put_block(old);
+      }
+      pthread_mutex_unlock(&alloc_lock);
+      COUNT(dedup_hits, 1);
+      return 0;
+    }
+    put_block(match);
+    pthread_mutex_unlock(&alloc_lock);
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  int block = old;
+  if (old > 0 && block_refs[old] == 1) {
+    if (block_hash[old]) {
+      dedup_remove(old);
+      set_block_hash(old, 0);
+    }
+  } else if ((block = alloc_block()) != -1) {
+    block_refs[block] = 1;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+
+  if (block == -1) {
+    journal_report("dedup_store: Disk is at block capacity.");
+    return -1;
+  }
+
+  int failed = block_write(block, data);
+
+  pthread_mutex_lock(&alloc_lock);
+  if (failed) {
+    if (block != old) {
+      put_block(block);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    fprintf(stderr, "dedup_store: Error writing block %d.\n", block);
+    return -1;
+  }
+
+  set_block_hash(block, hash);
+  dedup_insert(block);
+  if (block != old) {
+    set_ref_target(node, block);
+    if (old > 0) {
+      put_block(old);
+    }
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
+}
+
+/**
+ * Hashes the contents of a block for the content index, folding the journal
+ * checksum down to 32 bits.
+ *
+ * @param data  BLOCK_SIZE bytes of data.
+ * @return      The hash, never 0.
+ */
+unsigned int dedup_hash(char* data) {
+  unsigned long hash = journal_checksum(data, BLOCK_SIZE);
+  unsigned int folded = hash ^ (hash >> 32);
+  return folded ? folded : 1;
+}
+
+/**
+ * Looks a hash up in the content index. The caller holds alloc_lock.
+ *
+ * @param hash  Hash of the wanted contents.
+ * @return      Disk index of a block whose contents have that hash, or 0 if
+ *              there is none.
+ */
+int dedup_lookup(unsigned int hash) {
+  unsigned int slot = hash & (dedup_slots - 1);
+
+  while (dedup_index[slot]) {
+    if (block_hash[dedup_index[slot]] == hash) {
+      return dedup_index[slot];
+    }
+    slot = (slot + 1) & (dedup_slots - 1);
+  }
+
+  return 0;
+}
+
+/**
+ * Adds a block to the content index, under the hash it has in block_hash.
+ * Blocks with the same hash may be in it side by side. The caller holds
+ * alloc_lock.
+ *
+ * @param block  Disk index of the block.
+ */
+void dedup_insert(int block) {
+  unsigned int slot = block_hash[block] & (dedup_slots - 1);
+
+  while (dedup_index[slot]) {
+    slot = (slot + 1) & (dedup_slots - 1);
+  }
+
+  dedup_index[slot] = block;
 }
 
 /**
- * Search through the directory table for the first file with a given name.
+ * Removes a block from the content index, shifting later entries of the same
+ * probe run back into the hole, like dir_hash_remove. The block still has the
+ * hash it was indexed under. The caller holds alloc_lock.
  *
- * @param fname  Name of file to search for.
- * @return       Either the index of the file in the directory table,
- *               or -1 on failure.
+ * @param block  Disk index of the block.
  */
-int search_directory(char* fname) {
+void dedup_remove(int block) {
+  unsigned int mask = dedup_slots - 1;
+  unsigned int slot = block_hash[block] & mask;
+
+  while (dedup_index[slot] != block) {
+    if (!dedup_index[slot]) {
+      return;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  unsigned int hole = slot;
+  for (;;) {
+    dedup_index[hole] = 0;
+
+    /* Find the next entry that may move back into the hole */
+    unsigned int next = hole;
+    for (;;) {
+      next = (next + 1) & mask;
+      if (!dedup_index[next]) {
+        return;
+      }
+
+      unsigned int home = block_hash[dedup_index[next]] & mask;
+      /* It may move unless its home slot lies cyclically in (hole, next] */
+      if (((next - home) & mask) >= ((next - hole) & mask)) {
+        break;
+      }
+    }
+
+    dedup_index[hole] = dedup_index[next];
+    hole = next;
+  }
+}
+
+/**
+ * Records the hash of a block's contents. The caller holds alloc_lock.
+ *
+ * @param block  Disk index of the block.
+ * @param hash   Its hash, or 0 for none.
+ */
+void set_block_hash(int block, unsigned int hash) {
+  block_hash[block] = hash;
+  mark_dirty(&block_hash_dirty[block * sizeof(int) / BLOCK_SIZE]);
+}
+
+/**
+ * Writes the format header to the super block, including the sequence number
+ * the journal starts at.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int sync_super_block() {
+  char buffer[MAX_BLOCK_SIZE];
+  super_header header;
+
+  header.magic = FS_MAGIC;
+  header.version = FS_VERSION;
+  header.block_size = BLOCK_SIZE;
+  header.disk_blocks = DISK_BLOCKS;
+  header.bitmap_start = BITMAP_START;
+  header.bitmap_blocks = BITMAP_BLOCKS;
+  header.table_start = TABLE_START;
+  header.table_blocks = TABLE_BLOCKS;
+  header.ref_start = REF_START;
+  header.ref_blocks = REF_BLOCKS;
+  header.hash_start = HASH_START;
+  header.hash_blocks = HASH_BLOCKS;
+  header.dir_start = DIR_START;
+  header.dir_blocks = DIR_BLOCKS;
+  header.journal_start = JOURNAL_START;
+  header.journal_blocks = JOURNAL_BLOCKS;
+  header.data_start = DATA_START;
+  header.journal_seq = journal_seq;
+
+  memset(buffer, 0, BLOCK_SIZE);
+  memcpy(buffer, &header, sizeof(header));
+
+  if (block_write(SUPER_BLOCK, buffer)) {
+    fprintf(stderr, "sync_super_block: Error writing super block.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the block table region, which holds the next pointer of every block on
+ * the disk, into the in-memory block table.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int load_block_table() {
+  if (region_io(0, TABLE_START, TABLE_BLOCKS, (char*) block_table, NULL)) {
+    fprintf(stderr, "load_block_table: Error reading block table.\n");
+    return -1;
+  }
+
+  memset(block_table_dirty, 0, TABLE_BLOCKS);
+  return 0;
+}
+
+/**
+ * Reads the reference and hash regions into memory, counts the references to
+ * each block, and builds the content index from the hashes of the blocks
+ * that have any.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int load_refs() {
+  if (region_io(0, REF_START, REF_BLOCKS, (char*) ref_target, NULL)
+      || region_io(0, HASH_START, HASH_BLOCKS, (char*) block_hash, NULL)) {
+    fprintf(stderr, "load_refs: Error reading reference nodes.\n");
+    return -1;
+  }
+
   int i;
-  for (i = 0; i < MAX_FILES; i++) {
-    if (directory[i].start != 0
-        && !strcmp(fname, directory[i].filename)) {
-      return i;
+  for (i = 0; i < DISK_BLOCKS; i++) {
+    if (ref_target[i] >= DATA_START && ref_target[i] < DISK_BLOCKS) {
+      block_refs[ref_target[i]]++;
+    }
+  }
+  for (i = DATA_START; i < DISK_BLOCKS; i++) {
+    if (block_refs[i] && block_hash[i]) {
+      dedup_insert(i);
     }
   }
 
-  return -1;
+  memset(ref_target_dirty, 0, REF_BLOCKS);
+  memset(block_hash_dirty, 0, HASH_BLOCKS);
+  ref_hint = 0;
+  return 0;
 }
 
 /**
- * Gets the index of the next block in the chain, stored as the first two bytes
- * of the block on the disk.
+ * Allocates the in-memory free-space bitmap, block table, reference nodes and
+ * content hashes for the current geometry, zeroed, each padded to whole
+ * blocks of its region, along with their dirty flags, the bitmaps of blocks
+ * freed but not yet committed, the checkpoint flags, the reference counts and
+ * the content index.
  *
- * @param block  Disk index of the block in question.
- * @return       Disk index of the next block.
+ * @return  0 on success, -1 if out of memory.
  */
-short get_block_ptr(int block) {
-  char buffer[BLOCK_SIZE];
+int alloc_tables() {
+  free_tables();
+  block_bitmap = calloc(BITMAP_BLOCKS, BLOCK_SIZE);
+  block_bitmap_dirty = calloc(BITMAP_BLOCKS, 1);
+  pending_free = calloc(BITMAP_BLOCKS, BLOCK_SIZE);
+  committing_free = calloc(BITMAP_BLOCKS, BLOCK_SIZE);
+  pending_free_count = 0;
+  committing_free_count = 0;
+  block_table = calloc(TABLE_BLOCKS, BLOCK_SIZE);
+  block_table_dirty = calloc(TABLE_BLOCKS, 1);
+  ref_target = calloc(REF_BLOCKS, BLOCK_SIZE);
+  ref_target_dirty = calloc(REF_BLOCKS, 1);
+  block_hash = calloc(HASH_BLOCKS, BLOCK_SIZE);
+  block_hash_dirty = calloc(HASH_BLOCKS, 1);
+  block_refs = calloc(DISK_BLOCKS, sizeof(int));
+  checkpoint_dirty = calloc(JOURNAL_START, 1);
+
+  /* At least twice as many slots as blocks keeps probe runs short */
+  dedup_slots = 1;
+  while (dedup_slots < 2 * DISK_BLOCKS) {
+    dedup_slots *= 2;
+  }
+  dedup_index = calloc(dedup_slots, sizeof(int));
 
-  if (block_read(block, buffer)) {
-    fprintf(stderr, "get_block_ptr: Error reading block %d.\n", block);
+  if (!block_bitmap || !block_bitmap_dirty || !pending_free
+      || !committing_free || !block_table
+      || !block_table_dirty || !ref_target || !ref_target_dirty
+      || !block_hash || !block_hash_dirty || !block_refs || !dedup_index
+      || !checkpoint_dirty) {
+    free_tables();
     return -1;
   }
 
-  short* as_short = (short*) buffer;
-  return as_short[0];
+  return 0;
+}
+
+/**
+ * Frees whatever alloc_tables allocated.
+ */
+void free_tables() {
+  free(block_bitmap);
+  free(block_bitmap_dirty);
+  free(pending_free);
+  free(committing_free);
+  free(block_table);
+  free(block_table_dirty);
+  free(ref_target);
+  free(ref_target_dirty);
+  free(block_hash);
+  free(block_hash_dirty);
+  free(block_refs);
+  free(dedup_index);
+  free(checkpoint_dirty);
+  block_bitmap = NULL;
+  block_bitmap_dirty = NULL;
+  pending_free = NULL;
+  committing_free = NULL;
+  block_table = NULL;
+  block_table_dirty = NULL;
+  ref_target = NULL;
+  ref_target_dirty = NULL;
+  block_hash = NULL;
+  block_hash_dirty = NULL;
+  block_refs = NULL;
+  dedup_index = NULL;
+  checkpoint_dirty = NULL;
 }
 
 /**
- * Sets the index of the next block in the chain, stored as the first two bytes
- * of the block on the disk. This operation is performed without altering the
- * content of the block in question.
+ * Reads or writes a metadata region between the disk and its in-memory copy,
+ * merging consecutive blocks into vectored transfers of up to REGION_CHUNK
+ * blocks. With (dirty), only the blocks flagged in it are written, and their
+ * flags are cleared.
  *
- * @param block  Disk index of the block in question.
- * @param ptr    Disk index of the next block.
+ * @param write  Nonzero to write the region, zero to read it.
+ * @param start  First block of the region.
+ * @param count  Length of the region in blocks.
+ * @param data   In-memory copy, (count) blocks long.
+ * @param dirty  One flag per block of the region, or NULL for every block.
  * @return       0 on success, -1 on failure.
  */
-int set_block_ptr(int block, short ptr) {
-  char buffer[BLOCK_SIZE];
+int region_io(int write, int start, int count, char* data, char* dirty) {
+  int blocks[REGION_CHUNK];
+  char* bufs[REGION_CHUNK];
+  int n = 0;
+
+  int i;
+  for (i = 0; i <= count; i++) {
+    if (n == REGION_CHUNK || (i == count && n > 0)) {
+      if (write ? block_writev(n, blocks, bufs) : block_readv(n, blocks, bufs)) {
+        return -1;
+      }
+      n = 0;
+    }
+
+    if (i < count && (!dirty || dirty[i])) {
+      blocks[n] = start + i;
+      bufs[n++] = data + (size_t) i * BLOCK_SIZE;
+    }
+  }
+
+  if (dirty) {
+    memset(dirty, 0, count);
+  }
+  return 0;
+}
+
+/**
+ * Finds the in-memory copy of a metadata block.
+ *
+ * @param block  Disk index of a block of the bitmap, table, reference, hash
+ *               or directory region.
+ * @param dirty  Set to the block's flag for changes since the last commit.
+ * @return       Start of the block's in-memory copy, or NULL if (block) is in
+ *               none of those regions.
+ */
+char* meta_block(int block, char** dirty) {
+  if (block >= BITMAP_START && block < TABLE_START) {
+    *dirty = &block_bitmap_dirty[block - BITMAP_START];
+    return (char*) block_bitmap + (size_t) (block - BITMAP_START) * BLOCK_SIZE;
+  }
+
+  if (block >= TABLE_START && block < REF_START) {
+    *dirty = &block_table_dirty[block - TABLE_START];
+    return (char*) block_table + (size_t) (block - TABLE_START) * BLOCK_SIZE;
+  }
+
+  if (block >= REF_START && block < HASH_START) {
+    *dirty = &ref_target_dirty[block - REF_START];
+    return (char*) ref_target + (size_t) (block - REF_START) * BLOCK_SIZE;
+  }
+
+  if (block >= HASH_START && block < DIR_START) {
+    *dirty = &block_hash_dirty[block - HASH_START];
+    return (char*) block_hash + (size_t) (block - HASH_START) * BLOCK_SIZE;
+  }
+
+  if (block >= DIR_START && block < JOURNAL_START) {
+    *dirty = &directory_dirty[block - DIR_START];
+    return (char*) directory + (size_t) (block - DIR_START) * BLOCK_SIZE;
+  }
+
+  return NULL;
+}
+
+/**
+ * Marks the bitmap block holding a block's bit as changed since the last
+ * commit.
+ *
+ * @param block  Disk index of the block whose bit changed.
+ */
+void dirty_bitmap(int block) {
+  mark_dirty(&block_bitmap_dirty[block / 8 / BLOCK_SIZE]);
+}
+
+/**
+ * Sets a metadata block's flag for changes since the last commit, and counts
+ * the block towards the running transaction if it is new to it.
+ *
+ * @param flag  The block's flag.
+ */
+void mark_dirty(char* flag) {
+  if (!*flag) {
+    *flag = 1;
+    __atomic_fetch_add(&journal_dirty, 1, __ATOMIC_RELAXED);
+  }
+  journal_touched = 1;
+}
+
+/**
+ * Starts a call that may change metadata. No commit takes its snapshot until
+ * the call is over, so the call's changes are never split across two
+ * transactions.
+ */
+void journal_begin() {
+  pthread_rwlock_rdlock(&journal_handles);
+  journal_touched = 0;
+  journal_starved = 0;
+}
+
+/**
+ * Ends a call started with journal_begin. When fs_set_journal_sync is on and
+ * the call changed metadata, waits until its transaction is committed. So
+ * does a call that leaves the transaction a quarter of the journal long.
+ *
+ * @param ret  Return value of the call, which is passed through.
+ * @return     (ret), or -1 if the commit failed.
+ */
+int journal_end(int ret) {
+  /* Can't move on while this call still holds journal_handles */
+  unsigned long tid = journal_tid;
+  pthread_rwlock_unlock(&journal_handles);
+
+  /* A transaction is cut off once it fills a quarter of the journal, so that
+   * calls made without fs_sync never pile up more than it holds */
+  int grown = __atomic_load_n(&journal_dirty, __ATOMIC_RELAXED)
+    >= JOURNAL_BLOCKS / 4;
+  if (journal_touched && ((journal_sync && ret != -1) || grown)
+      && journal_commit(tid, 0)) {
+    fprintf(stderr, "journal_end: Could not commit changes.\n");
+    return -1;
+  }
+
+  return ret;
+}
+
+/**
+ * Commits every metadata change made so far as one transaction. The changed
+ * bitmap, block table, reference, hash and directory blocks are copied out
+ * while no call is changing metadata. File data in the block cache is synced
+ * first, so the metadata never points at blocks whose data isn't durable yet;
+ * then the copies are written to the journal behind a descriptor block and
+ * synced. Blocks freed in the transaction are only handed back to the
+ * allocators after that. Callers that queue up behind a commit in progress
+ * find their transaction committed by it, so concurrent callers share it.
+ *
+ * Once the journal is half full, the transaction is followed by a checkpoint,
+ * which empties it. A transaction too large for what is left of the journal
+ * empties it first with journal_rewind. One too large for the whole journal
+ * is refused: nothing is written, and its changes stay in memory, uncommitted.
+ * journal_end keeps transactions well short of that between calls.
+ *
+ * @param tid             Transaction to commit; nothing is done if it already
+ *                        is.
+ * @param checkpoint_now  Nonzero to checkpoint whether or not the journal is
+ *                        half full.
+ * @return                0 on success, -1 on failure.
+ */
+int journal_commit(unsigned long tid, int checkpoint_now) {
+  pthread_mutex_lock(&commit_lock);
+  if (journal_committed >= tid && !checkpoint_now) {
+    pthread_mutex_unlock(&commit_lock);
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&journal_handles);
+  pthread_mutex_lock(&dir_lock);
+  pthread_mutex_lock(&alloc_lock);
+
+  /* Deleted files must not leave their blocks marked in use */
+  while (reclaim_count > 0) {
+    pthread_cond_wait(&reclaim_done, &alloc_lock);
+  }
+
+  int count = 0;
+  int block;
+  char* dirty;
+  for (block = BITMAP_START; block < JOURNAL_START; block++) {
+    meta_block(block, &dirty);
+    count += *dirty;
+  }
+
+  /* Atomic only as a whole, so it must fit in the journal and its homes in
+   * the descriptor block */
+  int failed = count + 1 > JOURNAL_BLOCKS
+    || count > (BLOCK_SIZE - (int) sizeof(journal_header)) / (int) sizeof(int);
+  if (failed) {
+    fprintf(stderr, "journal_commit: Transaction of %d blocks is too large "
+            "for the journal.\n", count);
+  } else if (count + 1 > JOURNAL_BLOCKS - journal_head) {
+    failed = journal_rewind();
+  }
+  if (failed) {
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&journal_handles);
+    pthread_mutex_unlock(&commit_lock);
+    return -1;
+  }
 
-  if (block_read(block, buffer)) {
-    fprintf(stderr, "set_block_ptr: Error reading block %d.\n", block);
+  /* The first block is left for the descriptor */
+  int* homes = malloc((count + 1) * sizeof(int));
+  char* blocks = malloc((size_t) (count + 1) * BLOCK_SIZE);
+  if (!homes || !blocks) {
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&journal_handles);
+    pthread_mutex_unlock(&commit_lock);
+    free(homes);
+    free(blocks);
+    fprintf(stderr, "journal_commit: Couldn't allocate transaction.\n");
     return -1;
   }
 
-  memcpy(buffer, &ptr, 2);
+  int n = 0;
+  for (block = BITMAP_START; block < JOURNAL_START; block++) {
+    char* data = meta_block(block, &dirty);
+    if (*dirty) {
+      homes[n] = block;
+      memcpy(blocks + (size_t) (n + 1) * BLOCK_SIZE, data, BLOCK_SIZE);
+      checkpoint_dirty[block] = 1;
+      *dirty = 0;
+      n++;
+    }
+  }
+  __atomic_store_n(&journal_dirty, 0, __ATOMIC_RELAXED);
+  unsigned long committing = journal_tid++;
+
+  /* Blocks freed up to here wait for this commit; later ones for the next */
+  uint64_t* freed = committing_free;
+  committing_free = pending_free;
+  pending_free = freed;
+  committing_free_count = pending_free_count;
+  pending_free_count = 0;
+
+  /* Calls may carry on while the copy is written, unless the in-memory
+   * copies are about to be checkpointed */
+  int full = checkpoint_now || journal_head + count + 1 > JOURNAL_BLOCKS / 2;
+  if (!full) {
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&journal_handles);
+  }
+
+  /* Data before the metadata that points at it */
+  failed = (count > 0 && disk_sync())
+    || (count > 0 && journal_write(count, homes, blocks))
+    || disk_sync()
+    || (full && checkpoint());
 
-  if (block_write(block, buffer)) {
-    fprintf(stderr, "set_block_ptr: Error writing block %d.\n", block);
+  if (full) {
+    pthread_mutex_unlock(&alloc_lock);
+    pthread_mutex_unlock(&dir_lock);
+    pthread_rwlock_unlock(&journal_handles);
+  }
+
+  release_committed(!failed);
+  if (!failed) {
+    journal_committed = committing;
+  }
+  pthread_mutex_unlock(&commit_lock);
+
+  free(homes);
+  free(blocks);
+
+  if (failed) {
+    fprintf(stderr, "journal_commit: Could not commit metadata.\n");
     return -1;
   }
+  return 0;
+}
+
+/**
+ * Ends the wait of the blocks freed in the transaction a commit wrote out. If
+ * it is durable they can be allocated again, once discarded if that is on,
+ * one run of consecutive blocks at a time; if not, they wait for the next
+ * commit. The caller holds commit_lock but not alloc_lock, which nothing
+ * needs for the discards, since only commits change committing_free.
+ *
+ * @param committed  Nonzero if the transaction is durable.
+ */
+void release_committed(int committed) {
+  if (committed && committing_free_count && discard_freed) {
+    /* Best effort; the blocks are free either way */
+    int block, run = -1;
+    for (block = DATA_START; block <= DISK_BLOCKS; block++) {
+      if (run == -1 && block % 64 == 0 && block < DISK_BLOCKS
+          && !committing_free[block / 64]) {
+        block += 63;
+        continue;
+      }
+
+      int freed = block < DISK_BLOCKS
+        && (committing_free[block / 64] & ((uint64_t) 1 << (block % 64)));
+      if (freed && run == -1) {
+        run = block;
+      } else if (!freed && run != -1) {
+        block_discard(run, block - run);
+        run = -1;
+      }
+    }
+  }
 
+  pthread_mutex_lock(&alloc_lock);
+  if (committing_free_count) {
+    int w;
+    for (w = 0; w < DISK_BLOCKS / 64; w++) {
+      if (!committed) {
+        pending_free[w] |= committing_free[w];
+      }
+      committing_free[w] = 0;
+    }
+    if (!committed) {
+      pending_free_count += committing_free_count;
+    }
+    committing_free_count = 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+/**
+ * Called after the first try of a call that may be made twice. If it failed
+ * or fell short because it ran out of blocks while some were only waiting for
+ * their free to be committed, commits them so the call can be made once more.
+ * Otherwise the messages the try held back, if any, are printed now.
+ *
+ * @param failed  Whether the try failed or fell short.
+ * @return        1 if the call should be retried, 0 if not.
+ */
+int journal_retry(int failed) {
+  unsigned long tid = journal_starved;
+  int held = journal_held_count;
+  journal_quiet = 0;
+  journal_starved = 0;
+  journal_held_count = 0;
+
+  if (failed && tid && journal_commit(tid, 0) == 0) {
+    return 1;
+  }
+
+  int i;
+  for (i = 0; failed && i < held; i++) {
+    fprintf(stderr, "%s\n", journal_held[i]);
+  }
   return 0;
 }
 
 /**
- * Frees every block in the list recursively, starting with (head).
+ * Prints an error that running out of blocks led to. On the first try of a
+ * call that may get blocks back from a commit and be made again, the message
+ * is held back for journal_retry instead, so a call that then succeeds
+ * prints nothing.
  *
- * @param head  Index of block to start freeing from.
+ * @param message  The error, without a trailing newline.
  */
-void free_list(int head) {
-  if(head == BLOCK_TERMINATOR || head == BLOCK_FREE) {
+void journal_report(char* message) {
+  if (journal_quiet && journal_starved) {
+    if (journal_held_count < JOURNAL_HELD) {
+      journal_held[journal_held_count++] = message;
+    }
     return;
   }
-  
-  int tail = get_block_ptr(head);  
-  set_block_ptr(head, BLOCK_FREE);
-  free_list(tail);
+  fprintf(stderr, "%s\n", message);
+}
+
+/**
+ * Writes a transaction at the head of the journal: a descriptor block listing
+ * the home of every block in it and a checksum over all of them, then the
+ * blocks themselves, in one vectored write. Nothing is synced.
+ *
+ * @param count   Metadata blocks in the transaction.
+ * @param homes   Home block of each of them.
+ * @param blocks  (count + 1) blocks: room for the descriptor, then the
+ *                metadata blocks in the order of (homes).
+ * @return        0 on success, -1 on failure.
+ */
+int journal_write(int count, int* homes, char* blocks) {
+  journal_header header;
+  header.magic = JOURNAL_MAGIC;
+  header.seq = journal_seq;
+  header.count = count;
+  header.reserved = 0;
+  header.checksum = 0;
+
+  memset(blocks, 0, BLOCK_SIZE);
+  memcpy(blocks, &header, sizeof(header));
+  memcpy(blocks + sizeof(header), homes, count * sizeof(int));
+  header.checksum = journal_checksum(blocks, (size_t) (count + 1) * BLOCK_SIZE);
+  memcpy(blocks, &header, sizeof(header));
+
+  if (region_io(1, JOURNAL_START + journal_head, count + 1, blocks, NULL)) {
+    fprintf(stderr, "journal_write: Error writing journal.\n");
+    return -1;
+  }
+
+  journal_head += count + 1;
+  journal_seq++;
+  COUNT(commits, 1);
+  COUNT(journal_blocks, count + 1);
+  return 0;
+}
+
+/**
+ * Copies every transaction in the journal to the home blocks it lists, from
+ * the start of the journal on. Replay stops at the first block that is not a
+ * descriptor for the next transaction in sequence, or whose transaction
+ * doesn't match its checksum, as one torn by a crash wouldn't. Nothing is
+ * synced.
+ *
+ * @param seq  Sequence number the first transaction must have; set to the one
+ *             after the last transaction replayed.
+ * @return     Number of transactions replayed, or -1 on failure.
+ */
+int journal_replay(unsigned int* seq) {
+  int replayed = 0;
+  int pos = 0;
+
+  /* A clean journal costs a single block read */
+  while (pos < JOURNAL_BLOCKS - 1) {
+    journal_header header;
+    char* txn = malloc(BLOCK_SIZE);
+    if (!txn || block_read(JOURNAL_START + pos, txn)) {
+      fprintf(stderr, "journal_replay: Error reading journal.\n");
+      free(txn);
+      return -1;
+    }
+
+    memcpy(&header, txn, sizeof(header));
+    if (header.magic != JOURNAL_MAGIC || header.seq != *seq || header.count < 1
+        || header.count > JOURNAL_BLOCKS - pos - 1) {
+      free(txn);
+      break;
+    }
+
+    char* whole = realloc(txn, (size_t) (header.count + 1) * BLOCK_SIZE);
+    if (!whole || region_io(0, JOURNAL_START + pos + 1, header.count,
+                            whole + BLOCK_SIZE, NULL)) {
+      fprintf(stderr, "journal_replay: Error reading journal.\n");
+      free(whole ? whole : txn);
+      return -1;
+    }
+    txn = whole;
+
+    /* Checked the way it was computed, with the checksum zeroed */
+    unsigned long checksum = header.checksum;
+    header.checksum = 0;
+    memcpy(txn, &header, sizeof(header));
+    if (journal_checksum(txn, (size_t) (header.count + 1) * BLOCK_SIZE)
+        != checksum) {
+      free(txn);
+      break;
+    }
+
+    int* homes = (int*) (txn + sizeof(header));
+    int i;
+    for (i = 0; i < header.count; i++) {
+      if (homes[i] < BITMAP_START || homes[i] >= JOURNAL_START
+          || block_write(homes[i], txn + (size_t) (i + 1) * BLOCK_SIZE)) {
+        fprintf(stderr, "journal_replay: Error writing block %d.\n", homes[i]);
+        free(txn);
+        return -1;
+      }
+    }
+    free(txn);
+
+    pos += header.count + 1;
+    (*seq)++;
+    replayed++;
+  }
+
+  return replayed;
+}
+
+/**
+ * Checksums a journal transaction: FNV-1a over 8-byte words, which is enough
+ * to tell a transaction that was only partly written from a whole one.
+ *
+ * @param data  Start of the transaction.
+ * @param len   Its length in bytes, a multiple of 8.
+ * @return      The checksum.
+ */
+unsigned long journal_checksum(char* data, size_t len) {
+  unsigned long hash = 0xcbf29ce484222325UL;
+  size_t i;
+  for (i = 0; i < len; i += sizeof(hash)) {
+    unsigned long word;
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3UL;
+  }
+  return hash;
+}
+
+/**
+ * Writes every metadata block changed since the last checkpoint to its home
+ * block, and then records in the super block that the journal starts over
+ * with the next transaction. Each step is synced before the next, so the
+ * journal is only given up once everything in it is safely home. The caller
+ * holds commit_lock and journal_handles exclusively, so the in-memory copies
+ * hold committed changes only.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int checkpoint() {
+  if (region_io(1, BITMAP_START, BITMAP_BLOCKS, (char*) block_bitmap,
+                checkpoint_dirty + BITMAP_START)
+      || region_io(1, TABLE_START, TABLE_BLOCKS, (char*) block_table,
+                   checkpoint_dirty + TABLE_START)
+      || region_io(1, REF_START, REF_BLOCKS, (char*) ref_target,
+                   checkpoint_dirty + REF_START)
+      || region_io(1, HASH_START, HASH_BLOCKS, (char*) block_hash,
+                   checkpoint_dirty + HASH_START)
+      || region_io(1, DIR_START, DIR_BLOCKS, (char*) directory,
+                   checkpoint_dirty + DIR_START)
+      || disk_sync()
+      || sync_super_block()
+      || disk_sync()) {
+    fprintf(stderr, "checkpoint: Error writing metadata.\n");
+    return -1;
+  }
+
+  journal_head = 0;
+  journal_base = journal_seq;
+  COUNT(checkpoints, 1);
+  return 0;
+}
+
+/**
+ * Empties the journal ahead of a transaction that only fits in it once it is
+ * empty. The transactions already in it are written to their home blocks
+ * from the journal itself, as mount_fs replays them, since the in-memory
+ * copies hold the new transaction's changes as well. The caller holds
+ * commit_lock and journal_handles exclusively.
+ *
+ * @return  0 on success, -1 on failure.
+ */
+int journal_rewind() {
+  unsigned int seq = journal_base;
+  if (journal_replay(&seq) < 0 || seq != journal_seq
+      || disk_sync()
+      || sync_super_block()
+      || disk_sync()) {
+    fprintf(stderr, "journal_rewind: Error emptying the journal.\n");
+    return -1;
+  }
+
+  journal_head = 0;
+  journal_base = journal_seq;
+  COUNT(checkpoints, 1);
+  return 0;
+}
+
+#ifndef FS_NO_STATS
+/**
+ * Notes the start of a counted call, unless counting is turned off. The call
+ * tags the block accesses it makes (FS_OP_* + 1) in any block trace.
+ *
+ * @param timer  Filled in for stats_end.
+ * @param op     FS_OP_* index of the call.
+ */
+void stats_begin(op_timer* timer, int op) {
+  disk_trace_tag(op + 1);
+  if (!stats_enabled) {
+    timer->start = 0;
+    return;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  timer->start = ts.tv_sec * 1000000000L + ts.tv_nsec;
+  disk_thread_io(&timer->reads, &timer->writes);
+}
+
+/**
+ * Adds a finished call to the counters of (op): its time, the block I/O its
+ * thread issued meanwhile, and for reads and writes the bytes moved.
+ *
+ * @param timer  Filled in by stats_begin.
+ * @param op     FS_OP_* index of the call.
+ * @param ret    Return value of the call, which is passed through.
+ * @return       (ret).
+ */
+int stats_end(op_timer* timer, int op, int ret) {
+  disk_trace_tag(0);
+  if (!timer->start) {
+    return ret;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  long end = ts.tv_sec * 1000000000L + ts.tv_nsec;
+  unsigned long reads, writes;
+  disk_thread_io(&reads, &writes);
+
+  op_stats* s = &counters.ops[op];
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->ns, end - timer->start, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->block_reads, reads - timer->reads, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->block_writes, writes - timer->writes,
+                     __ATOMIC_RELAXED);
+  if (ret == -1) {
+    __atomic_fetch_add(&s->errors, 1, __ATOMIC_RELAXED);
+  } else if (op <= FS_OP_PWRITE) {
+    __atomic_fetch_add(&s->bytes, ret, __ATOMIC_RELAXED);
+  }
+
+  return ret;
 }
+#endif
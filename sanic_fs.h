@@ -1,26 +1,200 @@
 #ifndef _SANIC_FS_H_
 #define _SANIC_FS_H_
 
+#include <pthread.h>
+#include "disk.h"
+
 #define BLOCK_TERMINATOR -2
 #define BLOCK_FREE 0
+#define BLOCK_INLINE -3 // start of a file whose data is in its directory entry
+#define REF_EMPTY -1 // target of a reference node whose block is all zeros
 
 #define SUPER_BLOCK 0
 
-#define MAX_FILES 64
+#define FS_MAGIC 0x53414e43 // "SANC"
+#define FS_VERSION 7
+#define JOURNAL_MAGIC 0x53414e4a // "SANJ"
+#define CLUSTER_MAGIC 0x53414e5a // "SANZ"
+
+/* Chains link nodes: a node below DISK_BLOCKS is the disk block of the same
+ * index, and each of the DISK_BLOCKS nodes after that is a reference node,
+ * which stands for whichever disk block its entry in the reference region
+ * names, so that any number of chains can share one block */
+#define NODE_COUNT (2 * DISK_BLOCKS)
+
+/* The free-space bitmap region follows the super block directly, then come
+ * the block table, reference, hash, directory and journal regions. Their
+ * lengths follow from the geometry of the disk. */
+#define BITMAP_START (SUPER_BLOCK + 1)
+#define BITMAP_BLOCKS ((DISK_BLOCKS / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define TABLE_START (BITMAP_START + BITMAP_BLOCKS)
+#define TABLE_BLOCKS ((int) ((NODE_COUNT * sizeof(int) + BLOCK_SIZE - 1) \
+                             / BLOCK_SIZE))
+#define REF_START (TABLE_START + TABLE_BLOCKS)
+#define REF_BLOCKS ((int) ((DISK_BLOCKS * sizeof(int) + BLOCK_SIZE - 1) \
+                           / BLOCK_SIZE))
+#define HASH_START (REF_START + REF_BLOCKS)
+#define HASH_BLOCKS ((int) ((DISK_BLOCKS * sizeof(int) + BLOCK_SIZE - 1) \
+                            / BLOCK_SIZE))
+#define DIR_START (HASH_START + HASH_BLOCKS)
+#define DIR_BLOCKS ((int) (MAX_FILES * sizeof(directory_entry) / BLOCK_SIZE))
+#define JOURNAL_START (DIR_START + DIR_BLOCKS)
+#define JOURNAL_BLOCKS (JOURNAL_BYTES / BLOCK_SIZE)
+#define DATA_START (JOURNAL_START + JOURNAL_BLOCKS)
+
+#define FS_MAX_BLOCKS (1 << 24) // most blocks make_fs_geometry accepts
+#define MAP_CHUNK 1024 // block map entries allocated at a time
+#define REGION_CHUNK 256 // metadata blocks moved per vectored transfer
+#define JOURNAL_BYTES (2 << 20) // size of the journal region
+#define JOURNAL_HELD 4 // error messages a call holds back until its retry
+
+#define MAX_FILES 16384
+#define DIR_HASH_SIZE (2 * MAX_FILES) // slots in the filename index (power of 2)
 #define MAX_DESCRIPTORS 32
 #define MAX_FNAME 16
+#define INLINE_MAX 38 // largest file kept in its directory entry, in bytes
+#define CLUSTER_SIZE 32768 // bytes of a compressed file compressed together
+#define LZ_HASH_BITS 12 // log2 of the slots in the compressor's match table
+#define LZ_MIN_MATCH 4 // shortest match the compressor encodes
+#define ALLOC_RUN 8 // aligned window of blocks a growing file moves into
+#define READAHEAD_MIN 4 // first readahead window once reads look sequential
+#define READAHEAD_MAX 32 // largest readahead window, and the default limit
+#define RECLAIM_QUEUE 256 // deleted files the reclaimer can have pending
+#define RECLAIM_BATCH 256 // blocks freed per hold of the allocator lock
+
+/* Bits of directory_entry.flags */
+#define FILE_COMPRESSED 1 // data is stored in compressed clusters
+#define FILE_DEDUP 2 // chain is made of reference nodes, sharing blocks
+
+/* Calls counted by fs_get_stats; the first four move file data */
+#define FS_OP_READ 0
+#define FS_OP_WRITE 1
+#define FS_OP_PREAD 2
+#define FS_OP_PWRITE 3
+#define FS_OP_OPEN 4
+#define FS_OP_CLOSE 5
+#define FS_OP_CREATE 6
+#define FS_OP_DELETE 7
+#define FS_OP_LSEEK 8
+#define FS_OP_TRUNCATE 9
+#define FS_OP_FALLOCATE 10
+#define FS_OP_SYNC 11
+#define FS_OPS 12
+
+typedef struct t_super_header {
+  unsigned int magic; // FS_MAGIC
+  unsigned int version; // on-disk format version
+  int block_size; // bytes per block
+  int disk_blocks; // blocks on the disk
+  int bitmap_start; // first block of the free-space bitmap region
+  int bitmap_blocks; // length of the free-space bitmap region
+  int table_start; // first block of the block table region
+  int table_blocks; // length of the block table region
+  int ref_start; // first block of the reference region
+  int ref_blocks; // length of the reference region
+  int hash_start; // first block of the content hash region
+  int hash_blocks; // length of the content hash region
+  int dir_start; // first block of the directory region
+  int dir_blocks; // length of the directory region
+  int journal_start; // first block of the journal region
+  int journal_blocks; // length of the journal region
+  int data_start; // first block available to files
+  unsigned int journal_seq; // sequence number of the first transaction in the
+                            // journal that has not been checkpointed
+} super_header;
+
+/* First block of a journal transaction. The home block of each of the (count)
+ * metadata blocks that follow it is listed right after this header. */
+typedef struct t_journal_header {
+  unsigned int magic; // JOURNAL_MAGIC
+  unsigned int seq; // one more than the transaction before it
+  int count; // metadata blocks in the transaction
+  int reserved; // pads the header to 8 bytes
+  unsigned long checksum; // over this block, with (checksum) zeroed, and the
+                          // (count) blocks that follow
+} journal_header;
+
+/* Start of the first block of a cluster stored compressed, followed by the
+ * compressed data. A cluster stored as is has no header. */
+typedef struct t_cluster_header {
+  unsigned int magic; // CLUSTER_MAGIC
+  int length; // bytes of compressed data
+} cluster_header;
 
 typedef struct t_directory_entry {
   char filename[MAX_FNAME]; // 16 bytes maximum
-  short start; // block offset
+  int start; // block offset, or BLOCK_INLINE
   unsigned int size; // file size
+  unsigned short flags; // FILE_* bits
+  char data[INLINE_MAX]; // contents of an inline file; pads entries to 64
+                         // bytes, so none straddles two blocks
 } directory_entry;
 
+typedef struct t_open_file {
+  int directory_i; // index in directory of the file
+  int refs; // descriptors open on the file, 0 if the slot is unused
+  pthread_rwlock_t lock; // shared by readers, exclusive for writers
+  int** map; // disk index of each block of the file, built on demand in
+             // chunks of MAP_CHUNK entries that never move
+  int mapped; // leading entries of (map) that are filled in
+  pthread_mutex_t map_lock; // serialises extending (map)
+  char* tail_buf; // contents of block (tail_n), or of cluster (tail_n) of a
+                  // compressed file, not yet handed to the disk
+  int tail_n; // position of the block held in (tail_buf), or -1 if none
+  int tail_len; // bytes of the file in the cluster held in (tail_buf)
+  int tail_pos; // chain position of that cluster's first block
+  int tail_blocks; // blocks that cluster has in the chain, 0 if none yet
+  int* clusters; // chain position of the first block of each cluster of a
+                 // compressed file, for clusters 0 to (cluster_known)
+  int cluster_known; // clusters whose length in blocks is known
+  int cluster_cap; // entries allocated in (clusters)
+  char* cluster_buf; // decompressed contents of cluster (cluster_n)
+  int cluster_n; // cluster held in (cluster_buf), or -1 if none
+  pthread_mutex_t cluster_lock; // guards (clusters) and (cluster_buf)
+} open_file;
+
 typedef struct t_file_descriptor {
   int directory_i; // index in directory
+  int file_i; // index in the open file table
   int offset; // seek offset
+  int ra_next; // block position a sequential read would start at
+  int ra_window; // blocks to read ahead, 0 while access looks random
+  int ra_mark; // block position up to which blocks have been read ahead
+  pthread_mutex_t lock; // serialises calls made on this descriptor
 } file_descriptor;
 
+typedef struct t_op_stats {
+  unsigned long calls; // times the call was made
+  unsigned long errors; // calls that returned -1
+  unsigned long bytes; // file data read or written, for FS_OP_READ to PWRITE
+  unsigned long ns; // total time spent in the call, in nanoseconds
+  unsigned long block_reads; // block reads the call issued
+  unsigned long block_writes; // block writes the call issued
+} op_stats;
+
+typedef struct t_fs_stats {
+  op_stats ops[FS_OPS]; // per call, indexed by FS_OP_*
+  unsigned long chain_hops; // next pointers followed through the block table
+  unsigned long allocs; // blocks allocated
+  unsigned long alloc_scanned; // bitmap words, windows or blocks looked at
+  unsigned long commits; // journal transactions committed
+  unsigned long journal_blocks; // blocks written to the journal
+  unsigned long checkpoints; // times the journal was checkpointed and emptied
+  unsigned long compressed_bytes; // file data written out in compressed files
+  unsigned long compressed_blocks; // blocks that data was stored in
+  unsigned long dedup_hits; // blocks written to files that share blocks
+                            // whose contents were already on the disk, or
+                            // all zeros, and so took no write
+  disk_stats disk; // block I/O, cache and timing counters (disk_get_stats)
+} fs_stats;
+
+/*
+ * Every call other than make_fs, mount_fs and umount_fs may be made from many
+ * threads at once. Calls on different files, and reads of the same file, run
+ * in parallel; writes, truncations and reservations of a file exclude every
+ * other call on that file, and calls on a single descriptor run one at a time.
+ */
+
 /**
  * Creates a fresh (and empty) file system on the virtual disk with name
  * disk_name. Should invoke make_disk.
@@ -30,6 +204,18 @@ typedef struct t_file_descriptor {
  */
 int make_fs(char* disk_name);
 
+/**
+ * Like make_fs, but with (blocks) blocks of (block_size) bytes on the disk
+ * rather than the default 8192 of 4096. The block size must be a power of two
+ * from MIN_BLOCK_SIZE (4 KB) to MAX_BLOCK_SIZE (64 KB), and the block count a
+ * multiple of 64 up to FS_MAX_BLOCKS, large enough for the metadata regions.
+ * The geometry is recorded in the super block, and mount_fs picks it up.
+ *
+ * @return  0 on success, -1 when the geometry is invalid or the disk could
+ *          not be created, opened, or properly initialized.
+ */
+int make_fs_geometry(char* disk_name, int blocks, int block_size);
+
 /**
  * Mounts a file system that is stored on a virtual disk with name disk_name.
  * With this, the system becomes "ready for use."
@@ -49,6 +235,132 @@ int mount_fs(char* disk_name);
  */
 int umount_fs(char* disk_name);
 
+/**
+ * Makes every change made so far durable: file data still held in the write
+ * buffers of open files or in the block cache is written out, and the changes
+ * to the directory, block table and free-space bitmap are committed to the
+ * journal as one transaction. The commit takes two disk_syncs: one after the
+ * file data, so the metadata never points at blocks that aren't durable yet,
+ * and one after the journal write. Blocks the transaction frees are not
+ * reused until the second has returned. The journal is replayed by mount_fs,
+ * so a crash after fs_sync returns loses none of it. Calls made from other
+ * threads while a commit is running share the next one. umount_fs does this
+ * implicitly, and checkpoints the journal as well.
+ *
+ * @return  0 on success, -1 when the changes could not be written.
+ */
+int fs_sync();
+
+/**
+ * Controls whether every call that changes metadata (fs_create, fs_delete,
+ * fs_write, fs_pwrite, fs_truncate, fs_fallocate and fs_close) returns only
+ * once its changes are committed to the journal, as if followed by fs_sync.
+ * Threads whose calls finish while a commit is running are all covered by the
+ * next one, so concurrent callers share a sync. Off by default.
+ *
+ * @return  0 on success.
+ */
+int fs_set_journal_sync(int enable);
+
+/**
+ * Marks the file referenced by fildes as compressed (or, if enable is 0, as
+ * not). A compressed file is stored in clusters of CLUSTER_SIZE bytes, each
+ * compressed on its own with a built-in LZ codec and kept in as few blocks as
+ * it needs; a cluster that doesn't shrink by at least a block is stored as
+ * is. fs_read and fs_write compress and decompress transparently, and each
+ * open file keeps an index of where its clusters start, so a read only
+ * decompresses the clusters it touches. The flag can only change while the
+ * file is still held in its directory entry, as it is after fs_create.
+ *
+ * @return  0 on success, -1 if fildes is invalid or the file already has
+ *          blocks.
+ */
+int fs_set_compressed(int fildes, int enable);
+
+/**
+ * Controls whether files that get their first block from now on share blocks
+ * with identical contents. The chain of such a file is made of reference
+ * nodes rather than blocks: every block written to it is hashed and looked up
+ * in an index of the blocks already stored this way, and if one holds the
+ * same data, the node refers to it and nothing is written. Shared blocks
+ * carry a reference count, so writing to one of them stores a new copy for
+ * that file alone, and a block is only freed along with its last reference.
+ * Blocks of zeros take no space at all. The content hashes are kept in the
+ * hash region, and the index is rebuilt from them by mount_fs. Compressed
+ * files never share blocks, and space reserved by fs_fallocate is not shared
+ * either. Off by default.
+ *
+ * @return  0 on success.
+ */
+int fs_set_dedup(int enable);
+
+/**
+ * Controls whether blocks freed by fs_delete and fs_truncate have their space
+ * returned to the host file system by punching holes in the virtual disk file,
+ * which keeps the disk file thin at the cost of a system call per run of
+ * consecutive freed blocks.
+ * Off by default.
+ *
+ * @return  0 on success.
+ */
+int fs_set_discard(int enable);
+
+/**
+ * Controls whether fs_delete frees a file's blocks itself or hands the chain
+ * to a background thread and returns straight away. Handed-off blocks count
+ * as free at once: fs_get_free_blocks includes them, an allocation that finds
+ * the disk full waits for them, and fs_sync and umount_fs wait for them to be
+ * released before writing the free-space bitmap. Off by default; may be
+ * changed before or after mounting.
+ *
+ * @return  0 on success, -1 if the background thread could not be started.
+ */
+int fs_set_deferred_free(int enable);
+
+/**
+ * @return  The number of free blocks on the disk, including blocks of deleted
+ *          files still waiting to be released (see fs_set_deferred_free).
+ */
+int fs_get_free_blocks();
+
+/**
+ * Copies out the counters kept since the program started or the last
+ * fs_reset_stats. Each call counted in (ops) adds its time and the block reads
+ * and writes its thread issued while it ran, so dividing by (calls) gives the
+ * average cost of a call and shows which calls amplify I/O; block I/O done by
+ * the background reclaimer is not charged to any call. (disk) holds the totals
+ * for all block I/O, including cache hits and the time spent in block_read and
+ * block_write.
+ *
+ * @return  0 on success.
+ */
+int fs_get_stats(fs_stats* stats);
+
+/**
+ * Zeroes every counter reported by fs_get_stats.
+ *
+ * @return  0 on success.
+ */
+int fs_reset_stats();
+
+/**
+ * Turns counting and timing on (the default) or off at run time. Compiling
+ * with -DFS_NO_STATS leaves it out entirely.
+ *
+ * @return  0 on success.
+ */
+int fs_set_stats(int enable);
+
+/**
+ * Sets the most blocks fs_read may prefetch ahead of a descriptor that is
+ * reading sequentially, from 0 (no readahead) to READAHEAD_MAX, the default.
+ * The window starts at READAHEAD_MIN blocks and doubles up to this limit while
+ * reads stay sequential, and halves whenever a read jumps elsewhere.
+ *
+ * @return  0 on success, -1 if blocks is out of range.
+ */
+int fs_set_readahead(int blocks);
+
 /**
  * Opens the file specified by name for reading and writing.
  *
@@ -57,14 +369,22 @@ int umount_fs(char* disk_name);
 int fs_open(char* name);
 
 /**
- * Closes the file descriptor fildes.
+ * Closes the file descriptor fildes, first handing any small writes still
+ * buffered for its file to the disk (see fs_write). If that fails, for
+ * instance because the disk is full, the descriptor stays open and the data
+ * stays buffered: it is not durable, but fs_sync or another fs_close writes
+ * it out once there is room, and it is lost if the process exits first.
  *
- * @return  0 on success, and -1 if the fildes does not exist or is not open.
+ * @return  0 on success, and -1 if the fildes does not exist or is not open,
+ *          or if buffered data could not be written.
  */
 int fs_close(int fildes);
 
 /**
  * Creates a new file with name name in the root directory of the file system.
+ * The file takes no data block: up to INLINE_MAX bytes are kept in its
+ * directory entry, and it moves to a block chain of its own the first time a
+ * write or fs_fallocate takes it past that.
  *
  * @return  0 on success, -1 on failure.
  */
@@ -89,16 +409,67 @@ int fs_read(int fildes, void* buf, size_t nbyte);
  * Attempts to write nbyte bytes of data to the file referenced by the
  * descriptor fildes from the buffer pointed to by buf.
  *
+ * Writes into the last, partly filled block of a file are gathered in memory
+ * rather than going to the disk one by one, and a block that does not exist
+ * yet is only allocated once its data is written out. Buffered data is visible
+ * to every read at once, and is written when its block fills up, when the file
+ * is truncated or space is reserved for it, on fs_close and on fs_sync. Until
+ * then it would be lost in a crash, like anything else not yet synced.
+ *
+ * A write that would take the file past INT_MAX bytes fails without writing
+ * anything.
+ *
  * @return  Number of bytes actually written on success, -1 on failure.
  */
 int fs_write(int fildes, void* buf, size_t nbyte);
 
+/**
+ * Reads up to nbyte bytes from the file referenced by fildes, starting at byte
+ * offset of the file rather than at the descriptor's file pointer, which is
+ * left unchanged. Any number of threads may read through one descriptor this
+ * way at the same time.
+ *
+ * @return  Number of bytes read on success (0 at or past the end of the file),
+ *          -1 on failure.
+ */
+int fs_pread(int fildes, void* buf, size_t nbyte, off_t offset);
+
+/**
+ * Writes nbyte bytes to the file referenced by fildes, starting at byte offset
+ * of the file rather than at the descriptor's file pointer, which is left
+ * unchanged. The offset may be at most the current file size, and like
+ * fs_write, the write may not end past INT_MAX bytes.
+ *
+ * @return  Number of bytes actually written on success, -1 on failure.
+ */
+int fs_pwrite(int fildes, void* buf, size_t nbyte, off_t offset);
+
 /**
  * @return  The current size of the file pointed to by the file descriptor
  *          fildes. In case fildes is invalid, returns -1.
  */
 int fs_get_filesize(int fildes);
 
+/**
+ * Reserves contiguous disk blocks for the file referenced by fildes so that it
+ * can hold length bytes without further allocation. The file size is not
+ * changed; later writes up to length fill the reserved blocks in place. The
+ * reservation extends the file's current block chain, and falls back to
+ * scattered blocks if no contiguous free run is large enough.
+ *
+ * @return  0 on success, -1 on failure (including when the disk cannot hold
+ *          the reservation at all, and for a compressed file that needs more
+ *          than INLINE_MAX bytes, since its blocks depend on its contents).
+ */
+int fs_fallocate(int fildes, off_t length);
+
+/**
+ * @return  The number of contiguous runs of disk blocks making up the file
+ *          referenced by fildes (1 for an unfragmented file, 0 for one held in
+ *          its directory entry), or -1 if fildes is invalid.
+ */
+int fs_get_fragments(int fildes);
+
 /**
  * Sets the file pointer (the offset used for read and write operations)
  * associated with the file descriptorfildes to the argument offset.
@@ -1,5 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "sanic_fs.h"
 #include "disk.h"
 
@@ -24,14 +30,15 @@ int env_cleanup() {
 }
 
 /**
- * Write (nbytes) of arbitrary ASCII data to (file).
+ * Write (nbytes) of the test pattern to (file), starting at byte (start) of the
+ * pattern.
  */
-int write_test_pattern(int file, size_t nbytes) {
+int write_test_pattern_at(int file, size_t start, size_t nbytes) {
   char* buffer = malloc(nbytes);
 
   int i;
   for(i = 0; i < nbytes; i++) {
-    buffer[i] = 'a' + (i % ('z' - 'a'));
+    buffer[i] = 'a' + ((start + i) % ('z' - 'a'));
   }
 
   if (fs_write(file, buffer, nbytes) == -1)  {
@@ -45,13 +52,20 @@ int write_test_pattern(int file, size_t nbytes) {
 }
 
 /**
- * Read (nbytes) of data from the file and check that it matches the
- * test pattern.
+ * Write (nbytes) of arbitrary ASCII data to (file).
  */
-int check_test_pattern(int file, size_t nbytes) {
+int write_test_pattern(int file, size_t nbytes) {
+  return write_test_pattern_at(file, 0, nbytes);
+}
+
+/**
+ * Read (nbytes) of data from the file, which is positioned at byte (start) of
+ * the test pattern, and check that it matches.
+ */
+int check_test_pattern_at(int file, size_t start, size_t nbytes) {
   char* buffer = malloc(nbytes);
 
-  if (fs_write(file, buffer, nbytes) == -1)  {
+  if (fs_read(file, buffer, nbytes) != nbytes)  {
     fprintf(stderr, "check_test_pattern: Read failed.\n");
     free(buffer);
     return -1;
@@ -59,7 +73,7 @@ int check_test_pattern(int file, size_t nbytes) {
   
   int i;
   for(i = 0; i < nbytes; i++) {
-    if(buffer[i] != 'a' + (i % ('z' - 'a'))) {
+    if(buffer[i] != 'a' + ((start + i) % ('z' - 'a'))) {
       fprintf(stderr, "check_test_pattern: Pattern mismatch at byte %d.\n", i);
       free(buffer);
       return -1;
@@ -70,6 +84,14 @@ int check_test_pattern(int file, size_t nbytes) {
   return 0;
 }
 
+/**
+ * Read (nbytes) of data from the file and check that it matches the
+ * test pattern.
+ */
+int check_test_pattern(int file, size_t nbytes) {
+  return check_test_pattern_at(file, 0, nbytes);
+}
+
 /**
  * Make new filesystem, mount it, and unmount it.
  */
@@ -244,36 +266,2473 @@ int test_file_write() {
   return 0;
 }
 
-int main(int argc, char** argv) {
+/**
+ * Mount the filesystem, create a file, write several blocks of the test
+ * pattern, seek back into the middle and re-read, truncate the file to a bit
+ * over one block, check the new size and contents, delete the file, and
+ * unmount.
+ */
+int test_file_seek_truncate() {
+  char* fname = "test_file_4";
 
-  if (test_fs_creation()) {
-    printf("test_fs_creation failed.\n");
-    
-    if (env_cleanup()) {
-      return 1;
+  int fd = 0;
+
+  size_t nbytes = BLOCK_SIZE * 4 + 100;
+  size_t new_size = BLOCK_SIZE + 10;
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_file_seek_truncate: Mount failed.\n");
+    return -1;
+  }
+
+  /* Create and open a file */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1) {
+    fprintf(stderr, "test_file_seek_truncate: Failed to create file.\n");
+    return -1;
+  }
+
+  /* Write test pattern to the file */
+  if (write_test_pattern(fd, nbytes)
+      || fs_get_filesize(fd) != nbytes) {
+    fprintf(stderr, "test_file_seek_truncate: Failed to write pattern.\n");
+    return -1;
+  }
+
+  /* Seek back to the start and check the whole pattern */
+  if (fs_lseek(fd, 0)
+      || check_test_pattern(fd, nbytes)) {
+    fprintf(stderr, "test_file_seek_truncate: Pattern check failed.\n");
+    return -1;
+  }
+
+  /* Seeking past the end of the file must fail */
+  if (fs_lseek(fd, nbytes + 1) != -1) {
+    fprintf(stderr, "test_file_seek_truncate: Seek past end succeeded.\n");
+    return -1;
+  }
+
+  /* Truncate the file, which also pulls the offset back to the new end */
+  if (fs_truncate(fd, new_size)
+      || fs_get_filesize(fd) != new_size) {
+    fprintf(stderr, "test_file_seek_truncate: Truncate failed.\n");
+    return -1;
+  }
+
+  /* Nothing is left to read at the new end */
+  char byte;
+  if (fs_read(fd, &byte, 1) != 0) {
+    fprintf(stderr, "test_file_seek_truncate: Read past end succeeded.\n");
+    return -1;
+  }
+
+  /* The data before the new end is unchanged */
+  if (fs_lseek(fd, 0)
+      || check_test_pattern(fd, new_size)) {
+    fprintf(stderr, "test_file_seek_truncate: Truncated data changed.\n");
+    return -1;
+  }
+
+  /* Close and delete the file */
+  if (fs_close(fd)
+      || fs_delete(fname)) {
+    fprintf(stderr, "test_file_seek_truncate: Failed to delete file.\n");
+    return -1;
+  }
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_file_seek_truncate: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem with a tiny block cache, write more blocks than it
+ * holds, re-read the last block to check for a cache hit and the start of the
+ * file to check that evicted dirty blocks were written back, unmount, and check
+ * that everything persisted.
+ */
+int test_block_cache() {
+  char* fname = "test_file_5";
+
+  int fd = 0;
+  disk_stats stats;
+
+  size_t nbytes = BLOCK_SIZE * 8;
+  size_t off;
+
+  /* Mount filesystem with room for only two cached blocks */
+  if (disk_cache_size(2)
+      || mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_cache: Mount failed.\n");
+    return -1;
+  }
+
+  /* Write a file larger than the cache, half a block at a time so that every
+   * write goes through the cache rather than around it */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1) {
+    fprintf(stderr, "test_block_cache: Failed to create file.\n");
+    return -1;
+  }
+
+  for (off = 0; off < nbytes; off += BLOCK_SIZE / 2) {
+    if (write_test_pattern_at(fd, off, BLOCK_SIZE / 2)) {
+      fprintf(stderr, "test_block_cache: Failed to write file.\n");
+      return -1;
     }
-  } else {
-    printf("test_fs_creation successful.\n");
   }
 
-  if (test_file_creation()) {
-    printf("test_file_creation failed.\n");
-    
-    if (env_cleanup()) {
-      return 1;
+  /* Some blocks must have been pushed out of the cache */
+  disk_get_stats(&stats);
+  if (stats.evictions == 0 || stats.writebacks == 0) {
+    fprintf(stderr, "test_block_cache: Cache never evicted a block.\n");
+    return -1;
+  }
+
+  /* The most recently written block is still cached */
+  disk_reset_stats();
+  if (fs_lseek(fd, nbytes - BLOCK_SIZE)
+      || check_test_pattern_at(fd, nbytes - BLOCK_SIZE, BLOCK_SIZE)) {
+    fprintf(stderr, "test_block_cache: Failed to re-read last block.\n");
+    return -1;
+  }
+
+  disk_get_stats(&stats);
+  if (stats.hits != 1 || stats.misses != 0) {
+    fprintf(stderr, "test_block_cache: Last block was not a cache hit.\n");
+    return -1;
+  }
+
+  /* Evicted blocks come back from the disk intact */
+  if (fs_lseek(fd, 0)
+      || check_test_pattern(fd, nbytes)) {
+    fprintf(stderr, "test_block_cache: Pattern check failed.\n");
+    return -1;
+  }
+
+  /* Close the file and unmount, which flushes the cache */
+  if (fs_close(fd)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_cache: Unmount failed.\n");
+    return -1;
+  }
+
+  /* Re-mount with the default cache, check the data, and clean up */
+  if (disk_cache_size(DISK_CACHE_BLOCKS)
+      || mount_fs(DISK_NAME)
+      || (fd = fs_open(fname)) == -1
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_cache: Data did not persist.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, write a run of contiguous blocks plus a few scattered
+ * ones straight through the disk layer with block_writev, read them back in a
+ * different order with block_readv, check the contents, and unmount.
+ */
+int test_block_vectors() {
+  int blocks[] = { DATA_START + 10, DATA_START + 11, DATA_START + 12,
+                   DATA_START + 13, DATA_START + 40, DATA_START + 20 };
+  int count = sizeof(blocks) / sizeof(blocks[0]);
+
+  char* data = malloc(count * BLOCK_SIZE);
+  char* back = malloc(count * BLOCK_SIZE);
+  char* bufs[count];
+
+  int i;
+  for (i = 0; i < count * BLOCK_SIZE; i++) {
+    data[i] = 'a' + ((i / BLOCK_SIZE + i) % ('z' - 'a'));
+  }
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_vectors: Mount failed.\n");
+    return -1;
+  }
+
+  /* Write every block in one call */
+  for (i = 0; i < count; i++) {
+    bufs[i] = data + i * BLOCK_SIZE;
+  }
+  if (block_writev(count, blocks, bufs)) {
+    fprintf(stderr, "test_block_vectors: Vectored write failed.\n");
+    return -1;
+  }
+
+  /* Read them back last to first */
+  for (i = 0; i < count; i++) {
+    bufs[i] = back + (count - 1 - i) * BLOCK_SIZE;
+  }
+  int reversed[count];
+  for (i = 0; i < count; i++) {
+    reversed[i] = blocks[count - 1 - i];
+  }
+  if (block_readv(count, reversed, bufs)) {
+    fprintf(stderr, "test_block_vectors: Vectored read failed.\n");
+    return -1;
+  }
+
+  if (memcmp(data, back, count * BLOCK_SIZE)) {
+    fprintf(stderr, "test_block_vectors: Blocks read back differ.\n");
+    return -1;
+  }
+
+  free(data);
+  free(back);
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_vectors: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem on the memory-mapped backend, write the test pattern,
+ * check the first data block through block_ptr without copying, unmount,
+ * re-mount on the descriptor backend, and check that the data persisted.
+ */
+int test_mmap_backend() {
+  char* fname = "test_file_6";
+
+  int fd = 0;
+
+  size_t nbytes = BLOCK_SIZE * 2 + 7;
+
+  /* Mount filesystem on a mapped disk */
+  if (disk_set_backend(DISK_BACKEND_MMAP)
+      || mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_mmap_backend: Mount failed.\n");
+    return -1;
+  }
+
+  /* Write the test pattern */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)) {
+    fprintf(stderr, "test_mmap_backend: Failed to write file.\n");
+    return -1;
+  }
+
+  /* The file's first block is visible in place */
+  char* block = block_ptr(DATA_START);
+  if (!block || block[0] != 'a' || block[1] != 'b') {
+    fprintf(stderr, "test_mmap_backend: Mapped block has wrong data.\n");
+    return -1;
+  }
+
+  /* Close and unmount, which syncs the mapping */
+  if (fs_close(fd)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_mmap_backend: Unmount failed.\n");
+    return -1;
+  }
+
+  /* Re-mount through a plain descriptor, check the data, and clean up */
+  if (disk_set_backend(DISK_BACKEND_FD)
+      || mount_fs(DISK_NAME)
+      || block_ptr(DATA_START) != NULL
+      || (fd = fs_open(fname)) == -1
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_mmap_backend: Data did not persist.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem on the io_uring backend, queue writes and reads of
+ * scattered blocks directly, check them after a single wait, write and re-read
+ * a multi-block file through the file system, and unmount. Falls back to plain
+ * I/O (and still has to pass) where io_uring is unavailable.
+ */
+int test_async_backend() {
+  char* fname = "test_file_7";
+
+  int fd = 0;
+  int count = 8;
+
+  size_t nbytes = BLOCK_SIZE * 20 + 300;
+
+  char* data = malloc(count * BLOCK_SIZE);
+  char* back = malloc(count * BLOCK_SIZE);
+
+  int i;
+  for (i = 0; i < count * BLOCK_SIZE; i++) {
+    data[i] = 'a' + ((i / BLOCK_SIZE + i) % ('z' - 'a'));
+  }
+
+  /* Mount filesystem with asynchronous I/O */
+  if (disk_set_backend(DISK_BACKEND_URING)
+      || mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_async_backend: Mount failed.\n");
+    return -1;
+  }
+
+  /* Queue a write to every other block of a run, then wait once */
+  for (i = 0; i < count; i++) {
+    if (block_write_async(DATA_START + 100 + 2 * i, data + i * BLOCK_SIZE)) {
+      fprintf(stderr, "test_async_backend: Failed to queue write.\n");
+      return -1;
     }
-  } else {
-    printf("test_file_creation successful.\n");
+  }
+  if (block_wait()) {
+    fprintf(stderr, "test_async_backend: Queued writes failed.\n");
+    return -1;
   }
 
-  if (test_file_write()) {
-    printf("test_file_write failed.\n");
-    
-    if (env_cleanup()) {
-      return 1;
+  /* Queue the reads, then wait once */
+  for (i = 0; i < count; i++) {
+    if (block_read_async(DATA_START + 100 + 2 * i, back + i * BLOCK_SIZE)) {
+      fprintf(stderr, "test_async_backend: Failed to queue read.\n");
+      return -1;
     }
-  } else {
-    printf("test_file_write successful.\n");
+  }
+  if (block_wait()
+      || block_poll() != 0
+      || memcmp(data, back, count * BLOCK_SIZE)) {
+    fprintf(stderr, "test_async_backend: Queued reads differ.\n");
+    return -1;
+  }
+
+  free(data);
+  free(back);
+
+  /* Write and re-read a file through the file system */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_lseek(fd, 0)
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_delete(fname)) {
+    fprintf(stderr, "test_async_backend: File round trip failed.\n");
+    return -1;
+  }
+
+  /* Unmount filesystem and go back to the default backend */
+  if (umount_fs(DISK_NAME)
+      || disk_set_backend(DISK_BACKEND_FD)) {
+    fprintf(stderr, "test_async_backend: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Time creating a disk in each format mode and report the results, check that
+ * a sparse disk can be formatted and mounted, then write and delete a file with
+ * hole punching on and check that the disk file gives its space back.
+ */
+int test_format_modes() {
+  char* fname = "test_file_8";
+  char* mode_names[] = { "zero", "sparse", "allocate" };
+  int modes[] = { DISK_FORMAT_ZERO, DISK_FORMAT_SPARSE, DISK_FORMAT_ALLOCATE };
+
+  int fd = 0;
+  struct timespec start, end;
+  struct stat st;
+
+  size_t nbytes = BLOCK_SIZE * 64;
+
+  /* Time each format mode, starting from no disk file at all so that freeing
+   * the old one isn't counted */
+  int i;
+  for (i = 0; i < 3; i++) {
+    unlink(DISK_NAME);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (disk_set_format(modes[i])
+        || make_disk(DISK_NAME)) {
+      fprintf(stderr, "test_format_modes: Failed to create disk.\n");
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("  format %-8s %8.3f ms\n", mode_names[i],
+           (end.tv_sec - start.tv_sec) * 1e3
+           + (end.tv_nsec - start.tv_nsec) / 1e6);
+  }
+
+  /* Lay a file system on a sparse disk and mount it with hole punching */
+  if (disk_set_format(DISK_FORMAT_SPARSE)
+      || make_fs(DISK_NAME)
+      || fs_set_discard(1)
+      || mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_format_modes: Mount failed.\n");
+    return -1;
+  }
+
+  /* Write a file, flushing it out to the disk file */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_sync()
+      || stat(DISK_NAME, &st)) {
+    fprintf(stderr, "test_format_modes: Failed to write file.\n");
+    return -1;
+  }
+  blkcnt_t written = st.st_blocks;
+
+  /* Deleting it hands the space back */
+  if (fs_delete(fname)
+      || fs_sync()
+      || stat(DISK_NAME, &st)) {
+    fprintf(stderr, "test_format_modes: Failed to delete file.\n");
+    return -1;
+  }
+  if (st.st_blocks * 512 > written * 512 - nbytes / 2) {
+    fprintf(stderr, "test_format_modes: Freed blocks still take space.\n");
+    return -1;
+  }
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)
+      || fs_set_discard(0)) {
+    fprintf(stderr, "test_format_modes: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, create two files and grow them side by side a block at
+ * a time, check that neither ends up badly fragmented, reserve space for a
+ * third file with fs_fallocate and check that the reservation is a single run
+ * that writes fill without changing it, delete the files, and unmount.
+ */
+int test_file_locality() {
+  char* fname1 = "test_file_9";
+  char* fname2 = "test_file_10";
+  char* fname3 = "test_file_11";
+
+  int fd1 = 0, fd2 = 0, fd3 = 0;
+
+  int nblocks = 32;
+  size_t reserve = BLOCK_SIZE * 40;
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_file_locality: Mount failed.\n");
+    return -1;
+  }
+
+  /* Create and open the files */
+  if (fs_create(fname1)
+      || fs_create(fname2)
+      || fs_create(fname3)
+      || (fd1 = fs_open(fname1)) == -1
+      || (fd2 = fs_open(fname2)) == -1
+      || (fd3 = fs_open(fname3)) == -1) {
+    fprintf(stderr, "test_file_locality: Failed to create files.\n");
+    return -1;
+  }
+
+  /* Grow the first two files in lockstep */
+  int i;
+  for (i = 0; i < nblocks; i++) {
+    if (write_test_pattern_at(fd1, i * BLOCK_SIZE, BLOCK_SIZE)
+        || write_test_pattern_at(fd2, i * BLOCK_SIZE, BLOCK_SIZE)) {
+      fprintf(stderr, "test_file_locality: Failed to write files.\n");
+      return -1;
+    }
+  }
+
+  /* Each moved into whole windows rather than alternating blocks */
+  if (fs_get_fragments(fd1) > 1 + nblocks / ALLOC_RUN
+      || fs_get_fragments(fd2) > 1 + nblocks / ALLOC_RUN) {
+    fprintf(stderr, "test_file_locality: Files are fragmented.\n");
+    return -1;
+  }
+
+  /* Reserve room for the third file; its first block plus one run */
+  if (fs_fallocate(fd3, reserve)
+      || fs_get_filesize(fd3) != 0
+      || fs_get_fragments(fd3) > 2) {
+    fprintf(stderr, "test_file_locality: Reservation failed.\n");
+    return -1;
+  }
+  int reserved = fs_get_fragments(fd3);
+
+  /* Filling the reservation doesn't move anything */
+  if (write_test_pattern(fd3, reserve)
+      || fs_get_fragments(fd3) != reserved
+      || fs_lseek(fd3, 0)
+      || check_test_pattern(fd3, reserve)) {
+    fprintf(stderr, "test_file_locality: Reserved blocks were not used.\n");
+    return -1;
+  }
+
+  /* Check the lockstep files survived */
+  if (fs_lseek(fd1, 0)
+      || fs_lseek(fd2, 0)
+      || check_test_pattern(fd1, nblocks * BLOCK_SIZE)
+      || check_test_pattern(fd2, nblocks * BLOCK_SIZE)) {
+    fprintf(stderr, "test_file_locality: Pattern check failed.\n");
+    return -1;
+  }
+
+  /* Close and delete the files */
+  if (fs_close(fd1)
+      || fs_close(fd2)
+      || fs_close(fd3)
+      || fs_delete(fname1)
+      || fs_delete(fname2)
+      || fs_delete(fname3)) {
+    fprintf(stderr, "test_file_locality: Failed to delete files.\n");
+    return -1;
+  }
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_file_locality: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, create far more files than fit in one directory block,
+ * delete every other one, unmount and re-mount, check that exactly the
+ * survivors can be opened and that deleted names can be reused, delete
+ * everything, and unmount.
+ */
+int test_many_files() {
+  int nfiles = 5000;
+  char fname[MAX_FNAME];
+
+  int fd = 0;
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_many_files: Mount failed.\n");
+    return -1;
+  }
+
+  /* Create all of the files, then delete the odd ones */
+  int i;
+  for (i = 0; i < nfiles; i++) {
+    sprintf(fname, "many_%d", i);
+    if (fs_create(fname)) {
+      fprintf(stderr, "test_many_files: Failed to create %s.\n", fname);
+      return -1;
+    }
+  }
+  for (i = 1; i < nfiles; i += 2) {
+    sprintf(fname, "many_%d", i);
+    if (fs_delete(fname)) {
+      fprintf(stderr, "test_many_files: Failed to delete %s.\n", fname);
+      return -1;
+    }
+  }
+
+  /* Re-mount, which rebuilds the filename index from disk */
+  if (umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_many_files: Re-mount failed.\n");
+    return -1;
+  }
+
+  /* Survivors open */
+  for (i = 0; i < nfiles; i += 2) {
+    sprintf(fname, "many_%d", i);
+    if ((fd = fs_open(fname)) == -1
+        || fs_close(fd)) {
+      fprintf(stderr, "test_many_files: Failed to open %s.\n", fname);
+      return -1;
+    }
+  }
+
+  /* Deleted files don't, and existing names are refused */
+  if (fs_open("many_1") != -1
+      || fs_create("many_0") != -1) {
+    fprintf(stderr, "test_many_files: Directory index is wrong.\n");
+    return -1;
+  }
+
+  /* Deleted names can be reused, then everything goes */
+  for (i = 0; i < nfiles; i++) {
+    sprintf(fname, "many_%d", i);
+    if ((i % 2 == 1 && fs_create(fname))
+        || fs_delete(fname)) {
+      fprintf(stderr, "test_many_files: Failed to clean up %s.\n", fname);
+      return -1;
+    }
+  }
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_many_files: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+#define THREADS 4
+
+/* Work handed to one thread of test_threads */
+typedef struct t_thread_job {
+  int id;               /* thread number, which names its private file */
+  int fd;               /* descriptor on the shared file               */
+  int ops;              /* block reads to make from the shared file    */
+  int nblocks;          /* length of the shared file in blocks         */
+  int failed;           /* set when anything went wrong                */
+} thread_job;
+
+/**
+ * Create, fill, check and delete a file private to the thread.
+ */
+void* thread_private_file(void* arg) {
+  thread_job* job = arg;
+  char fname[MAX_FNAME];
+  size_t nbytes = BLOCK_SIZE * 16 + 100 * job->id;
+
+  int fd = 0;
+
+  sprintf(fname, "thread_%d", job->id);
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern_at(fd, job->id, nbytes)
+      || fs_lseek(fd, 0)
+      || check_test_pattern_at(fd, job->id, nbytes)
+      || fs_get_filesize(fd) != nbytes
+      || fs_close(fd)
+      || fs_delete(fname)) {
+    job->failed = 1;
+  }
+
+  return NULL;
+}
+
+/**
+ * Read and check blocks of the shared file through the thread's own
+ * descriptor, hopping around the file.
+ */
+void* thread_shared_reads(void* arg) {
+  thread_job* job = arg;
+
+  int i;
+  for (i = 0; i < job->ops && !job->failed; i++) {
+    int n = (i * 7 + job->id) % job->nblocks;
+    if (fs_lseek(job->fd, n * BLOCK_SIZE)
+        || check_test_pattern_at(job->fd, n * BLOCK_SIZE, BLOCK_SIZE)) {
+      job->failed = 1;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Mount the filesystem, have several threads create, fill, check and delete
+ * files of their own at once, then time 1, 2 and 4 threads reading one shared
+ * file through their own descriptors and report the throughput, delete the
+ * shared file, and unmount.
+ */
+int test_threads() {
+  char* fname = "test_file_12";
+
+  pthread_t threads[THREADS];
+  thread_job jobs[THREADS];
+  struct timespec start, end;
+
+  int nblocks = 64;
+  int ops = 4000;
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_threads: Mount failed.\n");
+    return -1;
+  }
+
+  /* Private files, all at once */
+  int i;
+  for (i = 0; i < THREADS; i++) {
+    memset(&jobs[i], 0, sizeof(jobs[i]));
+    jobs[i].id = i;
+    pthread_create(&threads[i], NULL, thread_private_file, &jobs[i]);
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (jobs[i].failed) {
+      fprintf(stderr, "test_threads: Thread %d failed on its own file.\n", i);
+      return -1;
+    }
+  }
+
+  /* Lay out the shared file */
+  int fd = 0;
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nblocks * BLOCK_SIZE)
+      || fs_close(fd)) {
+    fprintf(stderr, "test_threads: Failed to write shared file.\n");
+    return -1;
+  }
+
+  /* Readers of the shared file, each on its own descriptor */
+  int nthreads;
+  for (nthreads = 1; nthreads <= THREADS; nthreads *= 2) {
+    for (i = 0; i < nthreads; i++) {
+      memset(&jobs[i], 0, sizeof(jobs[i]));
+      jobs[i].id = i;
+      jobs[i].ops = ops;
+      jobs[i].nblocks = nblocks;
+      if ((jobs[i].fd = fs_open(fname)) == -1) {
+        fprintf(stderr, "test_threads: Failed to open shared file.\n");
+        return -1;
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < nthreads; i++) {
+      pthread_create(&threads[i], NULL, thread_shared_reads, &jobs[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (i = 0; i < nthreads; i++) {
+      if (jobs[i].failed || fs_close(jobs[i].fd)) {
+        fprintf(stderr, "test_threads: Shared read %d failed.\n", i);
+        return -1;
+      }
+    }
+
+    double secs = (end.tv_sec - start.tv_sec)
+      + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("  %d thread%s %10.0f reads/s\n", nthreads,
+           nthreads == 1 ? " " : "s", nthreads * ops / secs);
+  }
+
+  /* Delete the shared file and unmount filesystem */
+  if (fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_threads: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Work handed to one thread of test_positional_io */
+typedef struct t_pread_job {
+  int fd;               /* descriptor shared by every thread      */
+  int id;               /* thread number, which picks the offsets */
+  int nblocks;          /* length of the file in blocks           */
+  int closing;          /* set when the descriptor may close      */
+  int failed;           /* set when a read came back wrong        */
+} pread_job;
+
+/**
+ * Check that (nbytes) of (buffer) hold the test pattern from byte (start).
+ */
+int check_pattern_buffer(char* buffer, size_t start, size_t nbytes) {
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    if (buffer[i] != 'a' + ((start + i) % ('z' - 'a'))) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Read blocks of the file at unaligned offsets through the shared descriptor,
+ * until it is closed if it may be.
+ */
+void* thread_preads(void* arg) {
+  pread_job* job = arg;
+  char buffer[BLOCK_SIZE];
+
+  int i;
+  for (i = 0; i < 500 && !job->failed; i++) {
+    size_t off = ((i * 13 + job->id * 5) % (job->nblocks - 1)) * BLOCK_SIZE
+      + 7 * job->id;
+    int got = fs_pread(job->fd, buffer, BLOCK_SIZE, off);
+    if (got == -1 && job->closing) {
+      break;
+    }
+    if (got != BLOCK_SIZE || check_pattern_buffer(buffer, off, BLOCK_SIZE)) {
+      job->failed = 1;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Mount the filesystem, write a file, check that fs_pread and fs_pwrite work at
+ * the offsets given without moving the file pointer, have several threads read
+ * through one descriptor at once, then close it while they still do, delete
+ * the file and unmount.
+ */
+int test_positional_io() {
+  char* fname = "test_file_13";
+
+  pthread_t threads[THREADS];
+  pread_job jobs[THREADS];
+
+  int fd = 0;
+  int nblocks = 24;
+  size_t nbytes = BLOCK_SIZE * nblocks;
+  char buffer[BLOCK_SIZE + 50];
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_positional_io: Mount failed.\n");
+    return -1;
+  }
+
+  /* Write the file, leaving the file pointer at its start */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_lseek(fd, 0)) {
+    fprintf(stderr, "test_positional_io: Failed to write file.\n");
+    return -1;
+  }
+
+  /* Positional reads, including a short one at the end of the file */
+  if (fs_pread(fd, buffer, sizeof(buffer), 5000) != sizeof(buffer)
+      || check_pattern_buffer(buffer, 5000, sizeof(buffer))
+      || fs_pread(fd, buffer, sizeof(buffer), nbytes - 10) != 10
+      || check_pattern_buffer(buffer, nbytes - 10, 10)
+      || fs_pread(fd, buffer, sizeof(buffer), nbytes) != 0) {
+    fprintf(stderr, "test_positional_io: Positional read failed.\n");
+    return -1;
+  }
+
+  /* Positional writes: rewrite a span with the same pattern, then append */
+  char* tail = malloc(BLOCK_SIZE * 2);
+  int i;
+  for (i = 0; i < BLOCK_SIZE * 2; i++) {
+    tail[i] = 'a' + ((nbytes - 100 + i) % ('z' - 'a'));
+  }
+  if (fs_pwrite(fd, tail, BLOCK_SIZE * 2, nbytes - 100) != BLOCK_SIZE * 2
+      || fs_get_filesize(fd) != nbytes - 100 + BLOCK_SIZE * 2
+      || fs_pwrite(fd, tail, 10, nbytes + BLOCK_SIZE * 3) != -1
+      || fs_pwrite(fd, tail, INT_MAX, 100) != -1
+      || fs_get_filesize(fd) != nbytes - 100 + BLOCK_SIZE * 2) {
+    fprintf(stderr, "test_positional_io: Positional write failed.\n");
+    return -1;
+  }
+  free(tail);
+  nbytes += BLOCK_SIZE * 2 - 100;
+
+  /* The file pointer never moved */
+  if (check_test_pattern(fd, nbytes)) {
+    fprintf(stderr, "test_positional_io: File pointer moved.\n");
+    return -1;
+  }
+
+  /* Many readers on the one descriptor */
+  for (i = 0; i < THREADS; i++) {
+    memset(&jobs[i], 0, sizeof(jobs[i]));
+    jobs[i].fd = fd;
+    jobs[i].id = i;
+    jobs[i].nblocks = nblocks;
+    pthread_create(&threads[i], NULL, thread_preads, &jobs[i]);
+  }
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (jobs[i].failed) {
+      fprintf(stderr, "test_positional_io: Thread %d read bad data.\n", i);
+      return -1;
+    }
+  }
+
+  /* Close the descriptor under readers, which then fail cleanly */
+  for (i = 0; i < THREADS; i++) {
+    memset(&jobs[i], 0, sizeof(jobs[i]));
+    jobs[i].fd = fd;
+    jobs[i].id = i;
+    jobs[i].nblocks = nblocks;
+    jobs[i].closing = 1;
+    pthread_create(&threads[i], NULL, thread_preads, &jobs[i]);
+  }
+  int closed = fs_close(fd);
+  for (i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (jobs[i].failed) {
+      fprintf(stderr, "test_positional_io: Thread %d read bad data.\n", i);
+      return -1;
+    }
+  }
+  if (closed || fs_pread(fd, buffer, 10, 0) != -1) {
+    fprintf(stderr, "test_positional_io: Close under readers failed.\n");
+    return -1;
+  }
+
+  /* Delete the file and unmount filesystem */
+  if (fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_positional_io: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, write a long file and time single-block reads at the
+ * start and at the end of it, which should cost the same once the block map is
+ * built, then check random reads before and after truncating the file and
+ * growing it again, delete the file, and unmount.
+ */
+int test_block_map() {
+  char* fname = "test_file_14";
+
+  int fd = 0;
+  int nblocks = 2000;
+  int reads = 2000;
+  size_t nbytes = (size_t) BLOCK_SIZE * nblocks;
+  char buffer[BLOCK_SIZE];
+  struct timespec start, end;
+
+  /* Mount filesystem and write the file */
+  if (mount_fs(DISK_NAME)
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)) {
+    fprintf(stderr, "test_block_map: Failed to write file.\n");
+    return -1;
+  }
+
+  /* Reads near the start, then near the end */
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    size_t base = pass ? nbytes - 8 * BLOCK_SIZE : 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int i;
+    for (i = 0; i < reads; i++) {
+      size_t off = base + (i % 8) * BLOCK_SIZE;
+      if (fs_pread(fd, buffer, BLOCK_SIZE, off) != BLOCK_SIZE
+          || check_pattern_buffer(buffer, off, BLOCK_SIZE)) {
+        fprintf(stderr, "test_block_map: Read at %zu failed.\n", off);
+        return -1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("  reads at block %4d %8.2f us each\n", (int) (base / BLOCK_SIZE),
+           ((end.tv_sec - start.tv_sec) * 1e6
+            + (end.tv_nsec - start.tv_nsec) / 1e3) / reads);
+  }
+
+  /* Cut the file back and grow it again; the map must follow both */
+  size_t cut = BLOCK_SIZE * 700 + 123;
+  if (fs_truncate(fd, cut)
+      || fs_lseek(fd, cut)
+      || write_test_pattern_at(fd, cut, nbytes - cut)
+      || fs_get_filesize(fd) != nbytes) {
+    fprintf(stderr, "test_block_map: Failed to truncate and regrow file.\n");
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < 200; i++) {
+    size_t off = ((size_t) i * 7919 * 13) % (nbytes - BLOCK_SIZE);
+    if (fs_pread(fd, buffer, BLOCK_SIZE, off) != BLOCK_SIZE
+        || check_pattern_buffer(buffer, off, BLOCK_SIZE)) {
+      fprintf(stderr, "test_block_map: Random read at %zu failed.\n", off);
+      return -1;
+    }
+  }
+
+  /* Delete the file and unmount filesystem */
+  if (fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_block_map: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, write a file and read it back in small sequential
+ * pieces with readahead off and on, reporting the time and the readahead hit
+ * rate, check that random reads shrink the window so little is prefetched,
+ * delete the file, and unmount.
+ */
+int test_readahead() {
+  char* fname = "test_file_15";
+
+  int fd = 0;
+  int nblocks = 256;
+  size_t nbytes = (size_t) BLOCK_SIZE * nblocks;
+  size_t piece = 1000;
+  char buffer[BLOCK_SIZE];
+  struct timespec start, end;
+  disk_stats stats;
+
+  /* Mount filesystem and write the file */
+  if (mount_fs(DISK_NAME)
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_sync()) {
+    fprintf(stderr, "test_readahead: Failed to write file.\n");
+    return -1;
+  }
+
+  /* Sequential pieces, without and then with readahead */
+  int window;
+  for (window = 0; window <= READAHEAD_MAX; window += READAHEAD_MAX) {
+    if (fs_set_readahead(window)
+        || (fd = fs_open(fname)) == -1) {
+      fprintf(stderr, "test_readahead: Failed to open file.\n");
+      return -1;
+    }
+
+    disk_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t done;
+    for (done = 0; done < nbytes; done += piece) {
+      size_t n = nbytes - done < piece ? nbytes - done : piece;
+      if (check_test_pattern_at(fd, done, n)) {
+        fprintf(stderr, "test_readahead: Read at %zu failed.\n", done);
+        return -1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    disk_get_stats(&stats);
+
+    printf("  readahead %2d %8.3f ms, %lu prefetched, %lu used\n", window,
+           (end.tv_sec - start.tv_sec) * 1e3
+           + (end.tv_nsec - start.tv_nsec) / 1e6,
+           stats.prefetches, stats.prefetch_hits);
+
+    if (fs_close(fd)) {
+      fprintf(stderr, "test_readahead: Failed to close file.\n");
+      return -1;
+    }
+  }
+
+  /* Nearly everything read ahead got used, and nearly every block was */
+  if (stats.prefetch_hits < stats.prefetches * 9 / 10
+      || stats.prefetch_hits < nblocks * 9 / 10) {
+    fprintf(stderr, "test_readahead: Readahead missed.\n");
+    return -1;
+  }
+
+  /* Random reads stop the prefetching after the first few */
+  disk_reset_stats();
+  if ((fd = fs_open(fname)) == -1) {
+    fprintf(stderr, "test_readahead: Failed to open file.\n");
+    return -1;
+  }
+  int i;
+  for (i = 0; i < 100; i++) {
+    size_t off = ((size_t) i * 7919 * 37) % (nbytes - piece);
+    if (fs_lseek(fd, off)
+        || fs_read(fd, buffer, piece) != piece) {
+      fprintf(stderr, "test_readahead: Random read failed.\n");
+      return -1;
+    }
+  }
+  disk_get_stats(&stats);
+  if (stats.prefetches > 2 * READAHEAD_MIN) {
+    fprintf(stderr, "test_readahead: Random reads were read ahead.\n");
+    return -1;
+  }
+
+  /* Delete the file and unmount filesystem */
+  if (fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_readahead: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Mount the filesystem, append small records to one file and whole blocks to
+ * another, reporting the throughput of each and checking that the records
+ * cost about one block write per block, that a second descriptor sees
+ * buffered data straight away, that everything survives closing and
+ * re-mounting, and that a record which can't be written out on a full disk
+ * stays buffered until space is freed, then delete the files and unmount.
+ */
+int test_small_appends() {
+  char* fname1 = "test_file_16";
+  char* fname2 = "test_file_17";
+  char* fname3 = "test_file_31";
+
+  int fd1 = 0, fd2 = 0, fd3 = 0;
+  int nblocks = 256;
+  size_t record = 64;
+  size_t nbytes = (size_t) BLOCK_SIZE * nblocks;
+  struct timespec start, end;
+  disk_stats stats;
+  char buffer[BLOCK_SIZE];
+
+  char* data = malloc(nbytes);
+  int i;
+  for (i = 0; i < nbytes; i++) {
+    data[i] = 'a' + (i % ('z' - 'a'));
+  }
+
+  /* Mount filesystem and create the files */
+  if (mount_fs(DISK_NAME)
+      || fs_create(fname1)
+      || fs_create(fname2)
+      || (fd1 = fs_open(fname1)) == -1
+      || (fd2 = fs_open(fname2)) == -1
+      || (fd3 = fs_open(fname1)) == -1) {
+    fprintf(stderr, "test_small_appends: Failed to create files.\n");
+    return -1;
+  }
+
+  /* Small records, then whole blocks */
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    size_t piece = pass ? BLOCK_SIZE : record;
+    int fd = pass ? fd2 : fd1;
+
+    disk_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t done;
+    for (done = 0; done < nbytes; done += piece) {
+      if (fs_write(fd, data + done, piece) != piece) {
+        fprintf(stderr, "test_small_appends: Append failed.\n");
+        return -1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    disk_get_stats(&stats);
+
+    double secs = (end.tv_sec - start.tv_sec)
+      + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("  appends of %4zu bytes %8.1f MB/s, %lu block writes\n", piece,
+           nbytes / secs / (1 << 20), stats.writes);
+
+    if (stats.writes > nblocks + 1) {
+      fprintf(stderr, "test_small_appends: Too many block writes.\n");
+      return -1;
+    }
+  }
+
+  /* A record left in the write buffer is visible through another descriptor */
+  if (fs_write(fd1, data, 10) != 10
+      || fs_pread(fd3, buffer, 20, nbytes - 10) != 20
+      || memcmp(buffer, data + nbytes - 10, 10)
+      || memcmp(buffer + 10, data, 10)) {
+    fprintf(stderr, "test_small_appends: Buffered data not visible.\n");
+    return -1;
+  }
+
+  /* Closing and re-mounting keeps every record */
+  if (fs_close(fd1)
+      || fs_close(fd2)
+      || fs_close(fd3)
+      || umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)
+      || (fd1 = fs_open(fname1)) == -1
+      || fs_get_filesize(fd1) != nbytes + 10
+      || check_test_pattern(fd1, nbytes)
+      || fs_read(fd1, buffer, BLOCK_SIZE) != 10
+      || memcmp(buffer, data, 10)) {
+    fprintf(stderr, "test_small_appends: Records lost.\n");
+    return -1;
+  }
+
+  /* On a full disk, fs_close can't write a record past the last block out
+   * and keeps the descriptor open with the record still buffered */
+  if ((fd2 = fs_open(fname2)) == -1
+      || fs_lseek(fd2, nbytes)
+      || fs_create(fname3)
+      || (fd3 = fs_open(fname3)) == -1
+      || fs_fallocate(fd3, (off_t) fs_get_free_blocks() * BLOCK_SIZE)
+      || fs_get_free_blocks() != 0
+      || fs_close(fd3)
+      || fs_write(fd2, data, 10) != 10
+      || fs_close(fd2) != -1
+      || fs_pread(fd2, buffer, 10, nbytes) != 10
+      || memcmp(buffer, data, 10)) {
+    fprintf(stderr, "test_small_appends: Close on a full disk dropped data.\n");
+    return -1;
+  }
+
+  /* Once space is freed, fs_sync writes it out and the close goes through */
+  if (fs_delete(fname3)
+      || fs_sync()
+      || fs_close(fd2)
+      || (fd2 = fs_open(fname2)) == -1
+      || fs_get_filesize(fd2) != nbytes + 10
+      || fs_pread(fd2, buffer, BLOCK_SIZE, nbytes) != 10
+      || memcmp(buffer, data, 10)
+      || fs_close(fd2)) {
+    fprintf(stderr, "test_small_appends: Buffered record not written.\n");
+    return -1;
+  }
+  free(data);
+
+  /* Delete the files and unmount filesystem */
+  if (fs_close(fd1)
+      || fs_delete(fname1)
+      || fs_delete(fname2)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_small_appends: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int test_reclaim() {
+  char* fname = "test_file_18";
+
+  int fd = 0;
+  int nblocks = 2048;
+  struct timespec start, end;
+  char buffer[BLOCK_SIZE];
+  memset(buffer, 'r', BLOCK_SIZE);
+
+  /* Mount filesystem */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_reclaim: Failed to mount.\n");
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+
+  /* Delete a large file inline, then through the reclaimer */
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    if (fs_set_deferred_free(pass)
+        || fs_create(fname)
+        || (fd = fs_open(fname)) == -1) {
+      fprintf(stderr, "test_reclaim: Failed to create file.\n");
+      return -1;
+    }
+
+    int i;
+    for (i = 0; i < nblocks; i++) {
+      if (fs_write(fd, buffer, BLOCK_SIZE) != BLOCK_SIZE) {
+        fprintf(stderr, "test_reclaim: Write failed.\n");
+        return -1;
+      }
+    }
+
+    if (fs_close(fd) || fs_get_free_blocks() != free_start - nblocks) {
+      fprintf(stderr, "test_reclaim: Blocks not allocated.\n");
+      return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fs_delete(fname)) {
+      fprintf(stderr, "test_reclaim: Delete failed.\n");
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double usecs = (end.tv_sec - start.tv_sec) * 1e6
+      + (end.tv_nsec - start.tv_nsec) / 1e3;
+    printf("  %s delete of %d blocks %8.1f us\n",
+           pass ? "deferred" : "inline  ", nblocks, usecs);
+
+    /* Space is counted as free whether or not it has been released yet */
+    if (fs_get_free_blocks() != free_start) {
+      fprintf(stderr, "test_reclaim: Space not counted as free.\n");
+      return -1;
+    }
+  }
+
+  /* Reserving the whole disk right after a deferred delete waits for the
+   * reclaimer instead of failing */
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || fs_close(fd)
+      || fs_delete(fname)
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || fs_fallocate(fd, (off_t) free_start * BLOCK_SIZE)
+      || fs_get_free_blocks() != 0
+      || fs_close(fd)
+      || fs_delete(fname)) {
+    fprintf(stderr, "test_reclaim: Could not reuse reclaimed space.\n");
+    return -1;
+  }
+
+  /* After a sync and a re-mount every block is free on the disk too */
+  if (fs_sync()
+      || fs_get_free_blocks() != free_start
+      || umount_fs(DISK_NAME)
+      || fs_set_deferred_free(0)
+      || mount_fs(DISK_NAME)
+      || fs_get_free_blocks() != free_start) {
+    fprintf(stderr, "test_reclaim: Reclaimed blocks not written back.\n");
+    return -1;
+  }
+
+  /* Unmount filesystem */
+  if (umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_reclaim: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int test_stats() {
+  char* fname = "test_file_19";
+  char* names[FS_OPS] = { "read", "write", "pread", "pwrite", "open", "close",
+                          "create", "delete", "lseek", "truncate", "fallocate",
+                          "sync" };
+
+  int fd = 0;
+  int nblocks = 8;
+  size_t nbytes = (size_t) BLOCK_SIZE * nblocks;
+  char* buffer = malloc(nbytes);
+  fs_stats stats;
+
+  /* Mount filesystem and count a short session */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_stats: Failed to mount.\n");
+    return -1;
+  }
+  fs_reset_stats();
+
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_lseek(fd, 0)
+      || fs_read(fd, buffer, nbytes) != nbytes
+      || fs_read(-1, buffer, 1) != -1
+      || fs_sync()) {
+    fprintf(stderr, "test_stats: File operations failed.\n");
+    return -1;
+  }
+  fs_get_stats(&stats);
+
+  int i;
+  for (i = 0; i < FS_OPS; i++) {
+    op_stats* s = &stats.ops[i];
+    if (s->calls) {
+      printf("  %-9s %2lu calls %6lu bytes %8.1f us %5.1f reads %5.1f writes\n",
+             names[i], s->calls, s->bytes, s->ns / 1e3,
+             (double) s->block_reads / s->calls,
+             (double) s->block_writes / s->calls);
+    }
+  }
+  printf("  %lu chain hops, %lu blocks allocated scanning %lu\n",
+         stats.chain_hops, stats.allocs, stats.alloc_scanned);
+
+  op_stats* reads = &stats.ops[FS_OP_READ];
+  op_stats* writes = &stats.ops[FS_OP_WRITE];
+  if (reads->calls != 2 || reads->errors != 1 || reads->bytes != nbytes
+      || writes->calls != 1 || writes->bytes != nbytes
+      || writes->block_writes < nblocks
+      || stats.ops[FS_OP_CREATE].calls != 1
+      || stats.ops[FS_OP_SYNC].block_writes == 0
+      || stats.allocs < nblocks
+      || stats.alloc_scanned < stats.allocs
+      || stats.chain_hops < nblocks - 1
+      || stats.disk.writes < nblocks) {
+    fprintf(stderr, "test_stats: Wrong counters.\n");
+    return -1;
+  }
+
+  /* Nothing is counted while counting is off */
+  if (fs_set_stats(0)
+      || fs_lseek(fd, 0)
+      || fs_read(fd, buffer, nbytes) != nbytes
+      || fs_set_stats(1)) {
+    fprintf(stderr, "test_stats: File operations failed.\n");
+    return -1;
+  }
+  fs_get_stats(&stats);
+  if (stats.ops[FS_OP_READ].calls != 2 || stats.ops[FS_OP_LSEEK].calls != 1) {
+    fprintf(stderr, "test_stats: Counted while turned off.\n");
+    return -1;
+  }
+  free(buffer);
+
+  /* Delete the file and unmount filesystem */
+  if (fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_stats: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Read the trace saved at (path) into (header), returning its records, or NULL
+ * if it can't be read.
+ */
+disk_trace_record* load_trace(char* path, disk_trace_header* header) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+
+  disk_trace_record* records = NULL;
+  if (fread(header, sizeof(*header), 1, f) == 1) {
+    records = malloc((header->records + 1) * sizeof(disk_trace_record));
+    if (fread(records, sizeof(disk_trace_record), header->records, f)
+        != header->records) {
+      free(records);
+      records = NULL;
+    }
+  }
+
+  fclose(f);
+  return records;
+}
+
+int test_trace() {
+  char* fname = "test_file_20";
+  char* trace = "test.trace";
+  char* scratch = "replay.fs";
+
+  int fd = 0;
+  int nblocks = 4;
+  size_t nbytes = (size_t) BLOCK_SIZE * nblocks;
+  char* buffer = malloc(nbytes);
+  disk_trace_header header;
+  disk_stats stats;
+
+  /* Trace a short session, unmount included */
+  if (disk_trace_start(4096)
+      || mount_fs(DISK_NAME)
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_lseek(fd, 0)
+      || fs_read(fd, buffer, nbytes) != nbytes
+      || fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)
+      || disk_trace_save(trace)) {
+    fprintf(stderr, "test_trace: Traced session failed.\n");
+    return -1;
+  }
+  disk_trace_stop();
+
+  disk_trace_record* records = load_trace(trace, &header);
+  if (!records || header.magic != DISK_TRACE_MAGIC || header.dropped != 0) {
+    fprintf(stderr, "test_trace: Trace unreadable.\n");
+    return -1;
+  }
+
+  /* The file's data blocks are written and read back under the right calls */
+  unsigned long i;
+  int data_writes = 0, data_reads = 0, untagged = 0, prefetched = 0;
+  for (i = 0; i < header.records; i++) {
+    disk_trace_record* rec = &records[i];
+    int write = rec->kind == DISK_TRACE_WRITE
+      || rec->kind == DISK_TRACE_WRITE_ASYNC;
+
+    if (rec->kind == DISK_TRACE_PREFETCH) {
+      prefetched++;
+    }
+    if (rec->tag == 0) {
+      untagged++;
+    } else if (rec->block >= DATA_START) {
+      data_writes += write && rec->tag == FS_OP_WRITE + 1;
+      data_reads += !write && rec->tag == FS_OP_READ + 1;
+    }
+  }
+  printf("  %lu records, %d untagged (mount and unmount)\n", header.records,
+         untagged);
+
+  if (data_writes != nblocks || data_reads < nblocks || untagged == 0) {
+    fprintf(stderr, "test_trace: Records not attributed to their calls.\n");
+    return -1;
+  }
+
+  /* Replaying the trace on a scratch disk issues the same accesses */
+  unlink(scratch);
+  if (make_disk(scratch)
+      || open_disk(scratch)) {
+    fprintf(stderr, "test_trace: Could not open scratch disk.\n");
+    return -1;
+  }
+
+  disk_reset_stats();
+  if (disk_trace_replay(trace, 0)) {
+    fprintf(stderr, "test_trace: Replay failed.\n");
+    return -1;
+  }
+  disk_get_stats(&stats);
+
+  if (close_disk()
+      || stats.reads + stats.writes + prefetched != header.records) {
+    fprintf(stderr, "test_trace: Replay issued different accesses.\n");
+    return -1;
+  }
+  free(records);
+
+  /* A full ring keeps only the newest records */
+  if (disk_trace_start(8)
+      || mount_fs(DISK_NAME)
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || umount_fs(DISK_NAME)
+      || disk_trace_save(trace)
+      || !(records = load_trace(trace, &header))
+      || header.records != 8
+      || header.dropped == 0) {
+    fprintf(stderr, "test_trace: Ring did not wrap.\n");
+    return -1;
+  }
+  disk_trace_stop();
+  free(records);
+  free(buffer);
+
+  unlink(trace);
+  unlink(scratch);
+  return 0;
+}
+
+/**
+ * Copy disk image (from) to (to), which then looks like the disk after a crash
+ * at this point.
+ */
+int copy_image(char* from, char* to) {
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  char buffer[1 << 16];
+  size_t n;
+
+  int failed = !in || !out;
+  while (!failed && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    failed = fwrite(buffer, 1, n, out) != n;
+  }
+
+  if (in) {
+    fclose(in);
+  }
+  if (out && fclose(out)) {
+    failed = 1;
+  }
+  return failed ? -1 : 0;
+}
+
+/**
+ * Create and delete (ops) files private to the thread. Thread ids and
+ * operation counts are bounded so every name fits in MAX_FNAME and no two
+ * threads ever use the same one.
+ */
+void* thread_journal_churn(void* arg) {
+  thread_job* job = arg;
+  char name[MAX_FNAME];
+
+  if (job->id < 0 || job->id >= 1000 || job->ops > 100000) {
+    job->failed = 1;
+    return NULL;
+  }
+
+  int i;
+  for (i = 0; i < job->ops; i++) {
+    int len = snprintf(name, sizeof(name), "test_j%d_%d", job->id % 1000,
+                       i % 100000);
+    if (len < 0 || len >= sizeof(name)
+        || fs_create(name) || fs_delete(name)) {
+      job->failed = 1;
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+int test_journal() {
+  char* fname = "test_file_22";
+  char* fname2 = "test_file_23";
+  char* fname3 = "test_file_32";
+  char* crashed = "crash.fs";
+  char* torn = "torn.fs";
+  char* reused = "reuse.fs";
+  char* split = "split.fs";
+
+  int fd = 0;
+  size_t nbytes = BLOCK_SIZE * 3 + 17;
+  fs_stats stats;
+
+  /* Two files, each committed by its own fs_sync */
+  if (mount_fs(DISK_NAME)
+      || fs_reset_stats()
+      || fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_sync()
+      || fs_get_stats(&stats)
+      || stats.commits != 1) {
+    fprintf(stderr, "test_journal: First commit failed.\n");
+    return -1;
+  }
+  unsigned long first = stats.journal_blocks;
+
+  if (fs_create(fname2)
+      || (fd = fs_open(fname2)) == -1
+      || write_test_pattern(fd, 2 * nbytes)
+      || fs_close(fd)
+      || fs_sync()
+      || fs_get_stats(&stats)
+      || stats.commits != 2
+      || stats.checkpoints != 0) {
+    fprintf(stderr, "test_journal: Second commit failed.\n");
+    return -1;
+  }
+  int free_blocks = fs_get_free_blocks();
+
+  /* Crash now: the changes are in the journal only. In one copy, tear the
+   * second transaction by damaging its first metadata block. */
+  FILE* f = NULL;
+  if (copy_image(DISK_NAME, crashed)
+      || copy_image(DISK_NAME, torn)
+      || !(f = fopen(torn, "r+b"))
+      || fseek(f, (long) (JOURNAL_START + first + 1) * BLOCK_SIZE, SEEK_SET)
+      || fputc(0x5a, f) == EOF
+      || fclose(f)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_journal: Could not copy disk.\n");
+    return -1;
+  }
+
+  /* Replay brings back both files */
+  if (mount_fs(crashed)
+      || fs_get_free_blocks() != free_blocks
+      || (fd = fs_open(fname)) == -1
+      || fs_get_filesize(fd) != nbytes
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || (fd = fs_open(fname2)) == -1
+      || fs_get_filesize(fd) != 2 * nbytes
+      || check_test_pattern(fd, 2 * nbytes)
+      || fs_close(fd)
+      || umount_fs(crashed)) {
+    fprintf(stderr, "test_journal: Committed changes lost in crash.\n");
+    return -1;
+  }
+
+  /* A torn transaction is dropped as a whole; the one before it survives */
+  if (mount_fs(torn)
+      || (fd = fs_open(fname)) == -1
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || fs_open(fname2) != -1
+      || fs_get_free_blocks()
+         != free_blocks + (2 * nbytes + BLOCK_SIZE - 1) / BLOCK_SIZE
+      || umount_fs(torn)) {
+    fprintf(stderr, "test_journal: Torn transaction not dropped.\n");
+    return -1;
+  }
+
+  if (unlink(crashed) || unlink(torn)) {
+    fprintf(stderr, "test_journal: Could not remove copies.\n");
+    return -1;
+  }
+
+  /* Blocks of a file deleted since the last commit are not reused yet, so
+   * another file's data written out before a crash can't land in them. This
+   * runs on a copy, to leave the layout of the test disk alone. */
+  if (copy_image(DISK_NAME, reused)
+      || mount_fs(reused)
+      || fs_delete(fname)
+      || fs_create(fname3)
+      || (fd = fs_open(fname3)) == -1
+      || write_test_pattern_at(fd, 1, nbytes)
+      || fs_close(fd)
+      || disk_flush()
+      || copy_image(reused, crashed)
+      || umount_fs(reused)
+      || mount_fs(crashed)
+      || (fd = fs_open(fname)) == -1
+      || check_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || umount_fs(crashed)
+      || unlink(crashed)
+      || unlink(reused)) {
+    fprintf(stderr, "test_journal: Freed blocks reused before commit.\n");
+    return -1;
+  }
+
+  /* Calls made without fs_sync are committed in pieces before they outgrow
+   * the journal, here by creating enough files to fill a quarter of it with
+   * directory blocks, and a crash keeps the pieces committed so far */
+  char name[MAX_FNAME];
+  int nfiles = JOURNAL_BLOCKS / 4 * (BLOCK_SIZE / sizeof(directory_entry)) + 64;
+  if (copy_image(DISK_NAME, split)
+      || mount_fs(split)
+      || fs_reset_stats()) {
+    fprintf(stderr, "test_journal: Could not copy disk.\n");
+    return -1;
+  }
+  int i;
+  for (i = 0; i < nfiles; i++) {
+    snprintf(name, sizeof(name), "split_%d", i % 100000);
+    if (fs_create(name)) {
+      fprintf(stderr, "test_journal: Failed to create %s.\n", name);
+      return -1;
+    }
+  }
+  if (fs_get_stats(&stats)
+      || stats.commits < 1
+      || disk_flush()
+      || copy_image(split, crashed)
+      || umount_fs(split)
+      || mount_fs(crashed)
+      || (fd = fs_open("split_0")) == -1
+      || fs_close(fd)
+      || umount_fs(crashed)
+      || unlink(crashed)
+      || unlink(split)) {
+    fprintf(stderr, "test_journal: Long transaction not committed early.\n");
+    return -1;
+  }
+
+  /* Synchronous commits, from one thread and then from several at once */
+  if (mount_fs(DISK_NAME) || fs_set_journal_sync(1)) {
+    fprintf(stderr, "test_journal: Mount failed.\n");
+    return -1;
+  }
+
+  pthread_t threads[THREADS];
+  thread_job jobs[THREADS];
+  struct timespec start, end;
+  int ops = 50;
+
+  int nthreads;
+  for (nthreads = 1; nthreads <= THREADS; nthreads *= THREADS) {
+    fs_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int i;
+    for (i = 0; i < nthreads; i++) {
+      memset(&jobs[i], 0, sizeof(jobs[i]));
+      jobs[i].id = i;
+      jobs[i].ops = ops;
+      pthread_create(&threads[i], NULL, thread_journal_churn, &jobs[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+      pthread_join(threads[i], NULL);
+      if (jobs[i].failed) {
+        fprintf(stderr, "test_journal: Thread %d failed.\n", i);
+        return -1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fs_get_stats(&stats);
+
+    /* Each call is committed, but never by more than one commit */
+    int calls = 2 * ops * nthreads;
+    if (stats.commits == 0 || stats.commits > calls
+        || (nthreads == 1 && stats.commits != calls)) {
+      fprintf(stderr, "test_journal: %lu commits for %d calls.\n",
+              stats.commits, calls);
+      return -1;
+    }
+
+    double usecs = (end.tv_sec - start.tv_sec) * 1e6
+      + (end.tv_nsec - start.tv_nsec) / 1e3;
+    printf("  %d thread%s %8.1f us per call, %.2f syncs per call\n", nthreads,
+           nthreads == 1 ? " " : "s", usecs / calls,
+           (double) stats.disk.syncs / calls);
+  }
+
+  if (fs_set_journal_sync(0) || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_journal: Unmount failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int test_inline() {
+  char* fname = "test_file_24";
+  char* marker = "test_file_25";
+
+  int fd = 0;
+  size_t small = INLINE_MAX - 8;
+  size_t large = 2 * BLOCK_SIZE + 5;
+  char buffer[INLINE_MAX];
+  fs_stats stats;
+
+  /* Creating, filling and re-mounting tiny files takes no data block */
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_inline: Failed to mount.\n");
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+
+  if (fs_create(fname)
+      || fs_create(marker)
+      || (fd = fs_open(fname)) == -1
+      || write_test_pattern(fd, small)
+      || fs_pwrite(fd, "ab", 2, 0) != 2
+      || fs_get_fragments(fd) != 0
+      || fs_close(fd)
+      || fs_get_free_blocks() != free_start
+      || umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)
+      || fs_get_free_blocks() != free_start) {
+    fprintf(stderr, "test_inline: Tiny files took blocks.\n");
+    return -1;
+  }
+
+  /* Reading one back needs no block I/O */
+  fs_reset_stats();
+  if ((fd = fs_open(fname)) == -1
+      || fs_read(fd, buffer, INLINE_MAX) != small
+      || memcmp(buffer, "ab", 2)
+      || check_pattern_buffer(buffer + 2, 2, small - 2)
+      || fs_get_stats(&stats)
+      || stats.ops[FS_OP_READ].block_reads != 0) {
+    fprintf(stderr, "test_inline: Inline read failed.\n");
+    return -1;
+  }
+
+  /* Truncating keeps it inline; growing past INLINE_MAX moves it to a chain
+   * that starts with what it held */
+  if (fs_truncate(fd, 2)
+      || fs_lseek(fd, 2)
+      || write_test_pattern_at(fd, 2, large - 2)
+      || fs_get_fragments(fd) != 1
+      || fs_get_filesize(fd) != large
+      || fs_lseek(fd, 0)
+      || fs_read(fd, buffer, 2) != 2
+      || memcmp(buffer, "ab", 2)
+      || check_test_pattern_at(fd, 2, large - 2)
+      || fs_close(fd)
+      || fs_get_free_blocks() != free_start - 3) {
+    fprintf(stderr, "test_inline: Promotion failed.\n");
+    return -1;
+  }
+
+  /* Reserving space promotes an empty file too */
+  if ((fd = fs_open(marker)) == -1
+      || fs_fallocate(fd, INLINE_MAX)
+      || fs_get_fragments(fd) != 0
+      || fs_fallocate(fd, BLOCK_SIZE * 4)
+      || fs_get_fragments(fd) != 1
+      || fs_get_filesize(fd) != 0
+      || fs_close(fd)
+      || fs_get_free_blocks() != free_start - 7) {
+    fprintf(stderr, "test_inline: Reservation failed.\n");
+    return -1;
+  }
+
+  /* The promoted file survives a re-mount, and every block is given back on
+   * delete */
+  if (umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)
+      || (fd = fs_open(fname)) == -1
+      || fs_read(fd, buffer, 2) != 2
+      || memcmp(buffer, "ab", 2)
+      || check_test_pattern_at(fd, 2, large - 2)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || fs_delete(marker)
+      || fs_get_free_blocks() != free_start
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_inline: Re-mount or delete failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int test_compress() {
+  char* fname = "test_file_26";
+  char* noise = "test_file_27";
+
+  int fd = 0;
+  size_t nbytes = 10 * CLUSTER_SIZE + 123;
+  size_t cut = 4 * CLUSTER_SIZE + 77;
+  char* buffer = malloc(3 * CLUSTER_SIZE);
+  char* random = malloc(3 * CLUSTER_SIZE);
+  unsigned int seed = 26;
+  fs_stats stats;
+
+  int i;
+  for (i = 0; i < 3 * CLUSTER_SIZE; i++) {
+    random[i] = rand_r(&seed);
+  }
+  unsigned int magic = CLUSTER_MAGIC;
+  memcpy(random, &magic, sizeof(magic));
+
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_compress: Failed to mount.\n");
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+
+  /* The test pattern repeats every 25 bytes, so it takes far fewer blocks
+   * than it would stored as is */
+  fs_reset_stats();
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || fs_set_compressed(fd, 1)
+      || write_test_pattern(fd, nbytes)
+      || fs_close(fd)
+      || free_start - fs_get_free_blocks() > nbytes / BLOCK_SIZE / 3
+      || fs_get_stats(&stats)
+      || stats.compressed_bytes != nbytes
+      || stats.compressed_blocks != free_start - fs_get_free_blocks()) {
+    fprintf(stderr, "test_compress: Compressed write failed.\n");
+    return -1;
+  }
+
+  /* It reads back whole, and from any offset */
+  if ((fd = fs_open(fname)) == -1
+      || check_test_pattern(fd, nbytes)
+      || fs_pread(fd, buffer, 100, CLUSTER_SIZE - 50) != 100
+      || buffer[0] != 'a' + (CLUSTER_SIZE - 50) % ('z' - 'a')
+      || buffer[99] != 'a' + (CLUSTER_SIZE + 49) % ('z' - 'a')
+      || fs_pread(fd, buffer, 1000, nbytes - 23) != 23
+      || buffer[22] != 'a' + (nbytes - 1) % ('z' - 'a')) {
+    fprintf(stderr, "test_compress: Compressed read failed.\n");
+    return -1;
+  }
+
+  /* Data that won't compress, overwritten across three clusters in the
+   * middle, takes more blocks there without disturbing the clusters after */
+  if (fs_pwrite(fd, random, 2 * CLUSTER_SIZE, CLUSTER_SIZE + 100)
+      != 2 * CLUSTER_SIZE
+      || fs_pread(fd, buffer, 2 * CLUSTER_SIZE, CLUSTER_SIZE + 100)
+      != 2 * CLUSTER_SIZE
+      || memcmp(buffer, random, 2 * CLUSTER_SIZE)
+      || fs_lseek(fd, 3 * CLUSTER_SIZE + 100)
+      || check_test_pattern_at(fd, 3 * CLUSTER_SIZE + 100,
+                               nbytes - 3 * CLUSTER_SIZE - 100)) {
+    fprintf(stderr, "test_compress: Overwrite failed.\n");
+    return -1;
+  }
+
+  /* Truncating to the middle of a cluster keeps the part before the cut,
+   * and the file grows again from there */
+  if (fs_truncate(fd, cut)
+      || fs_get_filesize(fd) != cut
+      || fs_lseek(fd, 3 * CLUSTER_SIZE + 100)
+      || check_test_pattern_at(fd, 3 * CLUSTER_SIZE + 100,
+                               cut - 3 * CLUSTER_SIZE - 100)
+      || write_test_pattern_at(fd, cut, nbytes - cut)
+      || fs_fallocate(fd, 2 * nbytes) != -1
+      || fs_set_compressed(fd, 0) != -1
+      || fs_close(fd)) {
+    fprintf(stderr, "test_compress: Truncate failed.\n");
+    return -1;
+  }
+
+  /* Incompressible data is stored as is, even when it starts like a
+   * compressed cluster does */
+  if (fs_create(noise)
+      || (fd = fs_open(noise)) == -1
+      || fs_set_compressed(fd, 1)
+      || fs_write(fd, random, 3 * CLUSTER_SIZE) != 3 * CLUSTER_SIZE
+      || fs_close(fd)) {
+    fprintf(stderr, "test_compress: Incompressible write failed.\n");
+    return -1;
+  }
+
+  /* Everything survives a re-mount, and every block is given back on
+   * delete */
+  if (umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)
+      || (fd = fs_open(fname)) == -1
+      || fs_pread(fd, buffer, 2 * CLUSTER_SIZE, CLUSTER_SIZE + 100)
+      != 2 * CLUSTER_SIZE
+      || memcmp(buffer, random, 2 * CLUSTER_SIZE)
+      || fs_lseek(fd, 3 * CLUSTER_SIZE + 100)
+      || check_test_pattern_at(fd, 3 * CLUSTER_SIZE + 100,
+                               nbytes - 3 * CLUSTER_SIZE - 100)
+      || fs_close(fd)
+      || (fd = fs_open(noise)) == -1
+      || fs_read(fd, buffer, 3 * CLUSTER_SIZE) != 3 * CLUSTER_SIZE
+      || memcmp(buffer, random, 3 * CLUSTER_SIZE)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || fs_delete(noise)
+      || fs_get_free_blocks() != free_start
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_compress: Re-mount or delete failed.\n");
+    return -1;
+  }
+
+  free(buffer);
+  free(random);
+  return 0;
+}
+
+int test_dedup() {
+  char* fname = "test_file_28";
+  char* copy = "test_file_29";
+  char* third = "test_file_30";
+  char* repeat = "test_file_33";
+
+  int fd = 0;
+  int nblocks = 16;
+  size_t nbytes = (size_t) nblocks * BLOCK_SIZE;
+  char* data = malloc(nbytes);
+  char* buffer = malloc(nbytes);
+  char patch[100];
+  fs_stats stats;
+
+  /* Every fourth block is zeros, and the others hold one of three random
+   * blocks, so the file has three distinct blocks in it */
+  int b, i;
+  for (b = 0; b < nblocks; b++) {
+    unsigned int seed = b % 3 + 1;
+    for (i = 0; i < BLOCK_SIZE; i++) {
+      data[b * BLOCK_SIZE + i] = b % 4 == 3 ? 0 : rand_r(&seed);
+    }
+  }
+
+  if (mount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_dedup: Failed to mount.\n");
+    return -1;
+  }
+  int free_start = fs_get_free_blocks();
+
+  /* Two files with the same contents store three blocks between them, and
+   * every other block written is a hit */
+  fs_set_dedup(1);
+  fs_reset_stats();
+  if (fs_create(fname)
+      || (fd = fs_open(fname)) == -1
+      || fs_write(fd, data, nbytes) != nbytes
+      || fs_close(fd)
+      || fs_create(copy)
+      || (fd = fs_open(copy)) == -1
+      || fs_write(fd, data, nbytes) != nbytes
+      || fs_close(fd)
+      || free_start - fs_get_free_blocks() != 3
+      || fs_get_stats(&stats)
+      || stats.dedup_hits != 2 * nblocks - 3) {
+    fprintf(stderr, "test_dedup: Duplicate blocks were stored twice.\n");
+    return -1;
+  }
+
+  /* Fragments are counted between the blocks holding the data, so a file
+   * that is one block over and over is in as many pieces as it has blocks */
+  for (b = 0; b < 4; b++) {
+    memcpy(buffer + b * BLOCK_SIZE, data, BLOCK_SIZE);
+  }
+  if (fs_create(repeat)
+      || (fd = fs_open(repeat)) == -1
+      || fs_write(fd, buffer, 4 * BLOCK_SIZE) != 4 * BLOCK_SIZE
+      || fs_close(fd)
+      || (fd = fs_open(repeat)) == -1
+      || fs_get_fragments(fd) != 4
+      || fs_close(fd)
+      || fs_delete(repeat)
+      || free_start - fs_get_free_blocks() != 3) {
+    fprintf(stderr, "test_dedup: Fragments of a shared block miscounted.\n");
+    return -1;
+  }
+
+  /* Writing into a shared block copies it for that file alone, and writing
+   * into it again rewrites the copy in place */
+  memset(patch, 'x', sizeof(patch));
+  if ((fd = fs_open(copy)) == -1
+      || fs_pwrite(fd, patch, sizeof(patch), BLOCK_SIZE + 10) != sizeof(patch)
+      || free_start - fs_get_free_blocks() != 4
+      || fs_pwrite(fd, patch, 50, BLOCK_SIZE + 60) != 50
+      || free_start - fs_get_free_blocks() != 4
+      || fs_pread(fd, buffer, nbytes, 0) != nbytes
+      || memcmp(buffer, data, BLOCK_SIZE + 10)
+      || memcmp(buffer + BLOCK_SIZE + 10, patch, sizeof(patch))
+      || memcmp(buffer + BLOCK_SIZE + 110, data + BLOCK_SIZE + 110,
+                nbytes - BLOCK_SIZE - 110)) {
+    fprintf(stderr, "test_dedup: Write to a shared block failed.\n");
+    return -1;
+  }
+
+  /* Truncating only frees the block no other file shares */
+  if (fs_truncate(fd, BLOCK_SIZE)
+      || free_start - fs_get_free_blocks() != 3
+      || fs_close(fd)
+      || (fd = fs_open(fname)) == -1
+      || fs_read(fd, buffer, nbytes) != nbytes
+      || memcmp(buffer, data, nbytes)
+      || fs_close(fd)) {
+    fprintf(stderr, "test_dedup: Shared block changed under another file.\n");
+    return -1;
+  }
+
+  /* The index is rebuilt on mount, so a third copy takes no block at all,
+   * and blocks are freed with their last reference */
+  if (umount_fs(DISK_NAME)
+      || mount_fs(DISK_NAME)
+      || fs_create(third)
+      || (fd = fs_open(third)) == -1
+      || fs_write(fd, data, nbytes) != nbytes
+      || fs_close(fd)
+      || free_start - fs_get_free_blocks() != 3
+      || (fd = fs_open(copy)) == -1
+      || fs_read(fd, buffer, nbytes) != BLOCK_SIZE
+      || memcmp(buffer, data, BLOCK_SIZE)
+      || fs_close(fd)
+      || fs_delete(fname)
+      || fs_delete(third)
+      || free_start - fs_get_free_blocks() != 1
+      || fs_delete(copy)
+      || fs_get_free_blocks() != free_start
+      || fs_set_dedup(0)
+      || umount_fs(DISK_NAME)) {
+    fprintf(stderr, "test_dedup: Re-mount or delete failed.\n");
+    return -1;
+  }
+
+  free(data);
+  free(buffer);
+  return 0;
+}
+
+int test_geometry() {
+  char* fname = "test_file_21";
+  char* image = "geometry.fs";
+
+  /* Geometries the format can't hold are refused */
+  if (!make_fs_geometry(image, DEFAULT_DISK_BLOCKS, 3000)
+      || !make_fs_geometry(image, DEFAULT_DISK_BLOCKS, 2 * MAX_BLOCK_SIZE)
+      || !make_fs_geometry(image, DEFAULT_DISK_BLOCKS + 1, DEFAULT_BLOCK_SIZE)
+      || !make_fs_geometry(image, 64, DEFAULT_BLOCK_SIZE)) {
+    fprintf(stderr, "test_geometry: Invalid geometry accepted.\n");
+    return -1;
+  }
+
+  /* A disk too large for 16-bit block pointers, and one with large blocks */
+  struct {
+    int blocks, size, nblocks;
+  } shapes[] = {{65536, 4096, 33000}, {1024, 65536, 200}};
+
+  int s;
+  for (s = 0; s < 2; s++) {
+    int fd = 0;
+    size_t nbytes = (size_t) shapes[s].size * shapes[s].nblocks;
+    size_t tail = nbytes - 2 * shapes[s].size - 100;
+
+    if (make_fs_geometry(image, shapes[s].blocks, shapes[s].size)
+        || mount_fs(image)
+        || BLOCK_SIZE != shapes[s].size
+        || DISK_BLOCKS != shapes[s].blocks) {
+      fprintf(stderr, "test_geometry: Failed to make %d x %d disk.\n",
+              shapes[s].blocks, shapes[s].size);
+      return -1;
+    }
+    int free_start = fs_get_free_blocks();
+
+    if (free_start != DISK_BLOCKS - DATA_START
+        || fs_create(fname)
+        || (fd = fs_open(fname)) == -1
+        || write_test_pattern(fd, nbytes)
+        || fs_get_free_blocks() != free_start - shapes[s].nblocks
+        || fs_close(fd)) {
+      fprintf(stderr, "test_geometry: Write failed.\n");
+      return -1;
+    }
+
+    /* The geometry is read back from the super block, and the chain is
+     * followed to the last blocks of the file */
+    if (umount_fs(image)
+        || make_fs(DISK_NAME)
+        || mount_fs(image)
+        || BLOCK_SIZE != shapes[s].size
+        || DISK_BLOCKS != shapes[s].blocks
+        || fs_get_free_blocks() != free_start - shapes[s].nblocks
+        || (fd = fs_open(fname)) == -1
+        || fs_get_filesize(fd) != nbytes
+        || fs_lseek(fd, tail)
+        || check_test_pattern_at(fd, tail, nbytes - tail)
+        || fs_close(fd)
+        || umount_fs(image)) {
+      fprintf(stderr, "test_geometry: Data lost on re-mount.\n");
+      return -1;
+    }
+
+    printf("  %6d blocks of %5d bytes, %d-block file intact\n",
+           shapes[s].blocks, shapes[s].size, shapes[s].nblocks);
+  }
+
+  /* Leave the test disk in the default geometry */
+  if (unlink(image) || make_fs(DISK_NAME) || BLOCK_SIZE != DEFAULT_BLOCK_SIZE) {
+    fprintf(stderr, "test_geometry: Could not restore default geometry.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+
+  if (test_fs_creation()) {
+    printf("test_fs_creation failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_fs_creation successful.\n");
+  }
+
+  if (test_file_creation()) {
+    printf("test_file_creation failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_file_creation successful.\n");
+  }
+
+  if (test_file_write()) {
+    printf("test_file_write failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_file_write successful.\n");
+  }
+
+  if (test_file_seek_truncate()) {
+    printf("test_file_seek_truncate failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_file_seek_truncate successful.\n");
+  }
+
+  if (test_block_cache()) {
+    printf("test_block_cache failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_block_cache successful.\n");
+  }
+
+  if (test_block_vectors()) {
+    printf("test_block_vectors failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_block_vectors successful.\n");
+  }
+
+  if (test_mmap_backend()) {
+    printf("test_mmap_backend failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_mmap_backend successful.\n");
+  }
+
+  if (test_async_backend()) {
+    printf("test_async_backend failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_async_backend successful.\n");
+  }
+
+  if (test_format_modes()) {
+    printf("test_format_modes failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_format_modes successful.\n");
+  }
+
+  if (test_file_locality()) {
+    printf("test_file_locality failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_file_locality successful.\n");
+  }
+
+  if (test_many_files()) {
+    printf("test_many_files failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_many_files successful.\n");
+  }
+
+  if (test_threads()) {
+    printf("test_threads failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_threads successful.\n");
+  }
+
+  if (test_positional_io()) {
+    printf("test_positional_io failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_positional_io successful.\n");
+  }
+
+  if (test_block_map()) {
+    printf("test_block_map failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_block_map successful.\n");
+  }
+
+  if (test_readahead()) {
+    printf("test_readahead failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_readahead successful.\n");
+  }
+
+  if (test_small_appends()) {
+    printf("test_small_appends failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_small_appends successful.\n");
+  }
+
+  if (test_reclaim()) {
+    printf("test_reclaim failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_reclaim successful.\n");
+  }
+
+  if (test_stats()) {
+    printf("test_stats failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_stats successful.\n");
+  }
+
+  if (test_trace()) {
+    printf("test_trace failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_trace successful.\n");
+  }
+
+  if (test_journal()) {
+    printf("test_journal failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_journal successful.\n");
+  }
+
+  if (test_inline()) {
+    printf("test_inline failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_inline successful.\n");
+  }
+
+  if (test_compress()) {
+    printf("test_compress failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_compress successful.\n");
+  }
+
+  if (test_dedup()) {
+    printf("test_dedup failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_dedup successful.\n");
+  }
+
+  if (test_geometry()) {
+    printf("test_geometry failed.\n");
+    
+    if (env_cleanup()) {
+      return 1;
+    }
+  } else {
+    printf("test_geometry successful.\n");
   }
 
 